@@ -0,0 +1,428 @@
+// Micro-benchmark of the kernels in my_kernels.cl, each one launched on its own over synthetic inputs that stay on the device.
+// Every kernel runs a few untimed warm-up launches first (the first launch pays for the JIT and cold caches), then the
+// timed repetitions, each with its own profiling event. The CL_PROFILING_COMMAND_START/END times are summarised after
+// dropping outliers, and turned into pixels, bytes and atomics per second from what one launch does.
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <functional>
+
+#include "Utils.h"
+#include "Benchmark.h"
+#include "Roofline.h"
+#include "Regression.h"
+#include "Synthetic.h"
+
+void print_help() {
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -p : select platform " << std::endl;
+	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -size : image size, e.g. -size 4096x4096 (default)" << std::endl;
+	std::cerr << "  -bins : number of histogram bins, a power of 2 up to 256 (default: 256)" << std::endl;
+	std::cerr << "  -dist : distribution of the synthetic image, uniform, gaussian[:mean[:deviation]], single[:value], twospike[:a[:b]], gradient or noise (default)" << std::endl;
+	std::cerr << "  -w : untimed warm-up launches per kernel (default: 5)" << std::endl;
+	std::cerr << "  -n : timed repetitions per kernel (default: 50)" << std::endl;
+	std::cerr << "  -k : only run the kernels whose name contains this text" << std::endl;
+	std::cerr << "  -json : also write the results to this file as JSON" << std::endl;
+	std::cerr << "  -roofline : measure the device bandwidth and local atomic rate first, and give each kernel as a percentage of its roofline" << std::endl;
+	std::cerr << "  -baseline : compare the results with this JSON from an earlier run and exit with 2 if any kernel got slower" << std::endl;
+	std::cerr << "  -compare : with -baseline, compare this JSON from an earlier run instead of running the kernels (no device needed)" << std::endl;
+	std::cerr << "  -threshold : the smallest slowdown of the median that can count as a regression, in percent (default: 5)" << std::endl;
+	std::cerr << "  -allow-missing : with -baseline, only list the baseline kernels this run does not have instead of failing on them" << std::endl;
+	std::cerr << "  -any-device : with -baseline, compare with a baseline made on another platform or device (a warning instead of an error)" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+	std::cerr << "A baseline only matches results of the same kernel, size, bins and -dist, made on the same device, e.g. a CPU OpenCL device" << std::endl;
+	std::cerr << "  for local runs, with -json baseline.json on the commit to compare against." << std::endl;
+}
+
+// One kernel launch to time, with what one launch does for the derived rates.
+struct Case {
+	string name;
+	cl::Kernel kernel;
+	cl::NDRange global;
+	cl::NDRange local;
+	double pixels;
+	double bytes; // global memory read and written
+	double written; // of those bytes
+	double atomics;
+	function<void(cl::CommandQueue&)> reset; // untimed, before every launch, e.g. clearing the histogram it adds to
+};
+
+size_t RoundUp(size_t value, size_t multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+int main(int argc, char **argv) {
+	int platform_id = 0;
+	int device_id = 0;
+	int width = 4096, height = 4096;
+	int bins = 256;
+	int warmup = 5;
+	int repetitions = 50;
+	string filter = "";
+	string distribution = "noise";
+	string json_filename = "";
+	bool roofline = false;
+	string baseline_filename = "";
+	string compare_filename = "";
+	bool any_device = false;
+	RegressionLimits limits;
+
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+		else if ((strcmp(argv[i], "-size") == 0) && (i < (argc - 1))) { sscanf(argv[++i], "%dx%d", &width, &height); }
+		else if ((strcmp(argv[i], "-bins") == 0) && (i < (argc - 1))) { bins = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-dist") == 0) && (i < (argc - 1))) { distribution = argv[++i]; }
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { warmup = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) { repetitions = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { filter = argv[++i]; }
+		else if ((strcmp(argv[i], "-json") == 0) && (i < (argc - 1))) { json_filename = argv[++i]; }
+		else if (strcmp(argv[i], "-roofline") == 0) { roofline = true; }
+		else if ((strcmp(argv[i], "-baseline") == 0) && (i < (argc - 1))) { baseline_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-compare") == 0) && (i < (argc - 1))) { compare_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-threshold") == 0) && (i < (argc - 1))) { limits.threshold = atof(argv[++i]) / 100; }
+		else if (strcmp(argv[i], "-allow-missing") == 0) { limits.allowMissing = true; }
+		else if (strcmp(argv[i], "-any-device") == 0) { any_device = true; }
+		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+	}
+
+	// Prints how every kernel moved from the baseline and gives the exit code, 2 when any of them regressed or went missing.
+	// device is "<platform>, <device>" of the results. Timings from another device say nothing about this one, so a baseline
+	// from another device is refused unless -any-device is given. With -k only the baseline kernels it picks are expected.
+	auto gate = [&](const vector<BenchmarkResult>& results, const string& device) {
+		string baselineDevice;
+		vector<BenchmarkResult> baseline;
+		for (const BenchmarkResult& result : ReadResults(baseline_filename, &baselineDevice)) {
+			if (result.kernel.find(filter) != string::npos) {
+				baseline.push_back(result);
+			}
+		}
+		if (baselineDevice != device) {
+			string mismatch = baseline_filename + " was made on " + (baselineDevice.empty() ? "an unknown device" : baselineDevice) + ", not on " + device;
+			if (!any_device) {
+				throw runtime_error(mismatch + " (-any-device compares anyway)");
+			}
+			std::cout << "Warning: " << mismatch << std::endl;
+		}
+		vector<Comparison> comparisons = Compare(baseline, results, limits);
+		std::cout << std::endl << "Compared with " << baseline_filename << ":" << std::endl;
+		PrintComparisons(std::cout, comparisons);
+		int regressions = Regressions(comparisons);
+		if (regressions > 0) {
+			std::cout << regressions << " kernel(s) regressed or missing" << std::endl;
+			return 2;
+		}
+		std::cout << "No regressions" << std::endl;
+		return 0;
+	};
+
+	try {
+		if (!compare_filename.empty()) {
+			if (baseline_filename.empty()) {
+				throw runtime_error("-compare needs a -baseline");
+			}
+			string device;
+			vector<BenchmarkResult> results = ReadResults(compare_filename, &device);
+			return gate(results, device);
+		}
+		if (width <= 0 || height <= 0 || bins < 2 || bins > 256 || (bins & (bins - 1)) != 0 || repetitions < 1 || warmup < 0) {
+			throw runtime_error("bad -size, -bins, -w or -n");
+		}
+		cl::Context context = GetContext(platform_id, device_id);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+
+		cl::Program::Sources sources;
+		AddSources(sources, "kernels/my_kernels.cl");
+		cl::Program program(context, sources);
+		try {
+			program.build();
+		}
+		catch (const cl::Error& err) {
+			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+			throw err;
+		}
+
+		// Synthetic inputs, made once on the host and kept on the device for every launch
+		size_t plane = (size_t)width * height;
+		size_t histogramSize = bins * sizeof(int);
+		int computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+		// A colour image, whose first plane is also the grey one. The distribution decides how hard the histograms are hit.
+		SyntheticImage synthetic(distribution, width, height, 3, 19704410);
+		vector<unsigned char> pixels(3 * plane);
+		synthetic.Fill(pixels.data(), 0, pixels.size(), (int)thread::hardware_concurrency());
+		// The tables the later stages take, worked out on the host from the grey image so they hold realistic values
+		vector<int> binvals(bins), counts(256, 0), histogram(bins, 0), cumulative(bins), table(bins), reference(256), identityTable(256);
+		for (int i = 0; i < bins; i++) {
+			binvals[i] = i * (256 / bins); // the first intensity of every bin, as the application uploads it
+		}
+		for (size_t i = 0; i < plane; i++) {
+			counts[pixels[i]]++;
+			histogram[pixels[i] / (256 / bins)]++;
+		}
+		for (int i = 0; i < bins; i++) {
+			cumulative[i] = histogram[i] + (i ? cumulative[i - 1] : 0);
+		}
+		for (int i = 0; i < bins; i++) {
+			table[i] = (int)((long long)cumulative[i] * 255 / cumulative[bins - 1]); // needs the whole scan, for the total
+		}
+		for (int i = 0; i < 256; i++) {
+			reference[i] = (i + 1) * 100; // a flat reference for match
+			identityTable[i] = i;
+		}
+		vector<int> cumulative3, table3;
+		for (int c = 0; c < 3; c++) {
+			cumulative3.insert(cumulative3.end(), cumulative.begin(), cumulative.end());
+			table3.insert(table3.end(), table.begin(), table.end());
+		}
+		int levels[2] = { 10, 245 };
+
+		auto input = [&](size_t size, const void* data) {
+			return cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, (void*)data);
+		};
+		cl::Buffer greyBuffer = input(plane, pixels.data());
+		cl::Buffer colourBuffer = input(3 * plane, pixels.data());
+		vector<unsigned char> ones(plane, 1);
+		cl::Buffer maskBuffer = input(plane, ones.data());
+		cl::Buffer outputBuffer(context, CL_MEM_READ_WRITE, 3 * plane);
+		cl::Buffer binsizeBuffer = input(histogramSize, binvals.data());
+		cl::Buffer countsBuffer = input(256 * sizeof(int), counts.data());
+		cl::Buffer histogramBuffer = input(histogramSize, histogram.data());
+		cl::Buffer cumulativeBuffer = input(3 * histogramSize, cumulative3.data());
+		cl::Buffer tableBuffer = input(3 * histogramSize, table3.data());
+		cl::Buffer referenceBuffer = input(256 * sizeof(int), reference.data());
+		cl::Buffer identityBuffer = input(256 * sizeof(int), identityTable.data());
+		cl::Buffer levelsBuffer = input(sizeof(levels), levels);
+		cl::Buffer countedBuffer(context, CL_MEM_READ_WRITE, 3 * histogramSize); // what the counting kernels add to
+		cl::Buffer scanBuffer(context, CL_MEM_READ_WRITE, 3 * histogramSize); // what the scans and table kernels write
+		cl::Buffer percentileBuffer(context, CL_MEM_READ_WRITE, 2 * sizeof(int));
+
+		auto clearCounted = [&](cl::CommandQueue& q) {
+			q.enqueueFillBuffer(countedBuffer, 0, 0, 3 * histogramSize);
+		};
+		size_t grid = RoundUp(plane, bins); // one work-item per pixel, in whole work-groups of bins
+		int groups = (int)(grid / bins);
+		cl::Buffer partialsBuffer(context, CL_MEM_READ_WRITE, groups * histogramSize);
+		int blocks = (int)ceil(sqrt((double)groups)); // rows of the app's first reduce_partials pass
+		cl::Buffer blocksBuffer(context, CL_MEM_READ_WRITE, blocks * histogramSize);
+		size_t persistent = computeUnits * 4 * bins; // a few work-groups per compute unit
+		cl::NDRange grid2d(RoundUp(width, 16), RoundUp(height, 16));
+		cl::Buffer hashBuffer(context, CL_MEM_READ_WRITE, computeUnits * 4 * sizeof(cl_ulong));
+		cl::Buffer blellochBuffer(context, CL_MEM_READ_WRITE, histogramSize);
+
+		vector<Case> cases;
+		// Adds a case unless it is filtered out or its kernel was not built for this device (fp64, sub-groups)
+		auto add = [&](const string& name, cl::NDRange global, cl::NDRange local, double pixels, double bytes, double written, double atomics,
+			function<void(cl::Kernel&)> args, function<void(cl::CommandQueue&)> reset = NULL) {
+			if (!filter.empty() && name.find(filter) == string::npos) {
+				return;
+			}
+			try {
+				cl::Kernel kernel(program, name.c_str());
+				args(kernel);
+				cases.push_back(Case{ name, kernel, global, local, pixels, bytes, written, atomics, reset });
+			}
+			catch (const cl::Error&) {
+				std::cout << name << " skipped, not built for this device" << std::endl;
+			}
+		};
+		double N = (double)plane;
+		double tableBytes = 2.0 * histogramSize;
+
+		add("identity", cl::NDRange(plane), cl::NullRange, N, 2 * N, N, 0, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, outputBuffer);
+		});
+		for (const char* name : { "rgb2grey", "rgb2grey_fixed" }) {
+			add(name, cl::NDRange(3 * plane), cl::NullRange, N, 6 * N, 3 * N, 0, [&](cl::Kernel& k) {
+				k.setArg(0, colourBuffer); k.setArg(1, outputBuffer);
+			});
+		}
+		add("histogram", cl::NDRange(plane), cl::NullRange, N, N, 0, 0, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, countedBuffer); k.setArg(2, bins); k.setArg(3, (int)plane); k.setArg(4, binsizeBuffer);
+		}, clearCounted);
+		for (const char* name : { "local_global", "local_global_subgroup" }) {
+			add(name, cl::NDRange(grid), cl::NDRange(bins), N, N, 0, N, [&](cl::Kernel& k) {
+				k.setArg(0, greyBuffer); k.setArg(1, countedBuffer); k.setArg(2, cl::Local(histogramSize)); k.setArg(3, (int)plane); k.setArg(4, bins); k.setArg(5, binsizeBuffer);
+			}, clearCounted);
+		}
+		add("rgb_histogram", cl::NDRange(grid), cl::NDRange(bins), N, 3 * N, 0, 3 * N, [&](cl::Kernel& k) {
+			k.setArg(0, colourBuffer); k.setArg(1, countedBuffer); k.setArg(2, cl::Local(3 * histogramSize)); k.setArg(3, (int)plane); k.setArg(4, bins); k.setArg(5, binsizeBuffer);
+		}, clearCounted);
+		add("local_partials", cl::NDRange(grid), cl::NDRange(bins), N, N + groups * histogramSize, groups * histogramSize, N, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, partialsBuffer); k.setArg(2, cl::Local(histogramSize)); k.setArg(3, (int)plane); k.setArg(4, bins); k.setArg(5, binsizeBuffer);
+		});
+		// The first of the two reduce_partials passes, the second one adds only blocks rows
+		add("reduce_partials", cl::NDRange(bins, blocks), cl::NullRange, 0, ((double)groups + blocks) * histogramSize, blocks * histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, partialsBuffer); k.setArg(1, blocksBuffer); k.setArg(2, groups); k.setArg(3, bins);
+		});
+		add("local_global_packed", cl::NDRange(persistent), cl::NDRange(bins), N, N, 0, N, [&](cl::Kernel& k) {
+			int replicas = 4;
+			k.setArg(0, greyBuffer); k.setArg(1, countedBuffer); k.setArg(2, cl::Local(replicas * ((bins + 1) / 2) * sizeof(cl_uint)));
+			k.setArg(3, (int)plane); k.setArg(4, bins); k.setArg(5, binsizeBuffer); k.setArg(6, replicas);
+		}, clearCounted);
+		add("local_global_persistent", cl::NDRange(persistent), cl::NDRange(bins), N, N, 0, N, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, countedBuffer); k.setArg(2, cl::Local(histogramSize)); k.setArg(3, cl::Local(256 * sizeof(int)));
+			k.setArg(4, (int)plane); k.setArg(5, bins); k.setArg(6, binsizeBuffer);
+		}, clearCounted);
+		add("roi_histogram", grid2d, cl::NDRange(16, 16), N, N, 0, N, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, countedBuffer); k.setArg(2, cl::Local(histogramSize)); k.setArg(3, width); k.setArg(4, (int)plane); k.setArg(5, 1);
+			k.setArg(6, 0); k.setArg(7, 0); k.setArg(8, width); k.setArg(9, height); k.setArg(10, bins); k.setArg(11, binsizeBuffer);
+		}, clearCounted);
+		add("masked_histogram", cl::NDRange(persistent), cl::NDRange(bins), N, 2 * N, 0, N, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, maskBuffer); k.setArg(2, countedBuffer); k.setArg(3, cl::Local(histogramSize));
+			k.setArg(4, (int)plane); k.setArg(5, (int)plane); k.setArg(6, bins); k.setArg(7, binsizeBuffer);
+		}, clearCounted);
+		add("view_histogram", grid2d, cl::NDRange(16, 16), N, N, 0, N, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, countedBuffer); k.setArg(2, cl::Local(histogramSize)); k.setArg(3, width); k.setArg(4, height);
+			k.setArg(5, (cl_ulong)width); k.setArg(6, (cl_ulong)1); k.setArg(7, (cl_ulong)plane); k.setArg(8, 1); k.setArg(9, bins); k.setArg(10, binsizeBuffer);
+		}, clearCounted);
+		add("hash_blocks", cl::NDRange(computeUnits * 4 * 256), cl::NDRange(256), N, N, 0, 0, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, hashBuffer); k.setArg(2, cl::Local(256 * sizeof(cl_ulong))); k.setArg(3, (cl_ulong)plane);
+		});
+		add("coarsen", cl::NDRange(bins), cl::NullRange, 0, 256 * sizeof(int) + histogramSize, histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, countsBuffer); k.setArg(1, scanBuffer); k.setArg(2, bins); k.setArg(3, binsizeBuffer);
+		});
+		add("clip_histogram", cl::NDRange(bins), cl::NDRange(bins), 0, tableBytes, histogramSize, bins, [&](cl::Kernel& k) {
+			k.setArg(0, histogramBuffer); k.setArg(1, scanBuffer); k.setArg(2, cl::Local(sizeof(int))); k.setArg(3, bins); k.setArg(4, max(1, (int)(2 * plane / bins)));
+		});
+		add("cumulativeHistogram", cl::NDRange(bins), cl::NDRange(bins), 0, tableBytes, histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, histogramBuffer); k.setArg(1, scanBuffer); k.setArg(2, cl::Local(histogramSize)); k.setArg(3, cl::Local(histogramSize));
+		});
+		// blellochCumulative scans its input in place, so it gets a fresh copy of the histogram every time
+		add("blellochCumulative", cl::NDRange(bins), cl::NDRange(bins), 0, tableBytes, histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, blellochBuffer); k.setArg(1, scanBuffer);
+		}, [&](cl::CommandQueue& q) {
+			q.enqueueCopyBuffer(histogramBuffer, blellochBuffer, 0, 0, histogramSize);
+		});
+		for (const char* name : { "normalise", "normalise_fixed" }) {
+			add(name, cl::NDRange(bins), cl::NullRange, 0, tableBytes, histogramSize, 0, [&](cl::Kernel& k) {
+				k.setArg(0, cumulativeBuffer); k.setArg(1, scanBuffer); k.setArg(2, bins);
+			});
+		}
+		add("normalise_channels", cl::NDRange(3 * bins), cl::NullRange, 0, 3 * tableBytes, 3 * histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, cumulativeBuffer); k.setArg(1, scanBuffer); k.setArg(2, bins);
+		});
+		add("match", cl::NDRange(bins), cl::NullRange, 0, tableBytes + 256 * sizeof(int), histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, cumulativeBuffer); k.setArg(1, referenceBuffer); k.setArg(2, scanBuffer); k.setArg(3, bins);
+		});
+		add("percentiles", cl::NDRange(bins), cl::NullRange, 0, histogramSize, 2 * sizeof(int), 0, [&](cl::Kernel& k) {
+			k.setArg(0, cumulativeBuffer); k.setArg(1, percentileBuffer); k.setArg(2, bins); k.setArg(3, 100); k.setArg(4, 9900); k.setArg(5, binsizeBuffer);
+		});
+		add("stretch", cl::NDRange(bins), cl::NullRange, 0, histogramSize, histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, levelsBuffer); k.setArg(1, scanBuffer); k.setArg(2, bins); k.setArg(3, binsizeBuffer);
+		});
+		// compose maps the table through the identity, so it can run on the same buffer any number of times
+		add("compose", cl::NDRange(bins), cl::NullRange, 0, tableBytes, histogramSize, 0, [&](cl::Kernel& k) {
+			k.setArg(0, tableBuffer); k.setArg(1, identityBuffer); k.setArg(2, bins);
+		});
+		add("lookup", cl::NDRange(plane), cl::NullRange, N, 2 * N, N, 0, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, tableBuffer); k.setArg(2, outputBuffer); k.setArg(3, bins); k.setArg(4, binsizeBuffer);
+		});
+		add("lookup_channels", cl::NDRange(3 * plane), cl::NullRange, N, 6 * N, 3 * N, 0, [&](cl::Kernel& k) {
+			k.setArg(0, colourBuffer); k.setArg(1, tableBuffer); k.setArg(2, outputBuffer); k.setArg(3, (int)plane); k.setArg(4, bins); k.setArg(5, binsizeBuffer);
+		});
+		add("lookup_roi", grid2d, cl::NDRange(16, 16), N, 2 * N, N, 0, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, tableBuffer); k.setArg(2, outputBuffer); k.setArg(3, width); k.setArg(4, (int)plane); k.setArg(5, 1);
+			k.setArg(6, 0); k.setArg(7, 0); k.setArg(8, width); k.setArg(9, height); k.setArg(10, bins); k.setArg(11, binsizeBuffer);
+		});
+		add("lookup_masked", cl::NDRange(plane), cl::NullRange, N, 3 * N, N, 0, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, maskBuffer); k.setArg(2, tableBuffer); k.setArg(3, outputBuffer); k.setArg(4, (int)plane); k.setArg(5, bins); k.setArg(6, binsizeBuffer);
+		});
+		add("view_lookup", grid2d, cl::NullRange, N, 2 * N, N, 0, [&](cl::Kernel& k) {
+			k.setArg(0, greyBuffer); k.setArg(1, tableBuffer); k.setArg(2, outputBuffer); k.setArg(3, width); k.setArg(4, height);
+			k.setArg(5, (cl_ulong)width); k.setArg(6, (cl_ulong)1); k.setArg(7, (cl_ulong)plane); k.setArg(8, (cl_ulong)width); k.setArg(9, (cl_ulong)1); k.setArg(10, (cl_ulong)plane);
+			k.setArg(11, 1); k.setArg(12, bins); k.setArg(13, binsizeBuffer);
+		});
+
+		Roofline roof;
+		vector<pair<string, double>> calibration;
+		if (roofline) {
+			roof.Calibrate(context, program);
+			calibration = { { "copy_bytes_per_s", roof.copyBandwidth }, { "read_bytes_per_s", roof.readBandwidth },
+				{ "write_bytes_per_s", roof.writeBandwidth }, { "local_atomics_per_s", roof.localAtomics } };
+			std::cout << fixed << setprecision(2) << "Roofline: copy " << roof.copyBandwidth * 1e-9 << " GB/s, read " << roof.readBandwidth * 1e-9
+				<< " GB/s, write " << roof.writeBandwidth * 1e-9 << " GB/s, local atomics " << roof.localAtomics * 1e-9 << " G/s" << std::endl;
+		}
+
+		vector<BenchmarkResult> results;
+		std::cout << left << setw(26) << "kernel" << right << setw(12) << "median us" << setw(12) << "min us" << setw(12) << "p95 us"
+			<< setw(12) << "stddev us" << setw(6) << "out" << setw(12) << "Gpixel/s" << setw(12) << "GB/s" << setw(12) << "Gatomic/s";
+		if (roof.Calibrated()) {
+			std::cout << setw(9) << "roof %" << "  limit";
+		}
+		std::cout << std::endl;
+		for (Case& c : cases) {
+			for (int w = 0; w < warmup; w++) {
+				if (c.reset) {
+					c.reset(queue);
+				}
+				queue.enqueueNDRangeKernel(c.kernel, cl::NullRange, c.global, c.local);
+			}
+			queue.finish();
+
+			vector<cl::Event> events(repetitions);
+			for (int r = 0; r < repetitions; r++) {
+				if (c.reset) {
+					c.reset(queue);
+				}
+				queue.enqueueNDRangeKernel(c.kernel, cl::NullRange, c.global, c.local, NULL, &events[r]);
+			}
+			queue.finish();
+
+			vector<double> samples;
+			for (cl::Event& event : events) {
+				samples.push_back((double)(event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()));
+			}
+			BenchmarkResult result;
+			result.kernel = c.name;
+			result.width = width;
+			result.height = height;
+			result.bins = bins;
+			result.distribution = distribution;
+			result.pixels = c.pixels;
+			result.bytes = c.bytes;
+			result.written = c.written;
+			result.atomics = c.atomics;
+			result.ns = Summarise(samples);
+			if (roof.Calibrated()) {
+				result.rooflinePercent = roof.Percent(c.bytes, c.written, c.atomics, result.ns.median);
+			}
+			results.push_back(result);
+
+			double seconds = result.ns.median * 1e-9;
+			std::cout << left << setw(26) << c.name << right << fixed << setprecision(2)
+				<< setw(12) << result.ns.median / 1000 << setw(12) << result.ns.min / 1000 << setw(12) << result.ns.p95 / 1000
+				<< setw(12) << result.ns.stddev / 1000 << setw(6) << result.ns.rejected
+				<< setw(12) << c.pixels / seconds * 1e-9 << setw(12) << c.bytes / seconds * 1e-9 << setw(12) << c.atomics / seconds * 1e-9;
+			if (roof.Calibrated()) {
+				std::cout << setw(9) << result.rooflinePercent << "  " << roof.Limit(c.bytes, c.written, c.atomics);
+			}
+			std::cout << std::endl;
+		}
+
+		if (!json_filename.empty()) {
+			ofstream json(json_filename);
+			WriteJson(json, GetPlatformName(platform_id), GetDeviceName(platform_id, device_id), warmup, repetitions, results, calibration);
+			std::cout << "Results written to " << json_filename << std::endl;
+		}
+		if (!baseline_filename.empty()) {
+			return gate(results, GetPlatformName(platform_id) + ", " + GetDeviceName(platform_id, device_id));
+		}
+	}
+	catch (const cl::Error& err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		return 1;
+	}
+	catch (const exception& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+// The C interface of histeq.h, a thin layer over Equaliser that turns exceptions into error codes.
+// Submitted images are queued to one worker thread per handle, so they run in order and the caller never blocks.
+// histeq_equalise goes through the same queue and waits for its own job, so only the worker ever uses the Equaliser.
+
+#ifndef HISTEQ_EXPORTS
+#define HISTEQ_EXPORTS
+#endif
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+
+#include "histeq.h"
+#include "Equaliser.h"
+
+struct histeq_equaliser {
+	cl::Context context;
+	cl::Program program;
+	Equaliser* equaliser = NULL;
+	int bins = 256;
+	string error;
+
+	// Submitted work, run by worker
+	struct Job {
+		ImageView input;
+		ImageView output;
+		histeq_callback callback;
+		void* user;
+		bool waited; // a histeq_equalise job, its error goes back to its caller instead of to histeq_wait
+	};
+	deque<Job> jobs;
+	mutable mutex lock; // guards everything below and error
+	condition_variable changed;
+	thread worker;
+	int pending = 0; // queued or running jobs
+	long long submitted = 0; // jobs ever queued, the number of a job is the count when it was queued
+	long long finished = 0; // jobs ever finished, they finish in the order they were queued
+	int firstError = 0; // of the submitted jobs since the last histeq_wait
+	bool stopping = false;
+};
+
+namespace {
+
+// Checks that the strides describe rows and planes that do not overlap, as the kernels (and zero copy, which wraps
+// the whole span of the view) rely on it.
+ImageView ToView(const histeq_view* view) {
+	if (view == NULL || view->data == NULL || view->width <= 0 || view->height <= 0 || view->channels <= 0) {
+		throw runtime_error("invalid view: no data, or a size or channel count below 1");
+	}
+	if (view->layout != HISTEQ_PLANAR && view->layout != HISTEQ_INTERLEAVED) {
+		throw runtime_error("invalid view: layout is neither HISTEQ_PLANAR nor HISTEQ_INTERLEAVED");
+	}
+	bool interleaved = view->layout == HISTEQ_INTERLEAVED;
+	size_t row = (size_t)view->width * (interleaved ? view->channels : 1);
+	if (view->row_pitch < row || view->row_pitch > SIZE_MAX / view->height) {
+		throw runtime_error("invalid view: row_pitch is smaller than a row of pixels");
+	}
+	if (interleaved && view->channel_stride != 1) {
+		throw runtime_error("invalid view: channel_stride of an interleaved view is not 1");
+	}
+	size_t plane = view->row_pitch * (view->height - 1) + row;
+	if (!interleaved && view->channels > 1 && (view->channel_stride < plane || view->channel_stride > SIZE_MAX / view->channels)) {
+		throw runtime_error("invalid view: channel_stride is smaller than a plane, the planes overlap");
+	}
+	return ImageView{ view->data, view->width, view->height, view->channels, view->row_pitch, view->channel_stride,
+		interleaved ? ImageView::INTERLEAVED : ImageView::PLANAR };
+}
+
+// The last histeq_create failure of this thread, there is no handle to keep it on
+thread_local string createError;
+
+// Runs work, returning 0 or the error code and keeping the message on the handle.
+template <typename Work>
+int Guard(histeq_equaliser* handle, Work work) {
+	try {
+		work();
+		return 0;
+	}
+	catch (const cl::Error& err) {
+		lock_guard<mutex> guard(handle->lock);
+		handle->error = string(err.what()) + ", " + getErrorString(err.err());
+		return err.err() < 0 ? err.err() : -1;
+	}
+	catch (const exception& err) {
+		lock_guard<mutex> guard(handle->lock);
+		handle->error = err.what();
+		return -1;
+	}
+}
+
+void Work(histeq_equaliser* handle) {
+	unique_lock<mutex> guard(handle->lock);
+	while (true) {
+		handle->changed.wait(guard, [handle]() { return handle->stopping || !handle->jobs.empty(); });
+		if (handle->jobs.empty()) {
+			return;
+		}
+		histeq_equaliser::Job job = handle->jobs.front();
+		handle->jobs.pop_front();
+		guard.unlock();
+
+		vector<int> lut;
+		int status = Guard(handle, [&]() { lut = handle->equaliser->Equalise(job.input, job.output); });
+		if (job.callback != NULL) {
+			job.callback(status, status == 0 ? &lut[0] : NULL, handle->bins, job.user);
+		}
+
+		guard.lock();
+		if (status != 0 && handle->firstError == 0 && !job.waited) {
+			handle->firstError = status;
+		}
+		handle->pending--;
+		handle->finished++;
+		handle->changed.notify_all();
+	}
+}
+
+}
+
+histeq_equaliser* histeq_create(int platform_id, int device_id, const char* kernel_file, int bins, int zero_copy) {
+	if (bins < 1 || bins > 256 || (bins & (bins - 1)) != 0) {
+		createError = "bins must be 256 or a smaller power of 2";
+		return NULL;
+	}
+	histeq_equaliser* handle = new histeq_equaliser();
+	int status = Guard(handle, [&]() {
+		handle->context = GetContext(platform_id, device_id);
+		if (handle->context() == NULL) {
+			throw runtime_error("no device " + to_string(device_id) + " on platform " + to_string(platform_id));
+		}
+		string file = kernel_file != NULL ? kernel_file : "kernels/my_kernels.cl";
+		if (!ifstream(file)) {
+			throw runtime_error("could not read the kernels from " + file);
+		}
+		cl::Program::Sources sources;
+		AddSources(sources, file);
+		handle->program = cl::Program(handle->context, sources);
+		try {
+			handle->program.build();
+		}
+		catch (const cl::Error& err) {
+			cl::Device device = handle->context.getInfo<CL_CONTEXT_DEVICES>()[0];
+			throw runtime_error(string(err.what()) + ", " + getErrorString(err.err()) + ", build log:\n" + handle->program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device));
+		}
+		handle->equaliser = new Equaliser(handle->context, handle->program, bins);
+		handle->equaliser->SetZeroCopy(zero_copy != 0);
+	});
+	if (status != 0) {
+		createError = handle->error;
+		delete handle->equaliser;
+		delete handle;
+		return NULL;
+	}
+	handle->bins = bins;
+	handle->worker = thread(Work, handle);
+	return handle;
+}
+
+void histeq_destroy(histeq_equaliser* equaliser) {
+	if (equaliser == NULL) {
+		return;
+	}
+	{
+		lock_guard<mutex> guard(equaliser->lock);
+		equaliser->stopping = true;
+	}
+	equaliser->changed.notify_all();
+	equaliser->worker.join();
+	delete equaliser->equaliser;
+	delete equaliser;
+}
+
+namespace {
+
+// Queues a job for the worker and gives its number.
+long long Queue(histeq_equaliser* equaliser, const histeq_equaliser::Job& job) {
+	long long number;
+	{
+		lock_guard<mutex> guard(equaliser->lock);
+		equaliser->jobs.push_back(job);
+		equaliser->pending++;
+		number = ++equaliser->submitted;
+	}
+	equaliser->changed.notify_all();
+	return number;
+}
+
+// Where the worker leaves the result of a histeq_equalise job
+struct Result {
+	int status;
+	int* lut;
+};
+
+void Finished(int status, const int* lut, int bins, void* user) {
+	Result* result = (Result*)user;
+	result->status = status;
+	if (status == 0 && result->lut != NULL) {
+		copy(lut, lut + bins, result->lut);
+	}
+}
+
+}
+
+int histeq_equalise(histeq_equaliser* equaliser, const histeq_view* input, const histeq_view* output, int* lut) {
+	// Runs on the worker behind anything already submitted, so the Equaliser and its device queue are only used by one
+	// thread at a time however many threads call in. The worker writes result before it takes the lock to count the job
+	// finished, so it is complete once the count is seen here.
+	Result result = { 0, lut };
+	histeq_equaliser::Job job;
+	int status = Guard(equaliser, [&]() { job = histeq_equaliser::Job{ ToView(input), ToView(output), Finished, &result, true }; });
+	if (status != 0) {
+		return status;
+	}
+	long long number = Queue(equaliser, job);
+	unique_lock<mutex> guard(equaliser->lock);
+	equaliser->changed.wait(guard, [equaliser, number]() { return equaliser->finished >= number; });
+	return result.status;
+}
+
+int histeq_submit(histeq_equaliser* equaliser, const histeq_view* input, const histeq_view* output, histeq_callback callback, void* user) {
+	histeq_equaliser::Job job;
+	int status = Guard(equaliser, [&]() { job = histeq_equaliser::Job{ ToView(input), ToView(output), callback, user, false }; });
+	if (status != 0) {
+		return status;
+	}
+	Queue(equaliser, job);
+	return 0;
+}
+
+int histeq_wait(histeq_equaliser* equaliser) {
+	unique_lock<mutex> guard(equaliser->lock);
+	equaliser->changed.wait(guard, [equaliser]() { return equaliser->pending == 0; });
+	int status = equaliser->firstError;
+	equaliser->firstError = 0;
+	return status;
+}
+
+const char* histeq_last_error(const histeq_equaliser* equaliser) {
+	if (equaliser == NULL) {
+		return createError.c_str();
+	}
+	// The worker can replace the message at any time, so each calling thread gets its own copy, taken under the lock.
+	thread_local string message;
+	lock_guard<mutex> guard(equaliser->lock);
+	message = equaliser->error;
+	return message.c_str();
+}
@@ -12,9 +12,21 @@
 
 #include <iostream>
 #include <vector>
+#include <chrono>
+#include <functional>
+#include <filesystem>
 
 #include "Utils.h"
 #include "CImg.h"
+#include "PointOps.h"
+#include "SlidingAHE.h"
+#include "Equaliser.h"
+#include "AsyncEqualiser.h"
+#include "Roofline.h"
+#include "Synthetic.h"
+#ifdef __cpp_impl_coroutine
+#include "CoroutineBatch.h"
+#endif
 
 using namespace cimg_library;
 
@@ -25,7 +37,623 @@ void print_help() {
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
 	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -m : histogram method, auto, atomic, subgroup, partials, packed or persistent (default: auto, subgroup when the device compiler builds the sub-group kernel, otherwise atomic)" << std::endl;
+	std::cerr << "  -r : reference image or .cdf file to match the histogram to, instead of equalising" << std::endl;
+	std::cerr << "  -j : joint equalisation of a comma separated list of images, or the slices of one 3D volume (a .cimg volume is read and written a slice at a time), with one shared histogram and the -m histogram method" << std::endl;
+	std::cerr << "  -b : batch equalisation of a comma separated list of images and/or directories (their image files, without earlier _equalised outputs), each image on its own" << std::endl;
+	std::cerr << "  -cache : in batch mode, cache lookup tables of repeated images, up to the given number of MB" << std::endl;
+	std::cerr << "  -cache-outputs : also cache the output images, so a repeated image is just a copy" << std::endl;
+	std::cerr << "  -async : in batch mode, keep up to the given number of images on the device at once with asynchronous submission (no cache)" << std::endl;
+	std::cerr << "  -co : in batch mode, run the given number of coroutine jobs over binary PGM/PPM images (needs a C++20 build)" << std::endl;
+	std::cerr << "  -gen : batch equalise synthetic images, written to the synthetic directory first, as distribution,WxH[xC],count," << std::endl;
+	std::cerr << "    e.g. gaussian:128:20,1920x1080x3,100. Distributions: uniform, gaussian[:mean[:deviation]], single[:value], twospike[:a[:b]], gradient, noise" << std::endl;
+	std::cerr << "  -io : file I/O of the coroutine batch mode, uring (io_uring where the kernel has it, the default) or threads (needs a C++20 build)" << std::endl;
+	std::cerr << "  -c : equalise the red, green and blue channels of a colour image separately" << std::endl;
+	std::cerr << "  -fp : use the double precision rgb2grey and normalise kernels (needs cl_khr_fp64) instead of the integer ones" << std::endl;
+	std::cerr << "  -a : sliding window adaptive equalisation with a window of the given radius, on CPU threads" << std::endl;
+	std::cerr << "  -s : contrast stretch the p-th and (100-p)-th percentiles to 0 and 255 instead of equalising, p from 0 up to 50, e.g. -s 1" << std::endl;
+	std::cerr << "  -o : point ops applied after equalisation, e.g. gamma=1.2,levels=16:240[:0:255],stretch=10:245,threshold=128,invert,table=file" << std::endl;
+	std::cerr << "  -roi : count the histogram in the rectangle x,y,width,height only, e.g. -roi 100,50,320,240 (in batch mode, equalise only that rectangle of each image)" << std::endl;
+	std::cerr << "  -mask : count the histogram under a mask image only (non-zero pixels, same size as the input)" << std::endl;
+	std::cerr << "  -roi-only : apply the lookup table inside the -roi rectangle or -mask only, the rest of the image is kept" << std::endl;
+	std::cerr << "  -w : replace the image with a single-value worst case (every pixel in one bin)" << std::endl;
+	std::cerr << "  -roofline : measure the device bandwidth and local atomic rate first, and give each stage time as a percentage of its roofline" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
+	std::cerr << "While the output is shown: up and down double or halve the number of histogram bins, left and right lower or raise" << std::endl;
+	std::cerr << "  the clip limit, and o switches between equalisation, contrast stretch and matching (with -r)" << std::endl;
+}
+
+// Loads the 256 level cumulative histogram of a reference for histogram matching.
+// A .cdf file is read as it is, any other file is read as an image and its cumulative histogram is saved beside it as
+// <file>.cdf, so a reference image is only counted the first time it is used. Colour references are converted to grey
+// with the same fixed point weights as the rgb2grey_fixed kernel.
+// The saved file starts with "source <size> <modified time>" of the image it was counted from, and is only used while
+// the image still has that size and time, so an edited or replaced reference is counted again.
+vector<int> LoadReferenceCDF(const string& reference_filename) {
+	vector<int> cdf(256, 0);
+	bool isCDF = reference_filename.size() > 4 && reference_filename.compare(reference_filename.size() - 4, 4, ".cdf") == 0;
+	string cdf_filename = isCDF ? reference_filename : reference_filename + ".cdf";
+	string source;
+	if (!isCDF) {
+		source = to_string(filesystem::file_size(reference_filename)) + " " + to_string(filesystem::last_write_time(reference_filename).time_since_epoch().count());
+	}
+
+	ifstream cached(cdf_filename);
+	if (cached) {
+		string cachedSource;
+		if ((cached >> ws).peek() == 's') {
+			string word, size, time;
+			cached >> word >> size >> time;
+			cachedSource = size + " " + time;
+		}
+		for (int i = 0; i < 256; i++) {
+			cached >> cdf[i];
+		}
+		if (cached && (isCDF || cachedSource == source)) {
+			return cdf;
+		}
+		if (isCDF) {
+			throw runtime_error("could not read 256 values from " + cdf_filename);
+		}
+		std::cout << cdf_filename << " is not from the current " << reference_filename << ", counting it again" << std::endl;
+	}
+
+	CImg<unsigned char> reference(reference_filename.c_str());
+	size_t plane = (size_t)reference.width() * reference.height() * reference.depth();
+	vector<int> counts(256, 0);
+	for (size_t i = 0; i < plane; i++) {
+		int value = reference.data()[i];
+		if (reference.spectrum() == 3) {
+			value = (reference.data()[i] * 13933 + reference.data()[i + plane] * 46875 + reference.data()[i + (plane * 2)] * 4732) >> 16;
+		}
+		counts[value]++;
+	}
+	for (int i = 0, sum = 0; i < 256; i++) {
+		sum += counts[i];
+		cdf[i] = sum;
+	}
+
+	// The reference may be somewhere read-only, then it is simply counted again next time.
+	ofstream cache(cdf_filename);
+	cache << "source " << source << endl;
+	copy(cdf.begin(), cdf.end(), ostream_iterator<int>(cache, " "));
+	cache.close();
+	if (!cache) {
+		std::cout << "Could not write " << cdf_filename << ", the reference will be counted again next time" << std::endl;
+	}
+	return cdf;
+}
+
+// Loads and builds the device code, printing the build log if it fails.
+cl::Program BuildProgram(const cl::Context& context) {
+	cl::Program::Sources sources;
+
+	AddSources(sources, "kernels/my_kernels.cl");
+
+	cl::Program program(context, sources);
+
+	//build and debug the kernel code
+	try { 
+		program.build();
+	}
+	catch (const cl::Error& err) {
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+		throw err;
+	}
+	return program;
+}
+
+// Adds a suffix before the extension of a filename, used to name the joint and batch outputs.
+string OutputName(const string& filename, const string& suffix) {
+	size_t dot = filename.find_last_of('.');
+	if (dot == string::npos || filename.find_first_of("/\\", dot) != string::npos) {
+		return filename + suffix;
+	}
+	return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+// True for a file in a directory that the batch should take: an image by its extension, and not the output of an
+// earlier run (<name>_equalised.<ext> or <name>_joint.<ext>), so other files and a second run over the same directory are skipped.
+bool IsBatchImage(const filesystem::path& path) {
+	string extension = path.extension().string();
+	transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	const vector<string> images = { ".pgm", ".ppm", ".pnm", ".pbm", ".bmp", ".png", ".jpg", ".jpeg", ".tif", ".tiff" };
+	if (find(images.begin(), images.end(), extension) == images.end()) {
+		return false;
+	}
+	string stem = path.stem().string();
+	for (const string suffix : { "_equalised", "_joint" }) {
+		if (stem.size() >= suffix.size() && stem.compare(stem.size() - suffix.size(), suffix.size(), suffix) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Expands a comma separated list of images, where any entry that is a directory stands for every image in it (see IsBatchImage).
+vector<string> ExpandFileList(const string& list) {
+	vector<string> filenames;
+	stringstream entries(list);
+	for (string entry; getline(entries, entry, ',');) {
+		if (filesystem::is_directory(entry)) {
+			vector<string> files;
+			for (const auto& file : filesystem::directory_iterator(entry)) {
+				if (file.is_regular_file() && IsBatchImage(file.path())) {
+					files.push_back(file.path().string());
+				}
+			}
+			sort(files.begin(), files.end());
+			filenames.insert(filenames.end(), files.begin(), files.end());
+		}
+		else {
+			filenames.push_back(entry);
+		}
+	}
+	return filenames;
+}
+
+// Writes the synthetic images of a -gen list (distribution,WxH[xC],count) to the synthetic directory, each with its own seed,
+// and gives their names so the batch modes take them like any other files. They are streamed, so they can be any size.
+// The batch saves its outputs beside them as <name>_equalised.<ext>, which a later -b synthetic leaves out (see IsBatchImage).
+vector<string> GenerateImages(const string& spec) {
+	stringstream parts(spec);
+	string distribution, size, count;
+	getline(parts, distribution, ',');
+	getline(parts, size, ',');
+	getline(parts, count, ',');
+	int width = 0, height = 0, channels = 1;
+	if (sscanf(size.c_str(), "%dx%dx%d", &width, &height, &channels) < 2 || atoi(count.c_str()) < 1) {
+		throw runtime_error("bad -gen, e.g. -gen gaussian:128:20,1920x1080x3,100");
+	}
+
+	filesystem::create_directories("synthetic");
+	string name = distribution;
+	replace(name.begin(), name.end(), ':', '_');
+	vector<string> filenames;
+	size_t bytes = 0;
+	auto start = chrono::steady_clock::now();
+	for (int k = 0; k < atoi(count.c_str()); k++) {
+		SyntheticImage image(distribution, width, height, channels, k);
+		filenames.push_back("synthetic/" + name + "_" + to_string(k) + (channels == 1 ? ".pgm" : ".ppm"));
+		image.Write(filenames.back());
+		bytes += image.Size();
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	std::cout << "Generating " << filenames.size() << " " << distribution << " images (" << bytes << " bytes) took: " << seconds << "s, " << bytes / seconds * 1e-9 << " GB/s" << std::endl;
+	return filenames;
+}
+
+// Batch mode, every image is equalised on its own (each with its own lookup table) and saved as <name>_equalised.<ext>.
+// The Equaliser keeps its device buffers from one image to the next. With -cache, repeated images are found by a content
+// hash computed on the device and reuse their stored lookup table, or their stored output with -cache-outputs.
+// With -roi only the rectangle roi (x, y, width, height) of each image is equalised, in place, through a strided view of
+// the rectangle, and the rest of the image is kept. Devices that share memory with the host work on it without a copy.
+void BatchEqualise(const cl::Context& context, const cl::Program& program, const vector<string>& filenames, size_t cacheBytes, bool cacheOutputs, int asyncSlots, const array<int, 4>& roi) {
+	Equaliser equaliser(context, program);
+	LutCache cache(cacheBytes, cacheOutputs);
+	if (cacheBytes > 0) {
+		equaliser.SetCache(&cache);
+	}
+	if (roi[2] > 0) {
+		if (asyncSlots > 0 || cacheBytes > 0) {
+			throw runtime_error("-roi in batch mode does not work with -async or -cache");
+		}
+		equaliser.SetZeroCopy(context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE);
+	}
+
+	auto start = chrono::steady_clock::now();
+	size_t pixels = 0;
+	if (asyncSlots > 0) {
+		// With -async the images are submitted to an AsyncEqualiser and this thread goes on loading the next ones while the
+		// device works. Up to twice as many images as slots are kept loaded, the oldest is saved when that is reached.
+		AsyncEqualiser async(context, program, asyncSlots);
+		struct Pending {
+			string filename;
+			CImg<unsigned char> image, output;
+			future<vector<int>> done;
+		};
+		deque<Pending> pending;
+		auto saveOldest = [&]() {
+			Pending& oldest = pending.front();
+			oldest.done.get();
+			oldest.output.save(OutputName(oldest.filename, "_equalised").c_str());
+			pending.pop_front();
+		};
+		for (const string& filename : filenames) {
+			pending.push_back(Pending{ filename, CImg<unsigned char>(filename.c_str()), CImg<unsigned char>(), future<vector<int>>() });
+			Pending& next = pending.back();
+			next.output.assign(next.image.width(), next.image.height(), next.image.depth(), next.image.spectrum());
+			next.done = async.Submit(next.image.data(), next.output.data(), next.image.width(), next.image.height() * next.image.depth(), next.image.spectrum());
+			pixels += next.image.size();
+			if (pending.size() > 2 * (size_t)asyncSlots) {
+				saveOldest();
+			}
+		}
+		while (!pending.empty()) {
+			saveOldest();
+		}
+	}
+	else {
+		for (const string& filename : filenames) {
+			CImg<unsigned char> image(filename.c_str());
+			if (roi[2] > 0) {
+				if (roi[0] < 0 || roi[1] < 0 || roi[3] <= 0 || roi[0] + roi[2] > image.width() || roi[1] + roi[3] > image.height() * image.depth()) {
+					throw runtime_error("the -roi rectangle is not inside " + filename);
+				}
+				ImageView rectangle = ImageView::Planar(image.data(), image.width(), image.height() * image.depth(), image.spectrum()).Sub(roi[0], roi[1], roi[2], roi[3]);
+				equaliser.Equalise(rectangle, rectangle);
+				image.save(OutputName(filename, "_equalised").c_str());
+				pixels += (size_t)roi[2] * roi[3] * image.spectrum();
+				continue;
+			}
+			CImg<unsigned char> output(image.width(), image.height(), image.depth(), image.spectrum());
+			equaliser.Equalise(image.data(), output.data(), image.size(), image.spectrum());
+			output.save(OutputName(filename, "_equalised").c_str());
+			pixels += image.size();
+		}
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	std::cout << "Batch equalisation of " << filenames.size() << " images (" << pixels << " bytes) took: " << seconds << "s to complete" << std::endl;
+	if (cacheBytes > 0) {
+		std::cout << "Lookup table cache: " << cache.hits << " hits, " << cache.misses << " misses, " << cache.evictions << " evictions, " << cache.bytes << " bytes used" << std::endl;
+	}
+}
+
+// Picks the histogram kernel for -m from the kernels the program was built with. local_global_subgroup is only built when
+// the device's OpenCL C compiler defines a sub-group extension, which a device listing the extension does not promise.
+// auto is the sub-group kernel when it was built, otherwise the plain atomic one, and -m subgroup is refused without it.
+string HistogramMethod(const cl::Program& program, const string& method) {
+	bool subgroupsBuilt = HasKernel(program, "local_global_subgroup");
+	if (method == "auto") {
+		return subgroupsBuilt ? "subgroup" : "atomic";
+	}
+	if (method == "subgroup" && !subgroupsBuilt) {
+		throw runtime_error("-m subgroup needs a device whose OpenCL C compiler has cl_khr_subgroups or cl_intel_subgroups");
+	}
+	return method;
+}
+
+// Reads the size of an uncompressed 8-bit .cimg file, the one volume format CImg can read and write a slice at a time.
+// Gives false for any other file.
+bool CimgVolumeSize(const string& filename, unsigned int& width, unsigned int& height, unsigned int& depth, unsigned int& spectrum) {
+	if (filename.size() < 5 || filename.compare(filename.size() - 5, 5, ".cimg") != 0) {
+		return false;
+	}
+	ifstream file(filename, ios::binary);
+	string images, type, line;
+	if (!(file >> images >> type) || (type != "unsigned_char" && type != "uchar")) {
+		return false;
+	}
+	getline(file, line); // rest of the first line, the endianness
+	getline(file, line);
+	stringstream size(line);
+	return (size >> width >> height >> depth >> spectrum) && line.find('#') == string::npos; // '#' marks a compressed image
+}
+
+// Joint histogram equalisation: a batch of images, or the slices of a 3D volume, share one histogram and so one lookup table,
+// which keeps the brightness consistent from one frame or slice to the next.
+// The first pass streams every image through the histogram kernel of -m into the same histogram, then the scan and normalise
+// run once, and the second pass streams every image again through lookup. Images are loaded one at a time and only two are
+// on the device at once, alternating between two queues so one image uploads while the other is processed.
+void JointEqualise(const cl::Context& context, const cl::Program& program, const vector<string>& filenames, int hist, const string& method) {
+	size_t histogramSize = hist * sizeof(int);
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	string histogram_method = HistogramMethod(program, method);
+
+	// A single file with more than one slice is a volume, otherwise every file is one image of the batch.
+	// A .cimg volume is read one slice at a time in both passes and its output is written one slice at a time, so neither
+	// has to fit in memory. CImg can only decode the other volume formats whole, so they are loaded once and the output
+	// slices are written back over the input, without a second volume.
+	unsigned int width = 0, height = 0, depth = 1, spectrum = 0;
+	bool streamed = false;
+	CImg<unsigned char> volume;
+	if (filenames.size() == 1) {
+		streamed = CimgVolumeSize(filenames[0], width, height, depth, spectrum) && depth > 1;
+		if (!streamed) {
+			volume.assign(filenames[0].c_str());
+			depth = volume.depth();
+		}
+	}
+	bool isVolume = depth > 1;
+	int count = isVolume ? (int)depth : (int)filenames.size();
+	string volumeOutput = OutputName(filenames[0], "_joint");
+
+	function<CImg<unsigned char>(int)> load = [&](int k) {
+		if (streamed) {
+			return CImg<unsigned char>::get_load_cimg(filenames[0].c_str(), 0, 0, 0, 0, k, 0, ~0U, ~0U, k, ~0U);
+		}
+		return isVolume ? volume.get_slice(k) : CImg<unsigned char>(filenames[k].c_str());
+	};
+	function<void(int, const CImg<unsigned char>&)> store = [&](int k, const CImg<unsigned char>& output) {
+		if (streamed) {
+			output.save_cimg(volumeOutput.c_str(), 0, 0, 0, k, 0);
+		}
+		else if (isVolume) {
+			volume.draw_image(0, 0, k, 0, output);
+		}
+		else {
+			output.save(OutputName(filenames[k], "_joint").c_str());
+		}
+	};
+
+	// Each slot has its own queue and buffers, the host image has to stay alive until its queue has finished with it.
+	struct Slot {
+		cl::CommandQueue queue;
+		CImg<unsigned char> image;
+		vector<unsigned char> result;
+		cl::Buffer input, grey, output, partials, blocks, histogram;
+		size_t capacity = 0;
+		int pending = -1; // index of the image whose result is still being read back
+	};
+	vector<Slot> slots(2);
+	for (Slot& slot : slots) {
+		slot.queue = cl::CommandQueue(context);
+	}
+	auto reserve = [&](Slot& slot, size_t size) {
+		if (size > slot.capacity) {
+			slot.input = cl::Buffer(context, CL_MEM_READ_ONLY, size);
+			slot.grey = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+			slot.output = cl::Buffer(context, CL_MEM_WRITE_ONLY, size);
+			if (histogram_method == "partials") {
+				int groups = (int)(size / hist);
+				slot.partials = cl::Buffer(context, CL_MEM_READ_WRITE, groups * histogramSize);
+				slot.blocks = cl::Buffer(context, CL_MEM_READ_WRITE, (int)ceil(sqrt((double)groups)) * histogramSize);
+				slot.histogram = cl::Buffer(context, CL_MEM_READ_WRITE, histogramSize);
+			}
+			slot.capacity = size;
+		}
+	};
+
+	vector<int> binvals(hist);
+	for (int i = 0; i < hist; i++) {
+		binvals[i] = i * (256 / hist);
+	}
+	cl::Buffer binsizeBuffer(context, CL_MEM_READ_ONLY, histogramSize);
+	cl::Buffer jointHistogram(context, CL_MEM_READ_WRITE, histogramSize);
+	cl::Buffer cumulativeHistogram(context, CL_MEM_READ_WRITE, histogramSize);
+	cl::Buffer normalisedHistogram(context, CL_MEM_READ_WRITE, histogramSize);
+	// -m partials uses no global atomics, so each image's histogram goes to its own row and the rows are added up at the end
+	cl::Buffer imageHistograms;
+	if (histogram_method == "partials") {
+		imageHistograms = cl::Buffer(context, CL_MEM_READ_WRITE, count * histogramSize);
+	}
+	slots[0].queue.enqueueWriteBuffer(binsizeBuffer, CL_TRUE, 0, histogramSize, &binvals[0]);
+	slots[0].queue.enqueueFillBuffer(jointHistogram, 0, 0, histogramSize);
+	slots[0].queue.finish();
+	int persistentGroups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+
+	auto start = chrono::steady_clock::now();
+
+	// Pass 1, every image adds to the same histogram. The atomic, sub-group, packed and persistent kernels merge with
+	// global atomics, so the two queues can add into it at the same time.
+	for (int k = 0; k < count; k++) {
+		Slot& slot = slots[k % 2];
+		slot.queue.finish();
+		slot.image = load(k);
+		reserve(slot, slot.image.size());
+		slot.queue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, slot.image.size(), slot.image.data());
+
+		cl::Kernel kernel_grey(program, slot.image.spectrum() == 3 ? "rgb2grey_fixed" : "identity");
+		kernel_grey.setArg(0, slot.input);
+		kernel_grey.setArg(1, slot.grey);
+		slot.queue.enqueueNDRangeKernel(kernel_grey, cl::NullRange, cl::NDRange(slot.image.size()), cl::NullRange);
+
+		int size = (int)slot.image.size();
+		if (histogram_method == "partials") {
+			// Each work-group writes a row, the rows are added up into about sqrt(groups) rows, then into one histogram that is copied to row k
+			int groups = size / hist;
+			int blocks = (int)ceil(sqrt((double)groups));
+			cl::Kernel kernel_local_partials(program, "local_partials");
+			kernel_local_partials.setArg(0, slot.grey);
+			kernel_local_partials.setArg(1, slot.partials);
+			kernel_local_partials.setArg(2, cl::Local(histogramSize));
+			kernel_local_partials.setArg(3, size);
+			kernel_local_partials.setArg(4, hist);
+			kernel_local_partials.setArg(5, binsizeBuffer);
+			slot.queue.enqueueNDRangeKernel(kernel_local_partials, cl::NullRange, cl::NDRange(size), cl::NDRange(hist));
+
+			cl::Kernel kernel_reduce_partials(program, "reduce_partials");
+			kernel_reduce_partials.setArg(0, slot.partials);
+			kernel_reduce_partials.setArg(1, slot.blocks);
+			kernel_reduce_partials.setArg(2, groups);
+			kernel_reduce_partials.setArg(3, hist);
+			slot.queue.enqueueNDRangeKernel(kernel_reduce_partials, cl::NullRange, cl::NDRange(hist, blocks), cl::NullRange);
+
+			cl::Kernel kernel_reduce_blocks(program, "reduce_partials");
+			kernel_reduce_blocks.setArg(0, slot.blocks);
+			kernel_reduce_blocks.setArg(1, slot.histogram);
+			kernel_reduce_blocks.setArg(2, blocks);
+			kernel_reduce_blocks.setArg(3, hist);
+			slot.queue.enqueueNDRangeKernel(kernel_reduce_blocks, cl::NullRange, cl::NDRange(hist, 1), cl::NullRange);
+			slot.queue.enqueueCopyBuffer(slot.histogram, imageHistograms, 0, k * histogramSize, histogramSize);
+		}
+		else if (histogram_method == "packed") {
+			int replicas = 4;
+			cl::Kernel kernel_packed_histogram(program, "local_global_packed");
+			kernel_packed_histogram.setArg(0, slot.grey);
+			kernel_packed_histogram.setArg(1, jointHistogram);
+			kernel_packed_histogram.setArg(2, cl::Local(replicas * ((hist + 1) / 2) * sizeof(cl_uint)));
+			kernel_packed_histogram.setArg(3, size);
+			kernel_packed_histogram.setArg(4, hist);
+			kernel_packed_histogram.setArg(5, binsizeBuffer);
+			kernel_packed_histogram.setArg(6, replicas);
+			slot.queue.enqueueNDRangeKernel(kernel_packed_histogram, cl::NullRange, cl::NDRange(persistentGroups * hist), cl::NDRange(hist));
+		}
+		else if (histogram_method == "persistent") {
+			cl::Kernel kernel_persistent_histogram(program, "local_global_persistent");
+			kernel_persistent_histogram.setArg(0, slot.grey);
+			kernel_persistent_histogram.setArg(1, jointHistogram);
+			kernel_persistent_histogram.setArg(2, cl::Local(histogramSize));
+			kernel_persistent_histogram.setArg(3, cl::Local(256 * sizeof(int)));
+			kernel_persistent_histogram.setArg(4, size);
+			kernel_persistent_histogram.setArg(5, hist);
+			kernel_persistent_histogram.setArg(6, binsizeBuffer);
+			slot.queue.enqueueNDRangeKernel(kernel_persistent_histogram, cl::NullRange, cl::NDRange(persistentGroups * hist), cl::NDRange(hist));
+		}
+		else {
+			cl::Kernel kernel_histogram(program, histogram_method == "subgroup" ? "local_global_subgroup" : "local_global");
+			kernel_histogram.setArg(0, slot.grey);
+			kernel_histogram.setArg(1, jointHistogram);
+			kernel_histogram.setArg(2, cl::Local(histogramSize));
+			kernel_histogram.setArg(3, size);
+			kernel_histogram.setArg(4, hist);
+			kernel_histogram.setArg(5, binsizeBuffer);
+			slot.queue.enqueueNDRangeKernel(kernel_histogram, cl::NullRange, cl::NDRange(size), cl::NDRange(hist));
+		}
+		slot.queue.flush();
+	}
+	for (Slot& slot : slots) {
+		slot.queue.finish();
+	}
+	if (histogram_method == "partials") {
+		// One row per image, few enough to add up in one pass
+		cl::Kernel kernel_reduce_images(program, "reduce_partials");
+		kernel_reduce_images.setArg(0, imageHistograms);
+		kernel_reduce_images.setArg(1, jointHistogram);
+		kernel_reduce_images.setArg(2, count);
+		kernel_reduce_images.setArg(3, hist);
+		slots[0].queue.enqueueNDRangeKernel(kernel_reduce_images, cl::NullRange, cl::NDRange(hist, 1), cl::NullRange);
+	}
+
+	// One lookup table for everything
+	cl::Kernel kernel_cumulativeHistogram(program, "cumulativeHistogram");
+	kernel_cumulativeHistogram.setArg(0, jointHistogram);
+	kernel_cumulativeHistogram.setArg(1, cumulativeHistogram);
+	kernel_cumulativeHistogram.setArg(2, cl::Local(histogramSize));
+	kernel_cumulativeHistogram.setArg(3, cl::Local(histogramSize));
+	slots[0].queue.enqueueNDRangeKernel(kernel_cumulativeHistogram, cl::NullRange, cl::NDRange(hist), cl::NDRange(hist));
+
+	cl::Kernel kernel_normaliseHistogram(program, "normalise_fixed");
+	kernel_normaliseHistogram.setArg(0, cumulativeHistogram);
+	kernel_normaliseHistogram.setArg(1, normalisedHistogram);
+	kernel_normaliseHistogram.setArg(2, hist);
+	slots[0].queue.enqueueNDRangeKernel(kernel_normaliseHistogram, cl::NullRange, cl::NDRange(hist), cl::NullRange);
+
+	vector<int> lut(hist);
+	slots[0].queue.enqueueReadBuffer(normalisedHistogram, CL_TRUE, 0, histogramSize, &lut[0]);
+	cout << "Joint Normalised Histogram = " << lut << endl << endl;
+
+	// Pass 2, load every image again and apply the shared lookup table. A slot's previous result is saved
+	// before the slot is reused, so the save of one image overlaps the processing of the next.
+	auto finishSlot = [&](Slot& slot) {
+		slot.queue.finish();
+		if (slot.pending >= 0) {
+			store(slot.pending, CImg<unsigned char>(slot.result.data(), slot.image.width(), slot.image.height(), slot.image.depth(), slot.image.spectrum()));
+			slot.pending = -1;
+		}
+	};
+	if (streamed) {
+		// CImg's own save_empty_cimg writes the type as "unsigned char", which its reader does not accept, so the header is written here
+		ofstream output(volumeOutput, ios::binary);
+		output << "1 unsigned_char " << (cimg::endianness() ? "big_endian" : "little_endian") << "\n" << width << " " << height << " " << depth << " " << spectrum << "\n";
+		output.seekp((size_t)width * height * depth * spectrum - 1, ios::cur);
+		output.put(0);
+		if (!output) {
+			throw runtime_error("Could not write " + volumeOutput);
+		}
+	}
+	for (int k = 0; k < count; k++) {
+		Slot& slot = slots[k % 2];
+		finishSlot(slot);
+		slot.image = load(k);
+		slot.result.resize(slot.image.size());
+		reserve(slot, slot.image.size());
+		slot.queue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, slot.image.size(), slot.image.data());
+
+		cl::Kernel kernel_lookup(program, "lookup");
+		kernel_lookup.setArg(0, slot.input);
+		kernel_lookup.setArg(1, normalisedHistogram);
+		kernel_lookup.setArg(2, slot.output);
+		kernel_lookup.setArg(3, hist);
+		kernel_lookup.setArg(4, binsizeBuffer);
+		slot.queue.enqueueNDRangeKernel(kernel_lookup, cl::NullRange, cl::NDRange(slot.image.size()), cl::NullRange);
+		slot.queue.enqueueReadBuffer(slot.output, CL_FALSE, 0, slot.image.size(), slot.result.data());
+		slot.queue.flush();
+		slot.pending = k;
+	}
+	for (Slot& slot : slots) {
+		finishSlot(slot);
+	}
+	if (isVolume && !streamed) {
+		volume.save(volumeOutput.c_str());
+	}
+
+	std::cout << "Joint equalisation (" << histogram_method << " histogram) of " << count << (isVolume ? " slices" : " images") << " took: "
+		<< chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s to complete" << std::endl;
+}
+
+// Independent red, green and blue equalisation. rgb_histogram counts the three channels in one pass, the three histograms
+// are scanned together (one work-group each) and normalised together, and lookup_channels remaps every channel with its own
+// table. The image is uploaded once and read back once, and is never converted to grey.
+CImg<unsigned char> EqualiseChannels(const cl::Context& context, const cl::Program& program, const CImg<unsigned char>& image_input, int hist) {
+	cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+	size_t histogramSize = 3 * hist * sizeof(int); // three histograms one after another
+	int plane = (int)(image_input.size() / 3);
+	cl::Event histEvent, cumulativeEvent, normaliseEvent, lookupEvent;
+
+	vector<int> binvals(hist);
+	for (int i = 0; i < hist; i++) {
+		binvals[i] = i * (256 / hist);
+	}
+	vector<unsigned char> output(image_input.size());
+	vector<int> histograms(3 * hist);
+
+	cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
+	cl::Buffer binsizeBuffer(context, CL_MEM_READ_ONLY, hist * sizeof(int));
+	cl::Buffer channelHistograms(context, CL_MEM_READ_WRITE, histogramSize);
+	cl::Buffer cumulativeHistograms(context, CL_MEM_READ_WRITE, histogramSize);
+	cl::Buffer normalisedHistograms(context, CL_MEM_READ_WRITE, histogramSize);
+	cl::Buffer intensityMap(context, CL_MEM_WRITE_ONLY, image_input.size());
+
+	queue.enqueueWriteBuffer(dev_image_input, CL_FALSE, 0, image_input.size(), image_input.data());
+	queue.enqueueWriteBuffer(binsizeBuffer, CL_FALSE, 0, hist * sizeof(int), &binvals[0]);
+	queue.enqueueFillBuffer(channelHistograms, 0, 0, histogramSize);
+
+	cl::Kernel kernel_rgb_histogram(program, "rgb_histogram");
+	kernel_rgb_histogram.setArg(0, dev_image_input);
+	kernel_rgb_histogram.setArg(1, channelHistograms);
+	kernel_rgb_histogram.setArg(2, cl::Local(histogramSize));
+	kernel_rgb_histogram.setArg(3, plane);
+	kernel_rgb_histogram.setArg(4, hist);
+	kernel_rgb_histogram.setArg(5, binsizeBuffer);
+	queue.enqueueNDRangeKernel(kernel_rgb_histogram, cl::NullRange, cl::NDRange(plane), cl::NDRange(hist), NULL, &histEvent);
+
+	// The Hillis-Steel scan works within a work-group, so a work-group per channel scans all three histograms at once.
+	cl::Kernel kernel_cumulativeHistogram(program, "cumulativeHistogram");
+	kernel_cumulativeHistogram.setArg(0, channelHistograms);
+	kernel_cumulativeHistogram.setArg(1, cumulativeHistograms);
+	kernel_cumulativeHistogram.setArg(2, cl::Local(hist * sizeof(int)));
+	kernel_cumulativeHistogram.setArg(3, cl::Local(hist * sizeof(int)));
+	queue.enqueueNDRangeKernel(kernel_cumulativeHistogram, cl::NullRange, cl::NDRange(3 * hist), cl::NDRange(hist), NULL, &cumulativeEvent);
+
+	cl::Kernel kernel_normalise_channels(program, "normalise_channels");
+	kernel_normalise_channels.setArg(0, cumulativeHistograms);
+	kernel_normalise_channels.setArg(1, normalisedHistograms);
+	kernel_normalise_channels.setArg(2, hist);
+	queue.enqueueNDRangeKernel(kernel_normalise_channels, cl::NullRange, cl::NDRange(3 * hist), cl::NullRange, NULL, &normaliseEvent);
+
+	cl::Kernel kernel_lookup_channels(program, "lookup_channels");
+	kernel_lookup_channels.setArg(0, dev_image_input);
+	kernel_lookup_channels.setArg(1, normalisedHistograms);
+	kernel_lookup_channels.setArg(2, intensityMap);
+	kernel_lookup_channels.setArg(3, plane);
+	kernel_lookup_channels.setArg(4, hist);
+	kernel_lookup_channels.setArg(5, binsizeBuffer);
+	queue.enqueueNDRangeKernel(kernel_lookup_channels, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &lookupEvent);
+
+	queue.enqueueReadBuffer(intensityMap, CL_TRUE, 0, output.size(), &output[0]);
+	queue.enqueueReadBuffer(normalisedHistograms, CL_TRUE, 0, histogramSize, &histograms[0]);
+	cout << "Normalised RGB Histograms = " << histograms << endl << endl;
+
+	std::cout << "RGB histograms took: " << histEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+	std::cout << "RGB cumulative histograms took: " << cumulativeEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cumulativeEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+	std::cout << "Normalise RGB histograms took: " << normaliseEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - normaliseEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+	std::cout << "RGB lookup tables took: " << lookupEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - lookupEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+
+	return CImg<unsigned char>(output.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
 }
 
 int main(int argc, char **argv) {
@@ -34,12 +662,60 @@ int main(int argc, char **argv) {
 	int platform_id = 0;
 	int device_id = 0;
 	string image_filename = "colour_test.ppm";
+	string histogram_method = "auto";
+	string reference_filename = "";
+	vector<string> joint_filenames;
+	vector<string> batch_filenames;
+	string generate = "";
+	size_t cache_bytes = 0;
+	bool cache_outputs = false;
+	int async_slots = 0; // 0 means one image at a time
+	int coroutine_jobs = 0; // 0 means no coroutine batch mode
+	[[maybe_unused]] bool threads_io = false; // only read by -co, which a C++17 build leaves out
+	bool worstCase = false;
+	bool perChannel = false;
+	bool doublePrecision = false;
+	string point_ops = "";
+	double stretch_percent = -1; // below 0 means equalise
+	int ahe_radius = 0; // 0 means global equalisation
+	int roi_x = 0, roi_y = 0, roi_width = 0, roi_height = 0; // a width of 0 means no rectangle
+	string mask_filename = "";
+	bool roi_only = false;
+	bool roofline_report = false;
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
 		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { histogram_method = argv[++i]; }
+		else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { reference_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-j") == 0) && (i < (argc - 1))) {
+			stringstream list(argv[++i]);
+			for (string name; getline(list, name, ',');) { joint_filenames.push_back(name); }
+		}
+		else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) { batch_filenames = ExpandFileList(argv[++i]); }
+		else if ((strcmp(argv[i], "-gen") == 0) && (i < (argc - 1))) { generate = argv[++i]; }
+		else if ((strcmp(argv[i], "-cache") == 0) && (i < (argc - 1))) { cache_bytes = (size_t)(atof(argv[++i]) * 1024 * 1024); }
+		else if (strcmp(argv[i], "-cache-outputs") == 0) { cache_outputs = true; }
+		else if ((strcmp(argv[i], "-async") == 0) && (i < (argc - 1))) { async_slots = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-co") == 0) && (i < (argc - 1))) { coroutine_jobs = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-io") == 0) && (i < (argc - 1))) { threads_io = strcmp(argv[++i], "threads") == 0; }
+		else if (strcmp(argv[i], "-c") == 0) { perChannel = true; }
+		else if (strcmp(argv[i], "-fp") == 0) { doublePrecision = true; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { point_ops = argv[++i]; }
+		else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) {
+			// p has to be below 50 so the low percentile is below the high one, otherwise the stretch would be the identity or undefined
+			char* end;
+			stretch_percent = strtod(argv[++i], &end);
+			if (*end != 0 || !(stretch_percent >= 0 && stretch_percent < 50)) { std::cerr << "ERROR: -s needs a percentile from 0 up to (not including) 50" << std::endl; return 1; }
+		}
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1))) { ahe_radius = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-roi") == 0) && (i < (argc - 1))) { sscanf(argv[++i], "%d,%d,%d,%d", &roi_x, &roi_y, &roi_width, &roi_height); }
+		else if ((strcmp(argv[i], "-mask") == 0) && (i < (argc - 1))) { mask_filename = argv[++i]; }
+		else if (strcmp(argv[i], "-roi-only") == 0) { roi_only = true; }
+		else if (strcmp(argv[i], "-w") == 0) { worstCase = true; }
+		else if (strcmp(argv[i], "-roofline") == 0) { roofline_report = true; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
@@ -47,11 +723,82 @@ int main(int argc, char **argv) {
 
 	//detect any potential exceptions
 	try {
+		if (!generate.empty()) {
+			vector<string> generated = GenerateImages(generate);
+			batch_filenames.insert(batch_filenames.end(), generated.begin(), generated.end());
+		}
+
+		// Joint mode works through its own list of images, so it runs before the single image pipeline below.
+		if (!joint_filenames.empty()) {
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			JointEqualise(context, BuildProgram(context), joint_filenames, 256, histogram_method);
+			return 0;
+		}
+		if (!batch_filenames.empty()) {
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			if (coroutine_jobs > 0) {
+#ifdef __cpp_impl_coroutine
+				auto start = chrono::steady_clock::now();
+				CoroutineBatch batch(context, BuildProgram(context), batch_filenames, threads_io, [](const string& filename) { return OutputName(filename, "_equalised"); });
+				batch.Run(coroutine_jobs);
+				double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				std::cout << "Coroutine batch equalisation of " << batch_filenames.size() << " images (" << batch.pixels << " bytes, " << batch.failed << " failed) with " << coroutine_jobs << " jobs took: " << seconds << "s to complete" << std::endl;
+				const FileIo& io = *batch.io;
+				double megabytes = (io.bytesRead + io.bytesWritten) / (1024.0 * 1024.0);
+				std::cout << "File I/O (" << io.Name() << "): " << io.files << " files, " << io.bytesRead << " bytes read, " << io.bytesWritten << " bytes written, "
+					<< io.calls << " " << io.CallsName() << " (" << (io.files ? (double)io.calls / io.files : 0.0) << " per file), " << megabytes / seconds << " MB/s" << std::endl;
+#else
+				throw runtime_error("-co needs the program built as C++20");
+#endif
+				return 0;
+			}
+			BatchEqualise(context, BuildProgram(context), batch_filenames, cache_bytes, cache_outputs, async_slots, { roi_x, roi_y, roi_width, roi_height });
+			return 0;
+		}
+
 		bool histFired = false;
 		bool hillisFired = false;
+		int persistentGroups = 0;
 		CImg<unsigned char> image_input(image_filename.c_str());
+		// Every pixel in the same bin is the worst case for the histogram atomics, used to benchmark the histogram kernels.
+		if (worstCase) {
+			image_input.fill(0);
+		}
 		CImgDisplay disp_input(image_input,"input");
 
+		// Per channel equalisation has its own pipeline with three histograms, only used for colour images.
+		if (perChannel && image_input.spectrum() == 3) {
+			cl::Context context = GetContext(platform_id, device_id);
+			std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+			CImg<unsigned char> output_image = EqualiseChannels(context, BuildProgram(context), image_input, 256);
+			CImgDisplay disp_output(output_image, "output");
+
+			while (!disp_input.is_closed() && !disp_output.is_closed()
+				&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+				CImgDisplay::wait(disp_input, disp_output);
+			}
+			return 0;
+		}
+
+		// Sliding window adaptive equalisation gives every pixel its own window histogram. The histograms are updated
+		// incrementally as the window moves so the cost per pixel does not depend on the radius, and bands of rows run on CPU threads.
+		if (ahe_radius > 0) {
+			CImg<unsigned char> output_image(image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
+			auto start = chrono::steady_clock::now();
+			// Every slice of every channel is a separate width x height plane
+			SlidingAHE(ahe_radius).Apply(image_input.data(), output_image.data(), image_input.width(), image_input.height(), image_input.depth() * image_input.spectrum());
+			std::cout << "Sliding window equalisation (radius " << ahe_radius << ") took: " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s to complete" << std::endl;
+			CImgDisplay disp_output(output_image, "output");
+
+			while (!disp_input.is_closed() && !disp_output.is_closed()
+				&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+				CImgDisplay::wait(disp_input, disp_output);
+			}
+			return 0;
+		}
+
 		//Part 2 - host operations
 		//2.1 Select computing devices
 		cl::Context context = GetContext(platform_id, device_id);
@@ -59,6 +806,16 @@ int main(int argc, char **argv) {
 		//display the selected device
 		std::cout << "Runing on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+
+		// The integer rgb2grey_fixed and normalise_fixed kernels give the same result on every device and do not need double support,
+		// the original double kernels are only built (and can only be picked with -fp) when the device has cl_khr_fp64.
+		if (doublePrecision && extensions.find("cl_khr_fp64") == string::npos) {
+			std::cout << "Device has no cl_khr_fp64, using the integer kernels" << std::endl;
+			doublePrecision = false;
+		}
+
 		// Create a queue to which we will push commands for the device and enable profiling. 
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
 		
@@ -67,27 +824,28 @@ int main(int argc, char **argv) {
 		cl::Event greyEvent;
 		cl::Event histEvent;
 		cl::Event atomicHistEvent;
+		cl::Event reduceBlocksEvent;
+		cl::Event reducePartialsEvent;
 		cl::Event cumulativeHistEvent;
 		cl::Event blellochCumulEvent;
 		cl::Event normaliseHistEvent;
 		cl::Event mapHistEvent;
+		cl::Event composeEvent;
+		cl::Event percentileEvent;
 
 		//2.2 Load & build the device code
-		cl::Program::Sources sources;
-
-		AddSources(sources, "kernels/my_kernels.cl");
+		cl::Program program = BuildProgram(context);
 
-		cl::Program program(context, sources);
+		// Sub-groups let the histogram merge equal bins before the local atomics, only used when the sub-group kernel was built.
+		// -m atomic and -m subgroup force one of the two kernels, so they can be timed against each other on the same device (try -w).
+		histogram_method = HistogramMethod(program, histogram_method);
 
-		//build and debug the kernel code
-		try { 
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+		// The roofs the stage timings are compared against, measured before anything else runs on the device
+		Roofline roofline;
+		if (roofline_report) {
+			roofline.Calibrate(context, program);
+			std::cout << "Roofline: copy " << roofline.copyBandwidth * 1e-9 << " GB/s, read " << roofline.readBandwidth * 1e-9 << " GB/s, write "
+				<< roofline.writeBandwidth * 1e-9 << " GB/s, local atomics " << roofline.localAtomics * 1e-9 << " G/s" << std::endl;
 		}
 
 		// Part 3 Memory Allocation
@@ -126,13 +884,38 @@ int main(int argc, char **argv) {
 		queue.enqueueWriteBuffer(binsizeBuffer, CL_TRUE, 0, histogramSize, & binvals[0]);
 		queue.enqueueFillBuffer(intensityHistogram, 0, 0, histogramSize);
 
+		// A region of interest limits the histogram to a rectangle (-roi) or to the pixels under a mask (-mask), and with
+		// -roi-only the lookup table is applied there only. The same region is used in every plane (channel or slice).
+		int plane = image_input.width() * image_input.height();
+		int planes = image_input.depth() * image_input.spectrum();
+		size_t countedPixels = image_input.size(); // how many pixels the histogram adds up to
+		cl::Buffer maskBuffer(context, CL_MEM_READ_ONLY, plane); // Non-zero where the mask is set
+		if (roi_width > 0) {
+			if (roi_x < 0 || roi_y < 0 || roi_height <= 0 || roi_x + roi_width > image_input.width() || roi_y + roi_height > image_input.height()) {
+				throw runtime_error("the -roi rectangle is not inside the image");
+			}
+			countedPixels = (size_t)roi_width * roi_height * planes;
+		}
+		else if (!mask_filename.empty()) {
+			CImg<unsigned char> mask(mask_filename.c_str());
+			if (mask.width() != image_input.width() || mask.height() != image_input.height()) {
+				throw runtime_error("the mask has to be the same size as the image");
+			}
+			// Only the first slice of the first channel is used
+			queue.enqueueWriteBuffer(maskBuffer, CL_TRUE, 0, plane, mask.data());
+			countedPixels = (size_t)count_if(mask.data(), mask.data() + plane, [](unsigned char m) { return m != 0; }) * planes;
+			if (countedPixels == 0) {
+				throw runtime_error("the mask is empty");
+			}
+		}
+
 		// 4 Setup and execute the kernels (i.e. device code)
 		
 		// 4.1 Firstly, change the image to greyscale so the intensites can be counted
 		// Check if dev_image_input is RGB.
 		if (image_input.spectrum() == 3) {
 			// If RGB, convert to grayscale.
-			cl::Kernel kernel_rgb2gray(program, "rgb2grey");
+			cl::Kernel kernel_rgb2gray(program, doublePrecision ? "rgb2grey" : "rgb2grey_fixed");
 			kernel_rgb2gray.setArg(0, dev_image_input);
 			kernel_rgb2gray.setArg(1, initialImageArray);
 			queue.enqueueNDRangeKernel(kernel_rgb2gray, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &rgbEvent);
@@ -170,14 +953,118 @@ int main(int argc, char **argv) {
 		// to lock and unlock the global bins. Instead it uses a local memory buffer to store the local histograms.
 		// This way, only the local bins are locked and unlocked, and the global bins are only locked once to add the local,
 		// histograms together. This algoirthm is 3x faster than the serial version when tested on the large_test image. */
-		cl::Kernel kernel_atomic_histogram(program, "local_global");
-		kernel_atomic_histogram.setArg(0, initialImageArray);
-		kernel_atomic_histogram.setArg(1, intensityHistogram);
-		kernel_atomic_histogram.setArg(2, cl::Local(histogramSize));
-		kernel_atomic_histogram.setArg(3, (int)image_input.size());
-		kernel_atomic_histogram.setArg(4, hist);
-		kernel_atomic_histogram.setArg(5, binsizeBuffer);
-		queue.enqueueNDRangeKernel(kernel_atomic_histogram, cl::NullRange, cl::NDRange(image_input.size()), cl::NDRange(histogram.size()), NULL, &atomicHistEvent);
+		if (roi_width > 0) {
+			// The rectangle is counted with a 2D launch over just its rows and columns, 16 x 16 work-groups.
+			cl::Kernel kernel_roi_histogram(program, "roi_histogram");
+			kernel_roi_histogram.setArg(0, initialImageArray);
+			kernel_roi_histogram.setArg(1, intensityHistogram);
+			kernel_roi_histogram.setArg(2, cl::Local(histogramSize));
+			kernel_roi_histogram.setArg(3, image_input.width());
+			kernel_roi_histogram.setArg(4, plane);
+			kernel_roi_histogram.setArg(5, planes);
+			kernel_roi_histogram.setArg(6, roi_x);
+			kernel_roi_histogram.setArg(7, roi_y);
+			kernel_roi_histogram.setArg(8, roi_width);
+			kernel_roi_histogram.setArg(9, roi_height);
+			kernel_roi_histogram.setArg(10, hist);
+			kernel_roi_histogram.setArg(11, binsizeBuffer);
+			queue.enqueueNDRangeKernel(kernel_roi_histogram, cl::NullRange, cl::NDRange((roi_width + 15) / 16 * 16, (roi_height + 15) / 16 * 16), cl::NDRange(16, 16), NULL, &atomicHistEvent);
+		}
+		else if (!mask_filename.empty()) {
+			// The mask is tested as the pixels are counted. The launch is sized to the device like -m persistent.
+			cl::Kernel kernel_masked_histogram(program, "masked_histogram");
+			kernel_masked_histogram.setArg(0, initialImageArray);
+			kernel_masked_histogram.setArg(1, maskBuffer);
+			kernel_masked_histogram.setArg(2, intensityHistogram);
+			kernel_masked_histogram.setArg(3, cl::Local(histogramSize));
+			kernel_masked_histogram.setArg(4, (int)image_input.size());
+			kernel_masked_histogram.setArg(5, plane);
+			kernel_masked_histogram.setArg(6, hist);
+			kernel_masked_histogram.setArg(7, binsizeBuffer);
+			queue.enqueueNDRangeKernel(kernel_masked_histogram, cl::NullRange, cl::NDRange(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4 * histogram.size()), cl::NDRange(histogram.size()), NULL, &atomicHistEvent);
+		}
+		else if (histogram_method == "partials") {
+			// With -m partials each work-group writes its local histogram to a row of a groups x bins buffer,
+			// and a second kernel adds up the columns. No global atomics are used so the result is deterministic,
+			// and it does not stall on hot bins when thousands of groups finish at once, or on CPU devices where global atomics are slow.
+			int groups = (int)(image_input.size() / histogram.size());
+			cl::Buffer partialHistograms(context, CL_MEM_READ_WRITE, groups * histogramSize); // One histogram per work-group
+
+			cl::Kernel kernel_local_partials(program, "local_partials");
+			kernel_local_partials.setArg(0, initialImageArray);
+			kernel_local_partials.setArg(1, partialHistograms);
+			kernel_local_partials.setArg(2, cl::Local(histogramSize));
+			kernel_local_partials.setArg(3, (int)image_input.size());
+			kernel_local_partials.setArg(4, hist);
+			kernel_local_partials.setArg(5, binsizeBuffer);
+			queue.enqueueNDRangeKernel(kernel_local_partials, cl::NullRange, cl::NDRange(image_input.size()), cl::NDRange(histogram.size()), NULL, &atomicHistEvent);
+
+			// The rows are added up in two passes, first into about sqrt(groups) rows and then into the final histogram,
+			// so each work-item adds a few hundred rows rather than all of them one after another.
+			int blocks = (int)ceil(sqrt((double)groups));
+			cl::Buffer blockHistograms(context, CL_MEM_READ_WRITE, blocks * histogramSize);
+
+			cl::Kernel kernel_reduce_partials(program, "reduce_partials");
+			kernel_reduce_partials.setArg(0, partialHistograms);
+			kernel_reduce_partials.setArg(1, blockHistograms);
+			kernel_reduce_partials.setArg(2, groups);
+			kernel_reduce_partials.setArg(3, hist);
+			queue.enqueueNDRangeKernel(kernel_reduce_partials, cl::NullRange, cl::NDRange(histogram.size(), blocks), cl::NullRange, NULL, &reduceBlocksEvent);
+
+			cl::Kernel kernel_reduce_blocks(program, "reduce_partials");
+			kernel_reduce_blocks.setArg(0, blockHistograms);
+			kernel_reduce_blocks.setArg(1, intensityHistogram);
+			kernel_reduce_blocks.setArg(2, blocks);
+			kernel_reduce_blocks.setArg(3, hist);
+			queue.enqueueNDRangeKernel(kernel_reduce_blocks, cl::NullRange, cl::NDRange(histogram.size(), 1), cl::NullRange, NULL, &reducePartialsEvent);
+		}
+		else if (histogram_method == "packed") {
+			// With -m packed the local histogram is kept in 16-bit counters, two to a uint, so each copy of it takes half the local memory.
+			// The space saved holds several copies (replicas) so neighbouring work-items do not share counters, or leaves room for more
+			// work-groups to run at once. The grid is sized to the device like -m persistent, so each group counts far more than
+			// 65535 pixels and the kernel adds its counters to the global histogram whenever they could overflow.
+			int replicas = 4;
+			size_t packedSize = replicas * ((hist + 1) / 2) * sizeof(cl_uint);
+			persistentGroups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+
+			cl::Kernel kernel_packed_histogram(program, "local_global_packed");
+			kernel_packed_histogram.setArg(0, initialImageArray);
+			kernel_packed_histogram.setArg(1, intensityHistogram);
+			kernel_packed_histogram.setArg(2, cl::Local(packedSize));
+			kernel_packed_histogram.setArg(3, (int)image_input.size());
+			kernel_packed_histogram.setArg(4, hist);
+			kernel_packed_histogram.setArg(5, binsizeBuffer);
+			kernel_packed_histogram.setArg(6, replicas);
+			queue.enqueueNDRangeKernel(kernel_packed_histogram, cl::NullRange, cl::NDRange(persistentGroups * histogram.size()), cl::NDRange(histogram.size()), NULL, &atomicHistEvent);
+		}
+		else if (histogram_method == "persistent") {
+			// With -m persistent the grid is sized to the device rather than the image, a few work-groups per compute unit,
+			// and each work-item loops over many pixels with 16 byte loads. The local histogram is zeroed and merged into the
+			// global one once per group, so instead of ~70,000 merges on test_large there are only a few hundred.
+			persistentGroups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+
+			cl::Kernel kernel_persistent_histogram(program, "local_global_persistent");
+			kernel_persistent_histogram.setArg(0, initialImageArray);
+			kernel_persistent_histogram.setArg(1, intensityHistogram);
+			kernel_persistent_histogram.setArg(2, cl::Local(histogramSize));
+			kernel_persistent_histogram.setArg(3, cl::Local(256 * sizeof(int)));
+			kernel_persistent_histogram.setArg(4, (int)image_input.size());
+			kernel_persistent_histogram.setArg(5, hist);
+			kernel_persistent_histogram.setArg(6, binsizeBuffer);
+			queue.enqueueNDRangeKernel(kernel_persistent_histogram, cl::NullRange, cl::NDRange(persistentGroups * histogram.size()), cl::NDRange(histogram.size()), NULL, &atomicHistEvent);
+		}
+		else {
+			// With -m subgroup (the default when the device has sub-groups) the local_global_subgroup version is used, it adds up
+			// equal bins across a sub-group first so dark or saturated images (try -w) do not queue every work-item on the same local atomic.
+			cl::Kernel kernel_atomic_histogram(program, histogram_method == "subgroup" ? "local_global_subgroup" : "local_global");
+			kernel_atomic_histogram.setArg(0, initialImageArray);
+			kernel_atomic_histogram.setArg(1, intensityHistogram);
+			kernel_atomic_histogram.setArg(2, cl::Local(histogramSize));
+			kernel_atomic_histogram.setArg(3, (int)image_input.size());
+			kernel_atomic_histogram.setArg(4, hist);
+			kernel_atomic_histogram.setArg(5, binsizeBuffer);
+			queue.enqueueNDRangeKernel(kernel_atomic_histogram, cl::NullRange, cl::NDRange(image_input.size()), cl::NDRange(histogram.size()), NULL, &atomicHistEvent);
+		}
 		// Read to console
 		queue.enqueueReadBuffer(intensityHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
 		cout << "Histogram = " << histogram << endl << endl;
@@ -193,7 +1080,8 @@ int main(int argc, char **argv) {
 		kernel_cumulativeHistogram.setArg(1, cumulativeHistogram);
 		kernel_cumulativeHistogram.setArg(2, cl::Local(histogramSize));
 		kernel_cumulativeHistogram.setArg(3, cl::Local(histogramSize));
-		queue.enqueueNDRangeKernel(kernel_cumulativeHistogram, cl::NullRange, cl::NDRange(histogramSize), cl::NDRange(histogram.size()), NULL, &cumulativeHistEvent);
+		// One work-group of one work-item per bin, histogramSize is in bytes and would scan past the end of the histogram
+		queue.enqueueNDRangeKernel(kernel_cumulativeHistogram, cl::NullRange, cl::NDRange(histogram.size()), cl::NDRange(histogram.size()), NULL, &cumulativeHistEvent);
 		// Read to console
 		queue.enqueueReadBuffer(cumulativeHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
 		cout << "Hillis-Steel Cumulative Histogram = " << histogram << endl << endl;
@@ -205,86 +1093,371 @@ int main(int argc, char **argv) {
 		//cl::Kernel blellochCumuHistogram(program, "blellochCumulative");
 		//blellochCumuHistogram.setArg(0, intensityHistogram);
 		//blellochCumuHistogram.setArg(1, cumulativeHistogram);
-		//queue.enqueueNDRangeKernel(blellochCumuHistogram, cl::NullRange, cl::NDRange(histogramSize), cl::NullRange, NULL, &blellochCumulEvent);
+		//// Its barriers only synchronise a work-group, so it has to run as a single one.
+		//queue.enqueueNDRangeKernel(blellochCumuHistogram, cl::NullRange, cl::NDRange(histogram.size()), cl::NDRange(histogram.size()), NULL, &blellochCumulEvent);
 		//// Read to console
 		//queue.enqueueReadBuffer(cumulativeHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
 		//cout << "Blelloch Cumulative Histogram = " << histogram << endl;
 		
 		
-		// Normalise the cumlative histogram to a maximum value of 255.
-		cl::Kernel kernel_normaliseHistogram(program, "normalise");
-		kernel_normaliseHistogram.setArg(0, cumulativeHistogram);
-		kernel_normaliseHistogram.setArg(1, normalisedHistogram);
-		kernel_normaliseHistogram.setArg(2, hist);
-		queue.enqueueNDRangeKernel(kernel_normaliseHistogram, cl::NullRange, cl::NDRange(256), cl::NullRange, NULL, &normaliseHistEvent);
-		// Read to console
-		queue.enqueueReadBuffer(normalisedHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
-		cout << "Normalised Histogram = " << histogram << endl << endl;
+		cl::Buffer percentileLevels(context, CL_MEM_READ_WRITE, 2 * sizeof(int)); // The low and high percentile intensities
+		cl::Buffer referenceCumulative(context, CL_MEM_READ_ONLY, 256 * sizeof(int)); // The reference cumulative histogram
+		if (stretch_percent >= 0) {
+			// With -s the lookup table is a contrast stretch (auto levels) instead of equalisation. The percentiles are found on the
+			// device from the same cumulative histogram and the stretch table is built there too, then lookup applies it as usual,
+			// so switching operator costs nothing extra per image.
+			int low = (int)(stretch_percent * 100 + 0.5); // in hundredths of a percent
+
+			// The levels start as 0 and 255, so the table is still defined if a percentile is never crossed
+			vector<int> levels = { 0, 255 };
+			queue.enqueueWriteBuffer(percentileLevels, CL_TRUE, 0, 2 * sizeof(int), &levels[0]);
+			cl::Kernel kernel_percentiles(program, "percentiles");
+			kernel_percentiles.setArg(0, cumulativeHistogram);
+			kernel_percentiles.setArg(1, percentileLevels);
+			kernel_percentiles.setArg(2, hist);
+			kernel_percentiles.setArg(3, low);
+			kernel_percentiles.setArg(4, 10000 - low);
+			kernel_percentiles.setArg(5, binsizeBuffer);
+			queue.enqueueNDRangeKernel(kernel_percentiles, cl::NullRange, cl::NDRange(histogram.size()), cl::NullRange, NULL, &percentileEvent);
+
+			cl::Kernel kernel_stretch(program, "stretch");
+			kernel_stretch.setArg(0, percentileLevels);
+			kernel_stretch.setArg(1, normalisedHistogram);
+			kernel_stretch.setArg(2, hist);
+			kernel_stretch.setArg(3, binsizeBuffer);
+			queue.enqueueNDRangeKernel(kernel_stretch, cl::NullRange, cl::NDRange(histogram.size()), cl::NullRange, NULL, &normaliseHistEvent);
+			// Read to console
+			queue.enqueueReadBuffer(percentileLevels, CL_TRUE, 0, 2 * sizeof(int), &levels[0]);
+			queue.enqueueReadBuffer(normalisedHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
+			cout << "Percentile Levels = " << levels << endl;
+			cout << "Contrast Stretch Histogram = " << histogram << endl << endl;
+		}
+		else if (reference_filename.empty()) {
+			// Normalise the cumlative histogram to a maximum value of 255.
+			cl::Kernel kernel_normaliseHistogram(program, doublePrecision ? "normalise" : "normalise_fixed");
+			kernel_normaliseHistogram.setArg(0, cumulativeHistogram);
+			kernel_normaliseHistogram.setArg(1, normalisedHistogram);
+			kernel_normaliseHistogram.setArg(2, hist);
+			queue.enqueueNDRangeKernel(kernel_normaliseHistogram, cl::NullRange, cl::NDRange(histogram.size()), cl::NullRange, NULL, &normaliseHistEvent);
+			// Read to console
+			queue.enqueueReadBuffer(normalisedHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
+			cout << "Normalised Histogram = " << histogram << endl << endl;
+		}
+		else {
+			// With -r the image is matched to the reference's histogram instead of a flat one. The match kernel takes the place
+			// of normalise and writes the lookup table, so the rest of the pipeline and its cost per image are the same.
+			vector<int> referenceCDF = LoadReferenceCDF(reference_filename);
+			queue.enqueueWriteBuffer(referenceCumulative, CL_TRUE, 0, 256 * sizeof(int), &referenceCDF[0]);
+
+			cl::Kernel kernel_match(program, "match");
+			kernel_match.setArg(0, cumulativeHistogram);
+			kernel_match.setArg(1, referenceCumulative);
+			kernel_match.setArg(2, normalisedHistogram);
+			kernel_match.setArg(3, hist);
+			queue.enqueueNDRangeKernel(kernel_match, cl::NullRange, cl::NDRange(histogram.size()), cl::NullRange, NULL, &normaliseHistEvent);
+			// Read to console
+			queue.enqueueReadBuffer(normalisedHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
+			cout << "Matched Histogram = " << histogram << endl << endl;
+		}
+
+		// Point ops given with -o (gamma, levels, threshold...) are collapsed into one 256 entry table on the host
+		// and composed into the lookup table here, so the lookup below still reads and writes the image only once.
+		PointOpChain chain = PointOpChain::Parse(point_ops);
+		cl::Buffer pointOpTable(context, CL_MEM_READ_ONLY, 256 * sizeof(int)); // The composed point op table
+		if (!chain.IsIdentity()) {
+			queue.enqueueWriteBuffer(pointOpTable, CL_TRUE, 0, 256 * sizeof(int), &chain.Get()[0]);
+
+			cl::Kernel kernel_compose(program, "compose");
+			kernel_compose.setArg(0, normalisedHistogram);
+			kernel_compose.setArg(1, pointOpTable);
+			kernel_compose.setArg(2, hist);
+			queue.enqueueNDRangeKernel(kernel_compose, cl::NullRange, cl::NDRange(histogram.size()), cl::NullRange, NULL, &composeEvent);
+			// Read to console
+			queue.enqueueReadBuffer(normalisedHistogram, CL_TRUE, 0, histogramSize, &histogram[0]);
+			cout << "Point Op Lookup Table = " << histogram << endl << endl;
+		}
 
 		// Use the cumulative histogram as a lookup table to map the intensity values to the original image.
-		cl::Kernel kernel_lookup(program, "lookup");
-		kernel_lookup.setArg(0, dev_image_input);
-		kernel_lookup.setArg(1, normalisedHistogram);
-		kernel_lookup.setArg(2, intensityMap);
-		kernel_lookup.setArg(3, hist);
-		kernel_lookup.setArg(4, binsizeBuffer);
-		queue.enqueueNDRangeKernel(kernel_lookup, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, &mapHistEvent);
+		// With -roi-only a rectangle is mapped by a 2D launch over it alone and a mask by lookup_masked.
+		auto applyLut = [&](int lutBins, cl::Event* event) {
+			if (roi_only && roi_width > 0) {
+				cl::Kernel kernel_lookup_roi(program, "lookup_roi");
+				kernel_lookup_roi.setArg(0, dev_image_input);
+				kernel_lookup_roi.setArg(1, normalisedHistogram);
+				kernel_lookup_roi.setArg(2, intensityMap);
+				kernel_lookup_roi.setArg(3, image_input.width());
+				kernel_lookup_roi.setArg(4, plane);
+				kernel_lookup_roi.setArg(5, planes);
+				kernel_lookup_roi.setArg(6, roi_x);
+				kernel_lookup_roi.setArg(7, roi_y);
+				kernel_lookup_roi.setArg(8, roi_width);
+				kernel_lookup_roi.setArg(9, roi_height);
+				kernel_lookup_roi.setArg(10, lutBins);
+				kernel_lookup_roi.setArg(11, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_lookup_roi, cl::NullRange, cl::NDRange((roi_width + 15) / 16 * 16, (roi_height + 15) / 16 * 16), cl::NDRange(16, 16), NULL, event);
+			}
+			else if (roi_only && !mask_filename.empty()) {
+				cl::Kernel kernel_lookup_masked(program, "lookup_masked");
+				kernel_lookup_masked.setArg(0, dev_image_input);
+				kernel_lookup_masked.setArg(1, maskBuffer);
+				kernel_lookup_masked.setArg(2, normalisedHistogram);
+				kernel_lookup_masked.setArg(3, intensityMap);
+				kernel_lookup_masked.setArg(4, plane);
+				kernel_lookup_masked.setArg(5, lutBins);
+				kernel_lookup_masked.setArg(6, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_lookup_masked, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, event);
+			}
+			else {
+				cl::Kernel kernel_lookup(program, "lookup");
+				kernel_lookup.setArg(0, dev_image_input);
+				kernel_lookup.setArg(1, normalisedHistogram);
+				kernel_lookup.setArg(2, intensityMap);
+				kernel_lookup.setArg(3, lutBins);
+				kernel_lookup.setArg(4, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_lookup, cl::NullRange, cl::NDRange(image_input.size()), cl::NullRange, NULL, event);
+			}
+		};
+		// Only the rectangle is read back for -roi-only, into an output that already holds the input everywhere else.
+		auto readOutput = [&](unsigned char* output) {
+			if (roi_only && roi_width > 0) {
+				array<size_t, 3> origin = { (size_t)roi_x, (size_t)roi_y, 0 };
+				array<size_t, 3> region = { (size_t)roi_width, (size_t)roi_height, (size_t)planes };
+				queue.enqueueReadBufferRect(intensityMap, CL_TRUE, origin, origin, region, image_input.width(), plane, image_input.width(), plane, output);
+			}
+			else {
+				queue.enqueueReadBuffer(intensityMap, CL_TRUE, 0, image_input.size(), output);
+			}
+		};
+		applyLut(hist, &mapHistEvent);
 		
 		
 		// 4.3 Copy the result from device to the host.
-		queue.enqueueReadBuffer(intensityMap, CL_TRUE, 0, intensity_map.size(), &intensity_map.data()[0]);
+		if (roi_only && roi_width > 0) {
+			copy(image_input.begin(), image_input.end(), intensity_map.begin());
+		}
+		readOutput(intensity_map.data());
 
 		CImg<unsigned char> output_image(intensity_map.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
 		CImgDisplay disp_output(output_image,"output");
 		
 		
 		// 4.4 Timings of the events for each of the kernels.
+		// With -roofline each one is followed by how close it came to the device's bandwidth or local atomic roof, from the
+		// bytes it moves: the image stages read and write every byte, the histograms read every byte and count each pixel
+		// with a local atomic, and the table stages move histogramSize bytes, far too few to get near the roof.
+		double imageBytes = (double)image_input.size();
 		// The events are not used in the final version, but can be used to see the time taken for each kernel.
 		// The events are also used to see the time taken for the entire process.
 		if (image_input.spectrum() == 3) {
 			// If the image had to be converted to RGB then cout how long it took.
-			std::cout << "RGB to greyscale took: " << rgbEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - rgbEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+			std::cout << "RGB to greyscale took: " << rgbEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - rgbEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(2.0 * imageBytes, imageBytes, 0, rgbEvent) << std::endl;
 		}
 		else
 		{
 			// If the image was already greyscale, then cout how long it took.
-			std::cout << "Greyscale copy took: " << greyEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - greyEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+			std::cout << "Greyscale copy took: " << greyEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - greyEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(2.0 * imageBytes, imageBytes, 0, greyEvent) << std::endl;
 		}
 		
 		if (histFired)
 		{
 			// If the histogram was calculated, then cout how long it took.
-			std::cout << "Histogram took: " << histEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+			std::cout << "Histogram took: " << histEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - histEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(imageBytes, 0, imageBytes, histEvent) << std::endl;
+		}
+		else if (roi_width > 0 || !mask_filename.empty())
+		{
+			// If only the region of interest was counted, then cout how long it took and how many pixels it covered.
+			// roi_histogram only reads the rectangle, masked_histogram reads every pixel and its mask byte.
+			double readBytes = roi_width > 0 ? (double)countedPixels : 2.0 * imageBytes;
+			std::cout << (roi_width > 0 ? "ROI rectangle histogram (" : "Masked histogram (") << countedPixels << " pixels) took: " << atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(readBytes, 0, (double)countedPixels, atomicHistEvent) << std::endl;
+		}
+		else if (histogram_method == "partials")
+		{
+			// If the partials histogram was calculated, cout both kernels and their sum to compare with the atomic version.
+			cl_ulong partialsTime = atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cl_ulong reduceTime = reducePartialsEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - reduceBlocksEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			std::cout << "Partials histogram took: " << partialsTime << "ns" << roofline.Report(imageBytes, 0, imageBytes, atomicHistEvent) << ", reduction took: " << reduceTime << "ns, " << partialsTime + reduceTime << "ns in total to complete" << std::endl;
+		}
+		else if (histogram_method == "packed")
+		{
+			// If the packed histogram was calculated, then cout how long it took and how many groups it used.
+			std::cout << "Packed 16-bit histogram (" << persistentGroups << " work-groups) took: " << atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(imageBytes, 0, (double)countedPixels, atomicHistEvent) << std::endl;
+		}
+		else if (histogram_method == "persistent")
+		{
+			// If the persistent histogram was calculated, then cout how long it took and how many groups it used.
+			std::cout << "Persistent histogram (" << persistentGroups << " work-groups) took: " << atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(imageBytes, 0, (double)countedPixels, atomicHistEvent) << std::endl;
 		}
 		else
 		{
 			// If the atomic histogram was calculated, then cout how long it took.
-			std::cout << "Atomic histogram took: " << atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+			std::cout << (histogram_method == "subgroup" ? "Sub-group atomic histogram took: " : "Atomic histogram took: ") << atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - atomicHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(imageBytes, 0, (double)countedPixels, atomicHistEvent) << std::endl;
 		}
 		
 		if (hillisFired)
 		{
 			// If the Hillis-Steel cumulative histogram was calculated, then cout how long it took.
-			std::cout << "Hillis-Steel optimized cumulative histogram took: " << cumulativeHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cumulativeHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+			std::cout << "Hillis-Steel optimized cumulative histogram took: " << cumulativeHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - cumulativeHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(2.0 * histogramSize, histogramSize, 0, cumulativeHistEvent) << std::endl;
 		}
 		else
 		{
 			// If the blelloch cumulative histogram was calculated, then cout how long it took.
-			std::cout << "Blelloch cumulative histogram took: " << blellochCumulEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - blellochCumulEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+			std::cout << "Blelloch cumulative histogram took: " << blellochCumulEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - blellochCumulEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(2.0 * histogramSize, histogramSize, 0, blellochCumulEvent) << std::endl;
 		}
 		
-		std::cout << "Normalise histogram took: " << normaliseHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - normaliseHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
-		std::cout << "Lookup table took: " << mapHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mapHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << std::endl;
+		if (stretch_percent >= 0)
+		{
+			std::cout << "Percentiles took: " << percentileEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - percentileEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(histogramSize + 2 * sizeof(int), 2 * sizeof(int), 0, percentileEvent) << std::endl;
+		}
+		std::cout << (stretch_percent >= 0 ? "Contrast stretch took: " : reference_filename.empty() ? "Normalise histogram took: " : "Histogram matching took: ") << normaliseHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - normaliseHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(2.0 * histogramSize, histogramSize, 0, normaliseHistEvent) << std::endl;
+		if (!chain.IsIdentity())
+		{
+			std::cout << "Composing the point ops took: " << composeEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - composeEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(2.0 * histogramSize, histogramSize, 0, composeEvent) << std::endl;
+		}
+		std::cout << "Lookup table took: " << mapHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - mapHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() << "ns to complete" << roofline.Report(2.0 * imageBytes, imageBytes, 0, mapHistEvent) << std::endl;
 		
 		// Add all start and end times together to get the total time.
 		cl_ulong commandStart = (image_input.spectrum() == 3) ? rgbEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>() : greyEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
 		std::cout << "Total time for the kernels to execute from start to finish was: " <<  (float)(mapHistEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>()-commandStart)/1000000000 << "s to complete" << std::endl;
 
- 		while (!disp_input.is_closed() && !disp_output.is_closed()
+		// The viewer sleeps until a window has an event instead of polling, and the keys change the pipeline live:
+		// up and down double or halve the bins, left and right lower or raise the clip limit, and o switches between
+		// equalisation, contrast stretch and (with -r) matching. Everything stays on the device, so only the stages after
+		// the change run again. The full 256 bin histogram is kept and a coarser one is just adjacent bins added together
+		// (coarsen), so the pixels are never counted a second time. The time each update took is shown in the title bar.
+		cl::Buffer coarseHistogram(context, CL_MEM_READ_WRITE, histogramSize); // The full histogram with adjacent bins added up
+		cl::Buffer clippedHistogram(context, CL_MEM_READ_WRITE, histogramSize); // The coarse histogram after clipping
+		int bins = hist;
+		double clip = 0; // the clip limit in multiples of the mean bin height, 0 means no clipping
+		string lutOperator = stretch_percent >= 0 ? "stretch" : reference_filename.empty() ? "equalise" : "match";
+		int stretchLow = (int)((stretch_percent >= 0 ? stretch_percent : 1.0) * 100 + 0.5); // in hundredths of a percent, 1% unless -s said otherwise
+
+		auto update = [&](bool histogramChanged) {
+			auto updateStart = chrono::high_resolution_clock::now();
+
+			if (histogramChanged) {
+				vector<int> coarseBinvals(bins);
+				for (int i = 0; i < bins; i++) {
+					coarseBinvals[i] = i * (256 / bins);
+				}
+				queue.enqueueWriteBuffer(binsizeBuffer, CL_TRUE, 0, bins * sizeof(int), &coarseBinvals[0]);
+
+				cl::Kernel kernel_coarsen(program, "coarsen");
+				kernel_coarsen.setArg(0, intensityHistogram);
+				kernel_coarsen.setArg(1, coarseHistogram);
+				kernel_coarsen.setArg(2, bins);
+				kernel_coarsen.setArg(3, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_coarsen, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+
+				if (clip > 0) {
+					cl::Kernel kernel_clip(program, "clip_histogram");
+					kernel_clip.setArg(0, coarseHistogram);
+					kernel_clip.setArg(1, clippedHistogram);
+					kernel_clip.setArg(2, cl::Local(sizeof(int)));
+					kernel_clip.setArg(3, bins);
+					kernel_clip.setArg(4, max(1, (int)(clip * countedPixels / bins)));
+					queue.enqueueNDRangeKernel(kernel_clip, cl::NullRange, cl::NDRange(bins), cl::NDRange(bins));
+				}
+
+				cl::Kernel kernel_rescan(program, "cumulativeHistogram");
+				kernel_rescan.setArg(0, clip > 0 ? clippedHistogram : coarseHistogram);
+				kernel_rescan.setArg(1, cumulativeHistogram);
+				kernel_rescan.setArg(2, cl::Local(bins * sizeof(int)));
+				kernel_rescan.setArg(3, cl::Local(bins * sizeof(int)));
+				queue.enqueueNDRangeKernel(kernel_rescan, cl::NullRange, cl::NDRange(bins), cl::NDRange(bins));
+			}
+
+			if (lutOperator == "stretch") {
+				vector<int> levels = { 0, 255 };
+				queue.enqueueWriteBuffer(percentileLevels, CL_TRUE, 0, 2 * sizeof(int), &levels[0]);
+				cl::Kernel kernel_repercentiles(program, "percentiles");
+				kernel_repercentiles.setArg(0, cumulativeHistogram);
+				kernel_repercentiles.setArg(1, percentileLevels);
+				kernel_repercentiles.setArg(2, bins);
+				kernel_repercentiles.setArg(3, stretchLow);
+				kernel_repercentiles.setArg(4, 10000 - stretchLow);
+				kernel_repercentiles.setArg(5, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_repercentiles, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+
+				cl::Kernel kernel_restretch(program, "stretch");
+				kernel_restretch.setArg(0, percentileLevels);
+				kernel_restretch.setArg(1, normalisedHistogram);
+				kernel_restretch.setArg(2, bins);
+				kernel_restretch.setArg(3, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_restretch, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+			}
+			else if (lutOperator == "match") {
+				cl::Kernel kernel_rematch(program, "match");
+				kernel_rematch.setArg(0, cumulativeHistogram);
+				kernel_rematch.setArg(1, referenceCumulative);
+				kernel_rematch.setArg(2, normalisedHistogram);
+				kernel_rematch.setArg(3, bins);
+				queue.enqueueNDRangeKernel(kernel_rematch, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+			}
+			else {
+				cl::Kernel kernel_renormalise(program, doublePrecision ? "normalise" : "normalise_fixed");
+				kernel_renormalise.setArg(0, cumulativeHistogram);
+				kernel_renormalise.setArg(1, normalisedHistogram);
+				kernel_renormalise.setArg(2, bins);
+				queue.enqueueNDRangeKernel(kernel_renormalise, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+			}
+
+			if (!chain.IsIdentity()) {
+				cl::Kernel kernel_recompose(program, "compose");
+				kernel_recompose.setArg(0, normalisedHistogram);
+				kernel_recompose.setArg(1, pointOpTable);
+				kernel_recompose.setArg(2, bins);
+				queue.enqueueNDRangeKernel(kernel_recompose, cl::NullRange, cl::NDRange(bins), cl::NullRange);
+			}
+
+			applyLut(bins, NULL);
+			readOutput(output_image.data());
+			disp_output.display(output_image);
+
+			double latency = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - updateStart).count();
+			disp_output.set_title("output - %s, %d bins, clip %.1f - %.2f ms", lutOperator.c_str(), bins, clip, latency);
+		};
+
+		// The keys need the full histogram, which the counting kernels only give when hist is 256.
+		bool interactive = hist == 256;
+		disp_output.set_title("output - %s, %d bins, clip %.1f", lutOperator.c_str(), bins, clip);
+
+		while (!disp_input.is_closed() && !disp_output.is_closed()
 			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-		    disp_input.wait(1);
-		    disp_output.wait(1);
-	    }		
+			CImgDisplay::wait(disp_input, disp_output);
+			if (!interactive) {
+				continue;
+			}
+
+			auto pressed = [&](unsigned int key) { return disp_input.is_key(key) || disp_output.is_key(key); };
+			bool histogramChanged = false;
+			bool lutChanged = false;
+			if (pressed(cimg::keyARROWUP) && bins < 256) {
+				bins *= 2;
+				histogramChanged = true;
+			}
+			else if (pressed(cimg::keyARROWDOWN) && bins > 2) {
+				bins /= 2;
+				histogramChanged = true;
+			}
+			else if (pressed(cimg::keyARROWRIGHT)) {
+				clip += 0.5;
+				histogramChanged = true;
+			}
+			else if (pressed(cimg::keyARROWLEFT) && clip > 0) {
+				clip = max(0.0, clip - 0.5);
+				histogramChanged = true;
+			}
+			else if (pressed(cimg::keyO)) {
+				lutOperator = lutOperator == "equalise" ? "stretch" : lutOperator == "stretch" && !reference_filename.empty() ? "match" : "equalise";
+				lutChanged = true;
+			}
+
+			if (histogramChanged || lutChanged) {
+				disp_input.set_key();
+				disp_output.set_key();
+				update(histogramChanged);
+			}
+		}
 
 	}
 	catch (const cl::Error& err) {
@@ -293,6 +1466,9 @@ int main(int argc, char **argv) {
 	catch (CImgException& err) {
 		std::cerr << "ERROR: " << err.what() << std::endl;
 	}
+	catch (const runtime_error& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+	}
 
 	return 0;
 }
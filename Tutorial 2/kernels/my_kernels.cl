@@ -1,3 +1,8 @@
+// double is optional in OpenCL, the kernels that use it are only built when the device has cl_khr_fp64.
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
 // OpenCL kernel to convert an RGB image to grey scale.
 kernel void rgb2grey(global const uchar* A, global uchar* B) {
 	int id = get_global_id(0);
@@ -15,6 +20,25 @@ kernel void rgb2grey(global const uchar* A, global uchar* B) {
 	}
 }
 
+// OpenCL kernel to convert an RGB image to grey scale with integer maths, so every device gives the same result.
+// The weights of rgb2grey are stored in Q16 fixed point (weight * 65536, rounded to nearest): 13933, 46875 and 4732.
+// The weighted sum is shifted down by 16, which truncates like the conversion from double in rgb2grey. The rounded weights
+// put a few colours one grey level away from rgb2grey, but the result is the same on every device.
+// The weights add up to 65540, so the sum of three 255s still shifts down to 255 and cannot overflow a uchar.
+kernel void rgb2grey_fixed(global const uchar* A, global uchar* B) {
+	int id = get_global_id(0);
+	int image_size = get_global_size(0) / 3; //each image consists of 3 colour channels
+	int colour_channel = id / image_size; // 0 - red, 1 - green, 2 - blue
+
+	if (colour_channel == 0) {
+		uint value = (A[id] * 13933u + A[id + image_size] * 46875u + A[id + (image_size * 2)] * 4732u) >> 16;
+		// Copy the value across all three colour chanels.
+		B[id] = value;
+		B[id + image_size] = value;
+		B[id + (image_size * 2)] = value;
+	}
+}
+
 // A simple OpenCL kernel which copies all pixels from A to B.
 kernel void identity(global const uchar* A, global uchar* B) {
 	int id = get_global_id(0);
@@ -27,8 +51,9 @@ kernel void histogram(global const uchar* A, global int* B, int histSize, int im
 	int id = get_global_id(0);
 	int value = A[id];
 	// Loops through the image and if the value is within the range of the histogram, increment the histogram bin.
+	// The last bin has no upper bound in binsizeBuffer (it holds histSize entries), it takes everything up to 255.
 	for (int i = 0; i < histSize; i++) {
-		if (value >= binsizeBuffer[i] && value < binsizeBuffer[i + 1]) {
+		if (value >= binsizeBuffer[i] && (i == histSize - 1 || value < binsizeBuffer[i + 1])) {
 			B[i]++;
 		}
 	}
@@ -59,7 +84,8 @@ kernel void local_global(global const uchar* A, global int* H, local int* LH, in
 	{
 		for (size_t j = 0; j < histBins; j++)
 		{
-			if (A[i] >= binsizeBuffer[j] && A[i] < binsizeBuffer[j + 1])
+			// The last bin has no upper bound in binsizeBuffer, it takes everything up to 255.
+			if (A[i] >= binsizeBuffer[j] && (j == histBins - 1 || A[i] < binsizeBuffer[j + 1]))
 			{
 				atomic_inc(&LH[j]);
 				break;
@@ -77,6 +103,538 @@ kernel void local_global(global const uchar* A, global int* H, local int* LH, in
 	}
 }
 
+// OpenCL kernel which calculates separate red, green and blue histograms in one pass over a colour image.
+// Each work-item reads the three channels of its pixel (the image is stored one channel after another, plane pixels each)
+// and counts them in three local histograms that sit next to each other in LH, which are added to H the same way.
+kernel void rgb_histogram(global const uchar* A, global int* H, local int* LH, int plane, int histBins, global int* binsizeBuffer) {
+	int gid = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int gsize = get_global_size(0);
+
+	// Set the three Local Histograms to 0
+	for (int i = lid; i < 3 * histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+
+	// Wait for all threads to finish setting local histogram bins to 0
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Compute the Local Histograms, one read of each channel
+	for (int i = gid; i < plane; i += gsize)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			int value = A[i + c * plane];
+			for (int j = 0; j < histBins; j++)
+			{
+				if (value >= binsizeBuffer[j] && (j == histBins - 1 || value < binsizeBuffer[j + 1]))
+				{
+					atomic_inc(&LH[c * histBins + j]);
+					break;
+				}
+			}
+		}
+	}
+
+	// Wait for all threads to finish computing local histogram
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Copy Local Histograms to Global Histograms
+	for (int i = lid; i < 3 * histBins; i += lsize)
+	{
+		atomic_add(&H[i], LH[i]);
+	}
+}
+
+// OpenCL kernel which calculates the local histograms like local_global, but instead of adding them into the global
+// histogram with atomics each work-group writes its histogram to its own row of P (groups x histBins).
+// reduce_partials then adds the rows together, so there are no global atomics and the result is always the same.
+kernel void local_partials(global const uchar* A, global int* P, local int* LH, int A_size, int histBins, global int* binsizeBuffer) {
+	int gid = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int gsize = get_global_size(0);
+	int group = get_group_id(0);
+
+	// Set Local Histogram Bins to 0
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+
+	// Wait for all threads to finish setting local histogram bins to 0
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Compute Local Histogram
+	for (int i = gid; i < A_size; i += gsize)
+	{
+		for (int j = 0; j < histBins; j++)
+		{
+			if (A[i] >= binsizeBuffer[j] && (j == histBins - 1 || A[i] < binsizeBuffer[j + 1]))
+			{
+				atomic_inc(&LH[j]);
+				break;
+			}
+		}
+	}
+
+	// Wait for all threads to finish computing local histogram
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Write this group's histogram to its row of the partials buffer, no other group touches it.
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		P[group * histBins + i] = LH[i];
+	}
+}
+
+// OpenCL kernel which adds the partial histograms from local_partials together in column blocks, launched as histBins x blocks.
+// Work-item (bin, b) adds rows b, b + blocks, b + 2 * blocks, ... of its bin and writes the sum to row b of H, so one launch
+// turns groups rows into blocks rows. The host runs it twice, into about sqrt(groups) rows and then into the one row of the
+// final histogram, so each work-item adds a few hundred rows rather than all of them one after another.
+// Neighbouring work-items read neighbouring bins of the same row, so the reads are coalesced.
+kernel void reduce_partials(global const int* P, global int* H, int groups, int histBins) {
+	int id = get_global_id(0);
+	int block = get_global_id(1);
+	int blocks = get_global_size(1);
+	int sum = 0;
+
+	if (id >= histBins)
+		return;
+
+	for (int g = block; g < groups; g += blocks)
+	{
+		sum += P[g * histBins + id];
+	}
+	H[block * histBins + id] = sum;
+}
+
+// OpenCL kernel which calculates an intensity histogram with packed 16-bit counters in local memory.
+// Two bins share each uint of LP, so a copy of the histogram takes half the local memory of local_global and the same budget
+// holds twice as many copies (replicas). Work-items are spread over the replicas so neighbours rarely hit the same counter.
+// The host launches only a few work-groups per compute unit and each work-item loops over many pixels, so a 16-bit counter
+// can fill up: before any can overflow, the replicas are added straight into the global histogram and start again from 0.
+// There is no 32-bit copy of the histogram in local memory, the packed words are all the group keeps.
+kernel void local_global_packed(global const uchar* A, global int* H, local uint* LP, int A_size, int histBins, global int* binsizeBuffer, int replicas) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int gsize = get_global_size(0);
+	int words = (histBins + 1) / 2; // packed words per replica
+	local uint* replica = LP + (lid % replicas) * words;
+	// Each pass adds at most ceil(lsize / replicas) to a counter, this many passes are safe before a flush.
+	int flushEvery = 65535 / ((lsize + replicas - 1) / replicas);
+	int passes = 0;
+
+	// Set the packed replicas to 0
+	for (int i = lid; i < words * replicas; i += lsize)
+	{
+		LP[i] = 0;
+	}
+
+	// Wait for all threads to finish setting local histogram bins to 0
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Compute Local Histogram, the loop steps a whole work-group at a time so every work-item reaches the flush barriers.
+	for (int base = get_group_id(0) * lsize; base < A_size; base += gsize)
+	{
+		int i = base + lid;
+
+		if (i < A_size)
+		{
+			for (int j = 0; j < histBins; j++)
+			{
+				if (A[i] >= binsizeBuffer[j] && (j == histBins - 1 || A[i] < binsizeBuffer[j + 1]))
+				{
+					atomic_add(&replica[j / 2], 1u << ((j % 2) * 16));
+					break;
+				}
+			}
+		}
+
+		// Add the packed counters to the Global Histogram before they can overflow, and start them again from 0.
+		if (++passes == flushEvery)
+		{
+			barrier(CLK_LOCAL_MEM_FENCE);
+			for (int j = lid; j < histBins; j += lsize)
+			{
+				int sum = 0;
+				for (int r = 0; r < replicas; r++)
+				{
+					sum += (LP[r * words + j / 2] >> ((j % 2) * 16)) & 0xFFFF;
+				}
+				if (sum > 0)
+					atomic_add(&H[j], sum);
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+			for (int j = lid; j < words * replicas; j += lsize)
+			{
+				LP[j] = 0;
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+			passes = 0;
+		}
+	}
+
+	// Wait for all threads to finish computing local histogram
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Add what is left in the packed replicas to the Global Histogram
+	for (int j = lid; j < histBins; j += lsize)
+	{
+		int sum = 0;
+		for (int r = 0; r < replicas; r++)
+		{
+			sum += (LP[r * words + j / 2] >> ((j % 2) * 16)) & 0xFFFF;
+		}
+		atomic_add(&H[j], sum);
+	}
+}
+
+// OpenCL kernel which calculates an intensity histogram with a persistent launch, the host starts only a few work-groups
+// per compute unit and each work-item loops over many pixels instead of one. The zeroing and the merge into H happen once
+// per group, so with a few hundred groups the global merge traffic is a tiny fraction of the one-pixel-per-work-item launch.
+// Pixels are read 16 at a time with vload16, neighbouring work-items read neighbouring 16 byte chunks so the loads coalesce.
+// The bin search is done once per group into binOf (256 entries), after that each pixel is one local lookup.
+kernel void local_global_persistent(global const uchar* A, global int* H, local int* LH, local int* binOf, int A_size, int histBins, global int* binsizeBuffer) {
+	int gid = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int gsize = get_global_size(0);
+	int chunks = A_size / 16;
+
+	// Set Local Histogram Bins to 0 and work out which bin each intensity falls in
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+	for (int v = lid; v < 256; v += lsize)
+	{
+		int bin = 0;
+		for (int j = 0; j < histBins; j++)
+		{
+			if (v >= binsizeBuffer[j])
+				bin = j;
+		}
+		binOf[v] = bin;
+	}
+
+	// Wait for all threads to finish setting local histogram bins to 0
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Compute Local Histogram, 16 pixels per load
+	for (int c = gid; c < chunks; c += gsize)
+	{
+		uchar pixels[16];
+		vstore16(vload16(c, A), 0, pixels);
+		for (int k = 0; k < 16; k++)
+		{
+			atomic_inc(&LH[binOf[pixels[k]]]);
+		}
+	}
+	// The last few pixels that do not fill a chunk
+	for (int i = chunks * 16 + gid; i < A_size; i += gsize)
+	{
+		atomic_inc(&LH[binOf[A[i]]]);
+	}
+
+	// Wait for all threads to finish computing local histogram
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Copy Local Histograms to Global Histogram
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		atomic_add(&H[i], LH[i]);
+	}
+}
+
+// OpenCL kernel which calculates the intensity histogram of a rectangle of the image only (a region of interest).
+// The launch is 2D over the rectangle, rounded up to whole work-groups, and each work-item finds its pixel from the row
+// pitch (the image width), so only the rows and columns inside the rectangle are read and the cost follows its area.
+// Every plane (colour channel or volume slice) is counted at the same position.
+kernel void roi_histogram(global const uchar* A, global int* H, local int* LH, int width, int plane, int planes, int x0, int y0, int roiWidth, int roiHeight, int histBins, global int* binsizeBuffer) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	int lsize = get_local_size(0) * get_local_size(1);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (x < roiWidth && y < roiHeight)
+	{
+		for (int c = 0; c < planes; c++)
+		{
+			int value = A[c * plane + (y0 + y) * width + x0 + x];
+			for (int j = 0; j < histBins; j++)
+			{
+				if (value >= binsizeBuffer[j] && (j == histBins - 1 || value < binsizeBuffer[j + 1]))
+				{
+					atomic_inc(&LH[j]);
+					break;
+				}
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		if (LH[i] != 0)
+			atomic_add(&H[i], LH[i]);
+	}
+}
+
+// OpenCL kernel which calculates the intensity histogram of the pixels under a mask, for regions of any shape.
+// M holds one byte per pixel of a plane, non-zero inside the region, and every plane of A uses the same mask.
+// The mask test is fused into the counting pass, so no masked copy of the image is ever written.
+kernel void masked_histogram(global const uchar* A, global const uchar* M, global int* H, local int* LH, int A_size, int plane, int histBins, global int* binsizeBuffer) {
+	int gid = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int gsize = get_global_size(0);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = gid; i < A_size; i += gsize)
+	{
+		if (M[i % plane] == 0)
+			continue;
+		int value = A[i];
+		for (int j = 0; j < histBins; j++)
+		{
+			if (value >= binsizeBuffer[j] && (j == histBins - 1 || value < binsizeBuffer[j + 1]))
+			{
+				atomic_inc(&LH[j]);
+				break;
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		if (LH[i] != 0)
+			atomic_add(&H[i], LH[i]);
+	}
+}
+
+// The view_ kernels read images described by strides (see ImageView.h): pixel (x, y) of channel c is at
+// y * rowPitch + x * pixelStride + c * channelStride. That covers planar and interleaved images, padded rows and
+// sub-images, so nothing has to be repacked into a dense buffer first. They are launched 2D over the pixels.
+
+// OpenCL kernel which calculates the intensity histogram of a strided image, with the grey level of colour pixels
+// worked out on the fly with the rgb2grey_fixed weights, so no grey copy of the image is written. Channels after
+// the third (alpha) are ignored, and a one channel image is counted as it is. The strides are 64-bit, so a view can
+// reach pixels more than 2 GiB from its start.
+kernel void view_histogram(global const uchar* A, global int* H, local int* LH, int width, int height, ulong rowPitch, ulong pixelStride, ulong channelStride, int channels, int histBins, global int* binsizeBuffer) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int lid = get_local_id(1) * get_local_size(0) + get_local_id(0);
+	int lsize = get_local_size(0) * get_local_size(1);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (x < width && y < height)
+	{
+		ulong at = y * rowPitch + x * pixelStride;
+		int value = A[at];
+		if (channels >= 3)
+			value = (A[at] * 13933u + A[at + channelStride] * 46875u + A[at + 2 * channelStride] * 4732u) >> 16;
+		for (int j = 0; j < histBins; j++)
+		{
+			if (value >= binsizeBuffer[j] && (j == histBins - 1 || value < binsizeBuffer[j + 1]))
+			{
+				atomic_inc(&LH[j]);
+				break;
+			}
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		if (LH[i] != 0)
+			atomic_add(&H[i], LH[i]);
+	}
+}
+
+// Sub-group histogram, only compiled when the device supports sub-groups (the host checks CL_DEVICE_EXTENSIONS).
+#if defined(cl_khr_subgroups) || defined(cl_intel_subgroups)
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+// Number of leader rounds a sub-group spends merging equal bins before the remaining lanes fall back to atomic_inc.
+#define SUBGROUP_ROUNDS 4
+
+// OpenCL kernel which calculates an intensity histogram like local_global, but each sub-group adds up the lanes that
+// hit the same bin before touching local memory. On dark or saturated images most of a sub-group lands in one bin,
+// so one atomic_add replaces up to a sub-group's worth of atomic_inc calls on the same address.
+// Every lane of a sub-group has to reach the sub-group functions together, so the pixel loop steps a whole work-group at a time.
+kernel void local_global_subgroup(global const uchar* A, global int* H, local int* LH, int A_size, int histBins, global int* binsizeBuffer) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	int gsize = get_global_size(0);
+	uint sglid = get_sub_group_local_id();
+
+	// Set Local Histogram Bins to 0
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+
+	// Wait for all threads to finish setting local histogram bins to 0
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Compute Local Histogram
+	for (int base = get_group_id(0) * lsize; base < A_size; base += gsize)
+	{
+		int i = base + lid;
+		int bin = -1; // -1 marks a lane with nothing (left) to count
+
+		if (i < A_size)
+		{
+			for (int j = 0; j < histBins; j++)
+			{
+				if (A[i] >= binsizeBuffer[j] && (j == histBins - 1 || A[i] < binsizeBuffer[j + 1]))
+				{
+					bin = j;
+					break;
+				}
+			}
+		}
+
+		// The lowest lane still holding a bin leads the round, every lane with the same bin is counted in one atomic.
+		for (int round = 0; round < SUBGROUP_ROUNDS && sub_group_any(bin >= 0); round++)
+		{
+			uint leader = sub_group_reduce_min(bin >= 0 ? sglid : UINT_MAX);
+			int leaderBin = sub_group_broadcast(bin, leader);
+			int count = sub_group_reduce_add(bin == leaderBin ? 1 : 0);
+
+			if (sglid == leader)
+			{
+				atomic_add(&LH[leaderBin], count);
+			}
+			if (bin == leaderBin)
+			{
+				bin = -1;
+			}
+		}
+
+		// Whatever is left after the rounds is spread over many bins, so it is cheaper to count it directly.
+		if (bin >= 0)
+		{
+			atomic_inc(&LH[bin]);
+		}
+	}
+
+	// Wait for all threads to finish computing local histogram
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Copy Local Histograms to Global Histogram
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		atomic_add(&H[i], LH[i]);
+	}
+}
+#endif
+
+// 64-bit finaliser from MurmurHash3, spreads every input bit over the whole result.
+inline ulong mix64(ulong x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdUL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53UL;
+	x ^= x >> 33;
+	return x;
+}
+
+// OpenCL kernel which hashes the image for the lookup table cache, launched like local_global_persistent with a few groups.
+// Every 16 byte chunk is mixed together with its index and the results are added up, addition does not care about order
+// so the work-items can hash their chunks in any order and still agree with each other. Each group adds up its
+// work-items in local memory (the local size must be a power of 2) and writes one partial to P, the host adds the partials.
+// This is a fast content hash for spotting repeated images, not a cryptographic one. The size and positions are 64-bit,
+// so images of 2 GiB and more are hashed whole.
+kernel void hash_blocks(global const uchar* A, global ulong* P, local ulong* scratch, ulong A_size) {
+	ulong gid = get_global_id(0);
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+	ulong gsize = get_global_size(0);
+	ulong chunks = A_size / 16;
+	ulong h = 0;
+
+	for (ulong c = gid; c < chunks; c += gsize)
+	{
+		uchar16 v = vload16(c, A);
+		h += mix64(as_ulong(v.lo) ^ mix64(as_ulong(v.hi) ^ (ulong)c));
+	}
+	// The last few bytes that do not fill a chunk
+	for (ulong i = chunks * 16 + gid; i < A_size; i += gsize)
+	{
+		h += mix64((i << 8) | A[i]);
+	}
+
+	scratch[lid] = h;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int stride = lsize / 2; stride > 0; stride /= 2) {
+		if (lid < stride)
+			scratch[lid] += scratch[lid + stride];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		P[get_group_id(0)] = scratch[0];
+}
+
+// OpenCl kernel which derives a coarser histogram from the full 256 bin one by adding up adjacent bins, one work-item per coarse bin.
+// binsizeBuffer holds the first intensity of every coarse bin, so the result is the same histogram the counting kernels would
+// give with histBins bins, without reading the image again.
+kernel void coarsen(global const int* A, global int* H, int histBins, global int* binsizeBuffer) {
+	int id = get_global_id(0);
+	if (id >= histBins)
+		return;
+
+	int end = id == histBins - 1 ? 256 : binsizeBuffer[id + 1];
+	int sum = 0;
+	for (int v = binsizeBuffer[id]; v < end; v++)
+	{
+		sum += A[v];
+	}
+	H[id] = sum;
+}
+
+// OpenCl kernel which clips every bin of a histogram at limit and spreads the pixels cut off evenly over all the bins,
+// as in contrast limited equalisation. Tall bins are what make equalisation stretch the noise in flat areas, capping them
+// limits the slope of the lookup table. The total stays the same, so the result can be scanned and normalised as usual.
+// Runs as a single work-group of histBins work-items, the pixels cut off are added up in local memory.
+kernel void clip_histogram(global const int* A, global int* H, local int* excess, int histBins, int limit) {
+	int id = get_local_id(0);
+
+	if (id == 0)
+		*excess = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int count = A[id];
+	if (count > limit)
+		atomic_add(excess, count - limit);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int total = *excess;
+	H[id] = min(count, limit) + total / histBins + (id < total % histBins ? 1 : 0);
+}
+
 // OpenCl kernel which calulates the cumulative histogram from the intensity histogram.
 // This kernal uses the Hillis-Steel Inclusive parralel algorithm. This algorithm has been made efficient using 2 local memory buffers.
 // This cumulative histogram had to be inclusive so that no intensity values were lost. Moreover, this algorithm is suited to this role as there is more Proccessors than work items (256).
@@ -147,6 +705,7 @@ kernel void blellochCumulative(global int* A, global int* B) {
 	B[id] = A[id];
 }
 
+#ifdef cl_khr_fp64
 // OpenCl kernel which normalises the cumulative histogram to a maximum value of 255. 
 // Take a ratio of the actual value in relation to a maximum 255.
 kernel void normalise(global int* A, global int* B, int histBins) {
@@ -156,6 +715,97 @@ kernel void normalise(global int* A, global int* B, int histBins) {
 	// Normalise the histogram to a maximum of 255.
 	B[id] = value * (double)255 / A[histBins - 1];
 }
+#endif
+
+// OpenCl kernel which normalises the cumulative histogram to a maximum value of 255 with integer maths.
+// value * 255 is worked out in 64 bits so it cannot overflow, and the integer division truncates.
+// This gives exactly the same table as normalise: when the quotient is not whole it is at least 1 / total away
+// from the next integer, far more than the rounding error of the double division, so both truncate to the same value.
+kernel void normalise_fixed(global int* A, global int* B, int histBins) {
+	int id = get_global_id(0);
+	// Normalise the histogram to a maximum of 255.
+	B[id] = (int)(((long)A[id] * 255) / A[histBins - 1]);
+}
+
+// OpenCl kernel which normalises several cumulative histograms stored one after another to a maximum value of 255,
+// each one by its own total, with the same integer maths as normalise_fixed. Used for the three channel histograms from rgb_histogram.
+kernel void normalise_channels(global int* A, global int* B, int histBins) {
+	int id = get_global_id(0);
+	int last = (id / histBins) * histBins + histBins - 1; // the last bin of this histogram holds its total
+	B[id] = (int)(((long)A[id] * 255) / A[last]);
+}
+
+// OpenCl kernel which matches the image to a reference histogram (histogram specification) instead of a flat one.
+// A is the cumulative histogram of the image and R the 256 level cumulative histogram of the reference, each bin is mapped
+// to the lowest intensity where the reference has reached the same fraction of its pixels. The fractions are compared by
+// cross multiplying in 64 bits so no division or rounding is involved. R only grows, so the level is found with a binary search.
+// Like normalise the output is used as the lookup table, so matching costs the same per image as equalisation.
+kernel void match(global const int* A, global const int* R, global int* B, int histBins) {
+	int id = get_global_id(0);
+	if (id >= histBins)
+		return;
+
+	long total = A[histBins - 1];
+	long refTotal = R[255];
+	long value = A[id];
+	int lo = 0;
+	int hi = 255;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (R[mid] * total >= value * refTotal)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	B[id] = lo;
+}
+
+// OpenCl kernel which finds two percentiles of the image from its cumulative histogram, for contrast stretching.
+// P[0] is the lowest intensity where the cumulative histogram reaches low/10000 of the pixels and P[1] the highest intensity
+// of the bin where it reaches high/10000 (the percentiles are passed in hundredths of a percent so they stay integers).
+// The cumulative histogram only grows, so exactly one bin crosses each threshold and only that work-item writes.
+kernel void percentiles(global const int* A, global int* P, int histBins, int low, int high, global int* binsizeBuffer) {
+	int id = get_global_id(0);
+	if (id >= histBins)
+		return;
+
+	long total = A[histBins - 1];
+	long here = (long)A[id] * 10000;
+	long before = id > 0 ? (long)A[id - 1] * 10000 : -1;
+
+	if (here >= low * total && before < low * total)
+		P[0] = binsizeBuffer[id];
+	if (here >= high * total && before < high * total)
+		P[1] = id == histBins - 1 ? 255 : binsizeBuffer[id + 1] - 1;
+}
+
+// OpenCl kernel which builds a contrast stretch lookup table from the percentiles, P[0]..P[1] is spread over 0..255
+// (rounded to nearest) and anything outside is clamped. The table is used by lookup just like the normalised histogram.
+kernel void stretch(global const int* P, global int* B, int histBins, global int* binsizeBuffer) {
+	int id = get_global_id(0);
+	if (id >= histBins)
+		return;
+
+	int low = P[0];
+	int high = P[1];
+	int value = binsizeBuffer[id];
+
+	// Every pixel in one bin leaves nothing to stretch, keep the intensities as they are.
+	if (high <= low)
+		B[id] = value;
+	else
+		B[id] = ((clamp(value, low, high) - low) * 255 + (high - low) / 2) / (high - low);
+}
+
+// OpenCl kernel which composes a chain of point operations into the lookup table, B[id] becomes T[B[id]].
+// T is the 256 entry table of the whole chain (gamma, levels, threshold...) worked out on the host, so after this
+// one lookup pass gives equalisation and every point op together.
+kernel void compose(global int* B, global const int* T, int histBins) {
+	int id = get_global_id(0);
+	if (id < histBins)
+		B[id] = T[clamp(B[id], 0, 255)];
+}
 
 // OpenCl kernel which uses the cumalative histogram as a lookup table for the original intensities
 kernel void lookup(global const uchar* A, global const int* B, global uchar* C, int histBins, global int* binsizeBuffer) {
@@ -164,11 +814,151 @@ kernel void lookup(global const uchar* A, global const int* B, global uchar* C,
 	
 	for (size_t i = 0; i < histBins; i++)
 	{
-		if (value >= binsizeBuffer[i] && value < binsizeBuffer[i+1])
+		// The last bin has no upper bound in binsizeBuffer, it takes everything up to 255.
+		if (value >= binsizeBuffer[i] && (i == histBins - 1 || value < binsizeBuffer[i+1]))
 		{
 			C[id] = B[i];// Copy the lookup value to the output image.
+			break;
 		}
 	}
 	
 	
 }
+
+// OpenCl kernel which remaps every channel of a colour image with its own lookup table,
+// B holds the red, green and blue tables one after another and plane is the number of pixels in each channel.
+kernel void lookup_channels(global const uchar* A, global const int* B, global uchar* C, int plane, int histBins, global int* binsizeBuffer) {
+	int id = get_global_id(0);
+	int value = A[id]; // Take the original value.
+	global const int* table = B + (id / plane) * histBins;
+
+	for (int i = 0; i < histBins; i++)
+	{
+		if (value >= binsizeBuffer[i] && (i == histBins - 1 || value < binsizeBuffer[i + 1]))
+		{
+			C[id] = table[i];// Copy the lookup value to the output image.
+			break;
+		}
+	}
+}
+
+// OpenCl kernel which applies the lookup table inside a rectangle only, launched 2D over the rectangle like roi_histogram,
+// so the cost follows the area of the region. Pixels outside are never touched, the host reads back just the rectangle.
+kernel void lookup_roi(global const uchar* A, global const int* B, global uchar* C, int width, int plane, int planes, int x0, int y0, int roiWidth, int roiHeight, int histBins, global int* binsizeBuffer) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= roiWidth || y >= roiHeight)
+		return;
+
+	for (int c = 0; c < planes; c++)
+	{
+		int id = c * plane + (y0 + y) * width + x0 + x;
+		int value = A[id];
+		for (int i = 0; i < histBins; i++)
+		{
+			if (value >= binsizeBuffer[i] && (i == histBins - 1 || value < binsizeBuffer[i + 1]))
+			{
+				C[id] = B[i];
+				break;
+			}
+		}
+	}
+}
+
+// OpenCl kernel which applies the lookup table under the mask only, pixels outside the mask keep their original value.
+kernel void lookup_masked(global const uchar* A, global const uchar* M, global const int* B, global uchar* C, int plane, int histBins, global int* binsizeBuffer) {
+	int id = get_global_id(0);
+	int value = A[id];
+
+	C[id] = value;
+	if (M[id % plane] == 0)
+		return;
+	for (int i = 0; i < histBins; i++)
+	{
+		if (value >= binsizeBuffer[i] && (i == histBins - 1 || value < binsizeBuffer[i + 1]))
+		{
+			C[id] = B[i];
+			break;
+		}
+	}
+}
+
+// OpenCl kernel which applies the lookup table to a strided image, writing a strided output that can have another layout.
+// Like lookup every colour channel goes through the table, channels after the third (alpha) are copied unchanged.
+kernel void view_lookup(global const uchar* A, global const int* B, global uchar* C, int width, int height, ulong rowPitch, ulong pixelStride, ulong channelStride,
+	ulong outRowPitch, ulong outPixelStride, ulong outChannelStride, int channels, int histBins, global int* binsizeBuffer) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	if (x >= width || y >= height)
+		return;
+
+	for (int c = 0; c < channels; c++)
+	{
+		int value = A[y * rowPitch + x * pixelStride + c * channelStride];
+		ulong out = y * outRowPitch + x * outPixelStride + c * outChannelStride;
+
+		C[out] = value;
+		if (c >= 3)
+			continue;
+		for (int i = 0; i < histBins; i++)
+		{
+			if (value >= binsizeBuffer[i] && (i == histBins - 1 || value < binsizeBuffer[i + 1]))
+			{
+				C[out] = B[i];
+				break;
+			}
+		}
+	}
+}
+
+// Roofline probes, run by Roofline.h to measure the best the device can do. identity copies one byte per work-item, which
+// measures its launch overhead as much as its memory, so these move 16 bytes per work-item instead.
+
+// Copies A to B, reading and writing 16 bytes per work-item.
+kernel void probe_copy(global const uint4* A, global uint4* B) {
+	int id = get_global_id(0);
+	B[id] = A[id];
+}
+
+// Reads 16 bytes per work-item. What was read is only written out if it equals key, which the host makes impossible,
+// but the compiler cannot know that so the loads are kept.
+kernel void probe_read(global const uint4* A, global uint* B, uint key) {
+	int id = get_global_id(0);
+	uint4 v = A[id];
+	uint x = v.x ^ v.y ^ v.z ^ v.w;
+	if (x == key)
+		B[0] = x;
+}
+
+// Writes 16 bytes per work-item.
+kernel void probe_write(global uint4* B, uint value) {
+	int id = get_global_id(0);
+	B[id] = (uint4)(value);
+}
+
+// Local memory atomic throughput: every work-item does iterations atomic_inc calls on the local histogram, and at each step
+// neighbouring work-items hit neighbouring bins, so the rate is not held back by contention on one address.
+// histBins must be a power of 2.
+kernel void probe_local_atomics(global int* H, local int* LH, int iterations, int histBins) {
+	int lid = get_local_id(0);
+	int lsize = get_local_size(0);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		LH[i] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int bin = lid & (histBins - 1);
+	for (int i = 0; i < iterations; i++)
+	{
+		atomic_inc(&LH[bin]);
+		bin = (bin + 1) & (histBins - 1);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < histBins; i += lsize)
+	{
+		atomic_add(&H[i], LH[i]);
+	}
+}
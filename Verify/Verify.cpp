@@ -0,0 +1,836 @@
+// Differential correctness harness: every histogram, scan, table and apply kernel in my_kernels.cl, and every equalisation
+// backend (Equaliser, its views, zero copy and lookup table cache, AsyncEqualiser, the histeq.h C interface, the coroutine
+// batch when built as C++20, and the CPU SlidingAHE), is run over many generated images
+// and bin counts and compared with the plain host versions in Reference.h. The images come from SyntheticImage with a
+// random distribution, size (from 1x1, with odd sizes to hit the tails of the vector and work-group loops), channel count,
+// bin count, region and mask, so every run with the same seed checks the same cases.
+// The first mismatching bin or pixel of each variant is reported with the image it came from, and the exit code is 1 if
+// any variant did not match. Kernels are launched the way they are meant to be (a scan as one work-group of one work-item
+// per bin, and so on), a wrong launch in an application is found by checking it against these.
+// The serial histogram kernel does B[i]++ on global memory from every work-item, which races, so it is run and reported
+// but marked as known not to match and does not fail the run. blellochCumulative is an exclusive scan by design and is
+// held to an exclusive reference, cumulativeHistogram to an inclusive one.
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <iomanip>
+#include <functional>
+#include <fstream>
+#include <filesystem>
+
+#include "Utils.h"
+#include "Reference.h"
+#include "Synthetic.h"
+#include "ImageView.h"
+#include "Equaliser.h"
+#include "AsyncEqualiser.h"
+#include "SlidingAHE.h"
+#include "LutCache.h"
+// The C interface is compiled in with the rest, as Utils.h defines its functions in the header and cannot be in two objects
+#define HISTEQ_STATIC
+#include "../Library/histeq.cpp"
+#ifdef __cpp_impl_coroutine
+#include "CoroutineBatch.h"
+#endif
+
+void print_help() {
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -p : select platform " << std::endl;
+	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -all : check every device of every platform instead of one" << std::endl;
+	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -n : number of generated images (default: 1000)" << std::endl;
+	std::cerr << "  -max : largest image, e.g. -max 512x512 (default)" << std::endl;
+	std::cerr << "  -seed : first seed of the generated images (default: 0)" << std::endl;
+	std::cerr << "  -k : only check the variants whose name contains this text" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+// One generated test case, with what the references work out from it.
+struct Input {
+	int index = 0;
+	string spec;
+	int width = 0, height = 0, channels = 1, bins = 256;
+	vector<unsigned char> planar; // channels planes, like CImg
+	vector<unsigned char> interleaved;
+	vector<unsigned char> grey; // one plane, rgb2grey_fixed of a colour image
+	vector<unsigned char> mask; // one byte per pixel of a plane
+	int x0 = 0, y0 = 0, roiWidth = 0, roiHeight = 0;
+	vector<int> edges; // bins + 1, for the references
+	vector<int> binsizes; // bins, the binsizeBuffer the applications upload, without the closing 256
+	vector<int> counts, cumulative, table; // the grey pipeline
+	vector<int> channelCounts, channelCumulative, channelTables; // three histograms one after another
+	vector<int> full; // 256 bin histogram of every byte
+	vector<int> referenceCumulative; // 256 levels, for match
+	vector<int> composeTable; // 256 levels, for compose
+	int low = 0, high = 10000; // percentiles in hundredths of a percent
+
+	int Plane() const {
+		return width * height;
+	}
+
+	string Describe() const {
+		return "image " + to_string(index) + " (" + to_string(width) + "x" + to_string(height) + "x" + to_string(channels) + ", " + spec + ", " + to_string(bins) + " bins)";
+	}
+};
+
+Input Generate(int index, uint64_t seed, int maxWidth, int maxHeight) {
+	mt19937_64 random(seed);
+	auto uniform = [&](int lo, int hi) { return lo + (int)(random() % (uint64_t)(hi - lo + 1)); };
+	// Sizes spread evenly over the powers of two up to the largest, so small and odd images are as common as big ones
+	auto size = [&](int largest) { return max(1, min(largest, (int)exp2(uniform(0, 1000) / 1000.0 * log2(largest)) + uniform(0, 3))); };
+
+	Input input;
+	input.index = index;
+	const char* names[] = { "uniform", "gaussian", "single", "twospike", "gradient", "noise" };
+	input.spec = names[uniform(0, 5)];
+	if (input.spec == "gaussian") {
+		input.spec += ":" + to_string(uniform(0, 255)) + ":" + to_string(uniform(1, 64));
+	}
+	else if (input.spec == "single") {
+		input.spec += ":" + to_string(uniform(0, 255));
+	}
+	else if (input.spec == "twospike") {
+		input.spec += ":" + to_string(uniform(0, 255)) + ":" + to_string(uniform(0, 255));
+	}
+	input.width = size(maxWidth);
+	input.height = size(maxHeight);
+	input.channels = uniform(0, 1) ? 3 : 1;
+	input.bins = 1 << uniform(1, 8);
+
+	// Generated interleaved like a PPM, and rearranged into planes
+	SyntheticImage image(input.spec, input.width, input.height, input.channels, seed);
+	input.interleaved.resize(image.Size());
+	image.Fill(input.interleaved.data(), 0, image.Size());
+	int plane = input.Plane();
+	input.planar.resize(image.Size());
+	for (int p = 0; p < plane; p++) {
+		for (int c = 0; c < input.channels; c++) {
+			input.planar[(size_t)c * plane + p] = input.interleaved[(size_t)p * input.channels + c];
+		}
+	}
+	input.grey.assign(input.planar.begin(), input.planar.begin() + plane);
+	if (input.channels == 3) {
+		for (int p = 0; p < plane; p++) {
+			input.grey[p] = Reference::Grey(input.planar[p], input.planar[plane + p], input.planar[2 * plane + p]);
+		}
+	}
+
+	// A region somewhere inside, and a mask of about half the pixels (none or all of them now and then)
+	input.x0 = uniform(0, input.width - 1);
+	input.y0 = uniform(0, input.height - 1);
+	input.roiWidth = uniform(1, input.width - input.x0);
+	input.roiHeight = uniform(1, input.height - input.y0);
+	int share = uniform(0, 9) == 0 ? 0 : uniform(0, 9) == 0 ? 100 : 50;
+	input.mask.resize(plane);
+	for (unsigned char& m : input.mask) {
+		m = (int)(random() % 100) < share ? (unsigned char)uniform(1, 255) : 0;
+	}
+
+	input.edges = Reference::Edges(input.bins);
+	input.binsizes.assign(input.edges.begin(), input.edges.end() - 1);
+	input.counts = Reference::Histogram(input.grey, input.edges);
+	input.cumulative = Reference::InclusiveScan(input.counts);
+	input.table = Reference::Normalise(input.cumulative);
+	for (int c = 0; c < 3; c++) {
+		int from = input.channels == 3 ? c : 0;
+		vector<unsigned char> channel(input.planar.begin() + (size_t)from * plane, input.planar.begin() + (size_t)(from + 1) * plane);
+		vector<int> counts = Reference::Histogram(channel, input.edges), cumulative = Reference::InclusiveScan(counts), table = Reference::Normalise(cumulative);
+		input.channelCounts.insert(input.channelCounts.end(), counts.begin(), counts.end());
+		input.channelCumulative.insert(input.channelCumulative.end(), cumulative.begin(), cumulative.end());
+		input.channelTables.insert(input.channelTables.end(), table.begin(), table.end());
+	}
+	input.full = Reference::Histogram(input.planar, Reference::Edges(256));
+
+	// A reference histogram with empty levels now and then, so matching meets flat runs of the cumulative histogram
+	vector<int> reference(256);
+	for (int& count : reference) {
+		count = uniform(0, 3) == 0 ? 0 : uniform(0, 1000);
+	}
+	reference[uniform(0, 255)] += 1;
+	input.referenceCumulative = Reference::InclusiveScan(reference);
+	input.composeTable.resize(256);
+	for (int& level : input.composeTable) {
+		level = uniform(0, 255);
+	}
+	input.low = uniform(0, 5000);
+	input.high = uniform(input.low, 10000);
+	return input;
+}
+
+// The first place two results differ, or "" when they are the same.
+template <typename T>
+string FirstBin(const vector<T>& expected, const vector<T>& got) {
+	for (size_t i = 0; i < expected.size(); i++) {
+		if (i >= got.size() || expected[i] != got[i]) {
+			stringstream mismatch;
+			mismatch << "bin " << i << " of " << expected.size() << ": expected " << (long long)expected[i] << ", got " << (i < got.size() ? to_string((long long)got[i]) : "nothing");
+			return mismatch.str();
+		}
+	}
+	return "";
+}
+
+// The same for images, with the pixel as x, y and channel. A planar layout (like CImg) unless interleaved.
+string FirstPixel(const vector<unsigned char>& expected, const vector<unsigned char>& got, int width, int height, int channels, bool interleaved = false) {
+	size_t plane = (size_t)width * height;
+	for (size_t i = 0; i < expected.size(); i++) {
+		if (expected[i] != got[i]) {
+			size_t p = interleaved ? i / channels : i % plane;
+			size_t c = interleaved ? i % channels : i / plane;
+			stringstream mismatch;
+			mismatch << "pixel (" << p % width << ", " << p / width << ") channel " << c << ": expected " << (int)expected[i] << ", got " << (int)got[i];
+			return mismatch.str();
+		}
+	}
+	return "";
+}
+
+// A check of one kernel or backend. run gives "" when it matched, applies leaves out the cases it cannot take.
+struct Variant {
+	string name;
+	function<string(const Input&)> run;
+	function<bool(const Input&)> applies = [](const Input&) { return true; };
+	bool known = false; // known not to match, reported but not a failure
+	int cases = 0;
+	int failures = 0;
+	string first;
+};
+
+size_t RoundUp(size_t value, size_t multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+// Checks every variant on one device, and gives the number of failed ones (the known ones not counted).
+int Verify(int platform_id, int device_id, int count, uint64_t seed, int maxWidth, int maxHeight, const string& filter) {
+	cl::Context context = GetContext(platform_id, device_id);
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::CommandQueue queue(context, device);
+	cl::Program::Sources sources;
+	AddSources(sources, "kernels/my_kernels.cl");
+	cl::Program program(context, sources);
+	try {
+		program.build();
+	}
+	catch (const cl::Error& err) {
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+		throw err;
+	}
+
+	size_t maxGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	size_t L = min((size_t)256, maxGroup); // a power of 2, hash_blocks needs one
+	while (L & (L - 1)) {
+		L &= L - 1;
+	}
+	size_t tile = L >= 256 ? 16 : 8; // the 2D work-group side
+	int groups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+
+	// Device buffers from host vectors, and back
+	auto buffer = [&](const auto& data) {
+		return cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, max((size_t)1, data.size()) * sizeof(data[0]), (void*)data.data());
+	};
+	auto zeros = [&](size_t count) {
+		return buffer(vector<int>(max((size_t)1, count), 0));
+	};
+	auto readInts = [&](const cl::Buffer& from, size_t count) {
+		vector<int> values(count);
+		queue.enqueueReadBuffer(from, CL_TRUE, 0, count * sizeof(int), values.data());
+		return values;
+	};
+	auto readBytes = [&](const cl::Buffer& from, size_t count) {
+		vector<unsigned char> values(count);
+		queue.enqueueReadBuffer(from, CL_TRUE, 0, count, values.data());
+		return values;
+	};
+	auto run = [&](cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local) {
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+	};
+	auto grid = [&](int width, int height) {
+		return cl::NDRange(RoundUp(width, tile), RoundUp(height, tile));
+	};
+	auto colour = [](const Input& in) { return in.channels == 3; };
+	auto oneGroup = [=](const Input& in) { return (size_t)in.bins <= maxGroup; };
+
+	// The histogram of the grey plane every counting kernel gets, and the interleaved grey of a colour image
+	auto histogramOf = [&](const Input& in, const char* name, const function<void(cl::Kernel&, cl::Buffer&, cl::Buffer&, cl::Buffer&)>& launch) {
+		cl::Kernel kernel(program, name);
+		cl::Buffer image = buffer(in.grey), histogram = zeros(in.bins), edges = buffer(in.binsizes);
+		launch(kernel, image, histogram, edges);
+		return FirstBin(in.counts, readInts(histogram, in.bins));
+	};
+
+	vector<Variant> variants;
+	auto add = [&](const string& name, function<string(const Input&)> check, function<bool(const Input&)> applies = nullptr, bool known = false) {
+		Variant variant;
+		variant.name = name;
+		variant.run = check;
+		if (applies) {
+			variant.applies = applies;
+		}
+		variant.known = known;
+		variants.push_back(variant);
+	};
+
+	// Histograms
+	add("histogram", [&](const Input& in) {
+		return histogramOf(in, "histogram", [&](cl::Kernel& k, cl::Buffer& a, cl::Buffer& h, cl::Buffer& e) {
+			k.setArg(0, a); k.setArg(1, h); k.setArg(2, in.bins); k.setArg(3, in.Plane()); k.setArg(4, e);
+			run(k, cl::NDRange(in.Plane()), cl::NullRange);
+		});
+	}, nullptr, true);
+	add("local_global", [&](const Input& in) {
+		return histogramOf(in, "local_global", [&](cl::Kernel& k, cl::Buffer& a, cl::Buffer& h, cl::Buffer& e) {
+			k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, in.Plane()); k.setArg(4, in.bins); k.setArg(5, e);
+			run(k, cl::NDRange(RoundUp(in.Plane(), L)), cl::NDRange(L));
+		});
+	});
+	add("local_partials + reduce_partials", [&](const Input& in) {
+		return histogramOf(in, "local_partials", [&](cl::Kernel& k, cl::Buffer& a, cl::Buffer& h, cl::Buffer& e) {
+			size_t global = RoundUp(in.Plane(), L);
+			int partialGroups = (int)(global / L);
+			cl::Buffer partials = zeros(partialGroups * in.bins);
+			k.setArg(0, a); k.setArg(1, partials); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, in.Plane()); k.setArg(4, in.bins); k.setArg(5, e);
+			run(k, cl::NDRange(global), cl::NDRange(L));
+			// Two passes like the app, the first into 1 to 8 rows so both the blocked and the single row pass are checked
+			int blocks = min(partialGroups, 1 + in.index % 8);
+			cl::Buffer rows = zeros(blocks * in.bins);
+			cl::Kernel reduce(program, "reduce_partials");
+			reduce.setArg(0, partials); reduce.setArg(1, rows); reduce.setArg(2, partialGroups); reduce.setArg(3, in.bins);
+			run(reduce, cl::NDRange(in.bins, blocks), cl::NullRange);
+			cl::Kernel reduceRows(program, "reduce_partials");
+			reduceRows.setArg(0, rows); reduceRows.setArg(1, h); reduceRows.setArg(2, blocks); reduceRows.setArg(3, in.bins);
+			run(reduceRows, cl::NDRange(in.bins, 1), cl::NullRange);
+		});
+	});
+	add("local_global_packed", [&](const Input& in) {
+		return histogramOf(in, "local_global_packed", [&](cl::Kernel& k, cl::Buffer& a, cl::Buffer& h, cl::Buffer& e) {
+			// One work-group and few replicas, so images from about 256x256 go through the 16-bit flushes
+			int replicas = 1 << (in.index % 3);
+			k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(replicas * ((in.bins + 1) / 2) * sizeof(cl_uint)));
+			k.setArg(3, in.Plane()); k.setArg(4, in.bins); k.setArg(5, e); k.setArg(6, replicas);
+			run(k, cl::NDRange(L), cl::NDRange(L));
+		});
+	});
+	add("local_global_persistent", [&](const Input& in) {
+		return histogramOf(in, "local_global_persistent", [&](cl::Kernel& k, cl::Buffer& a, cl::Buffer& h, cl::Buffer& e) {
+			k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, cl::Local(256 * sizeof(int))); k.setArg(4, in.Plane()); k.setArg(5, in.bins); k.setArg(6, e);
+			run(k, cl::NDRange(groups * L), cl::NDRange(L));
+		});
+	});
+	if (HasKernel(program, "local_global_subgroup")) {
+		add("local_global_subgroup", [&](const Input& in) {
+			return histogramOf(in, "local_global_subgroup", [&](cl::Kernel& k, cl::Buffer& a, cl::Buffer& h, cl::Buffer& e) {
+				k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, in.Plane()); k.setArg(4, in.bins); k.setArg(5, e);
+				run(k, cl::NDRange(RoundUp(in.Plane(), L)), cl::NDRange(L));
+			});
+		});
+	}
+	add("rgb_histogram", [&](const Input& in) {
+		cl::Kernel k(program, "rgb_histogram");
+		cl::Buffer a = buffer(in.planar), h = zeros(3 * in.bins), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(3 * in.bins * sizeof(int))); k.setArg(3, in.Plane()); k.setArg(4, in.bins); k.setArg(5, e);
+		run(k, cl::NDRange(RoundUp(in.Plane(), L)), cl::NDRange(L));
+		return FirstBin(in.channelCounts, readInts(h, 3 * in.bins));
+	}, colour);
+	add("roi_histogram", [&](const Input& in) {
+		vector<unsigned char> inside;
+		for (int c = 0; c < in.channels; c++) {
+			for (int y = in.y0; y < in.y0 + in.roiHeight; y++) {
+				for (int x = in.x0; x < in.x0 + in.roiWidth; x++) {
+					inside.push_back(in.planar[(size_t)c * in.Plane() + (size_t)y * in.width + x]);
+				}
+			}
+		}
+		cl::Kernel k(program, "roi_histogram");
+		cl::Buffer a = buffer(in.planar), h = zeros(in.bins), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, in.width); k.setArg(4, in.Plane()); k.setArg(5, in.channels);
+		k.setArg(6, in.x0); k.setArg(7, in.y0); k.setArg(8, in.roiWidth); k.setArg(9, in.roiHeight); k.setArg(10, in.bins); k.setArg(11, e);
+		run(k, grid(in.roiWidth, in.roiHeight), cl::NDRange(tile, tile));
+		return FirstBin(Reference::Histogram(inside, in.edges), readInts(h, in.bins));
+	});
+	add("masked_histogram", [&](const Input& in) {
+		vector<unsigned char> inside;
+		for (size_t i = 0; i < in.planar.size(); i++) {
+			if (in.mask[i % in.Plane()]) {
+				inside.push_back(in.planar[i]);
+			}
+		}
+		cl::Kernel k(program, "masked_histogram");
+		cl::Buffer a = buffer(in.planar), m = buffer(in.mask), h = zeros(in.bins), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, m); k.setArg(2, h); k.setArg(3, cl::Local(in.bins * sizeof(int))); k.setArg(4, (int)in.planar.size()); k.setArg(5, in.Plane()); k.setArg(6, in.bins); k.setArg(7, e);
+		run(k, cl::NDRange(groups * L), cl::NDRange(L));
+		return FirstBin(Reference::Histogram(inside, in.edges), readInts(h, in.bins));
+	});
+	add("view_histogram", [&](const Input& in) {
+		cl::Kernel k(program, "view_histogram");
+		cl::Buffer a = buffer(in.interleaved), h = zeros(in.bins), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, in.width); k.setArg(4, in.height);
+		k.setArg(5, (cl_ulong)in.width * in.channels); k.setArg(6, (cl_ulong)in.channels); k.setArg(7, (cl_ulong)1); k.setArg(8, in.channels); k.setArg(9, in.bins); k.setArg(10, e);
+		run(k, grid(in.width, in.height), cl::NDRange(tile, tile));
+		return FirstBin(in.counts, readInts(h, in.bins));
+	});
+	add("coarsen", [&](const Input& in) {
+		cl::Kernel k(program, "coarsen");
+		cl::Buffer a = buffer(in.full), h = zeros(in.bins), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, h); k.setArg(2, in.bins); k.setArg(3, e);
+		run(k, cl::NDRange(in.bins), cl::NullRange);
+		return FirstBin(Reference::Histogram(in.planar, in.edges), readInts(h, in.bins));
+	});
+
+	// Scans
+	add("cumulativeHistogram", [&](const Input& in) {
+		cl::Kernel k(program, "cumulativeHistogram");
+		cl::Buffer a = buffer(in.counts), b = zeros(in.bins);
+		k.setArg(0, a); k.setArg(1, b); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, cl::Local(in.bins * sizeof(int)));
+		run(k, cl::NDRange(in.bins), cl::NDRange(in.bins));
+		return FirstBin(in.cumulative, readInts(b, in.bins));
+	}, oneGroup);
+	add("cumulativeHistogram (3 histograms)", [&](const Input& in) {
+		cl::Kernel k(program, "cumulativeHistogram");
+		cl::Buffer a = buffer(in.channelCounts), b = zeros(3 * in.bins);
+		k.setArg(0, a); k.setArg(1, b); k.setArg(2, cl::Local(in.bins * sizeof(int))); k.setArg(3, cl::Local(in.bins * sizeof(int)));
+		run(k, cl::NDRange(3 * in.bins), cl::NDRange(in.bins));
+		return FirstBin(in.channelCumulative, readInts(b, 3 * in.bins));
+	}, oneGroup);
+	add("blellochCumulative", [&](const Input& in) {
+		cl::Kernel k(program, "blellochCumulative");
+		cl::Buffer a = buffer(in.counts), b = zeros(in.bins);
+		k.setArg(0, a); k.setArg(1, b);
+		run(k, cl::NDRange(in.bins), cl::NDRange(in.bins));
+		return FirstBin(Reference::ExclusiveScan(in.counts), readInts(b, in.bins));
+	}, oneGroup);
+	add("clip_histogram", [&](const Input& in) {
+		int limit = max(1, in.Plane() / in.bins * (1 + in.index % 4));
+		cl::Kernel k(program, "clip_histogram");
+		cl::Buffer a = buffer(in.counts), h = zeros(in.bins);
+		k.setArg(0, a); k.setArg(1, h); k.setArg(2, cl::Local(sizeof(int))); k.setArg(3, in.bins); k.setArg(4, limit);
+		run(k, cl::NDRange(in.bins), cl::NDRange(in.bins));
+		return FirstBin(Reference::Clip(in.counts, limit), readInts(h, in.bins));
+	}, oneGroup);
+
+	// Tables
+	auto normalise = [&](const char* name) {
+		return [&, name](const Input& in) {
+			cl::Kernel k(program, name);
+			cl::Buffer a = buffer(in.cumulative), b = zeros(in.bins);
+			k.setArg(0, a); k.setArg(1, b); k.setArg(2, in.bins);
+			run(k, cl::NDRange(in.bins), cl::NullRange);
+			return FirstBin(in.table, readInts(b, in.bins));
+		};
+	};
+	add("normalise_fixed", normalise("normalise_fixed"));
+	if (HasKernel(program, "normalise")) {
+		add("normalise", normalise("normalise"));
+	}
+	add("normalise_channels", [&](const Input& in) {
+		cl::Kernel k(program, "normalise_channels");
+		cl::Buffer a = buffer(in.channelCumulative), b = zeros(3 * in.bins);
+		k.setArg(0, a); k.setArg(1, b); k.setArg(2, in.bins);
+		run(k, cl::NDRange(3 * in.bins), cl::NullRange);
+		return FirstBin(in.channelTables, readInts(b, 3 * in.bins));
+	});
+	add("match", [&](const Input& in) {
+		cl::Kernel k(program, "match");
+		cl::Buffer a = buffer(in.cumulative), r = buffer(in.referenceCumulative), b = zeros(in.bins);
+		k.setArg(0, a); k.setArg(1, r); k.setArg(2, b); k.setArg(3, in.bins);
+		run(k, cl::NDRange(in.bins), cl::NullRange);
+		return FirstBin(Reference::Match(in.cumulative, in.referenceCumulative), readInts(b, in.bins));
+	});
+	add("percentiles", [&](const Input& in) {
+		int levels[2] = { -1, -1 };
+		cl::Kernel k(program, "percentiles");
+		cl::Buffer a = buffer(in.cumulative), p = buffer(vector<int>(levels, levels + 2)), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, p); k.setArg(2, in.bins); k.setArg(3, in.low); k.setArg(4, in.high); k.setArg(5, e);
+		run(k, cl::NDRange(in.bins), cl::NullRange);
+		Reference::Percentiles(in.cumulative, in.edges, in.low, in.high, levels);
+		return FirstBin(vector<int>(levels, levels + 2), readInts(p, 2));
+	});
+	add("stretch", [&](const Input& in) {
+		int levels[2] = { 0, 255 };
+		Reference::Percentiles(in.cumulative, in.edges, in.low, in.high, levels);
+		cl::Kernel k(program, "stretch");
+		cl::Buffer p = buffer(vector<int>(levels, levels + 2)), b = zeros(in.bins), e = buffer(in.binsizes);
+		k.setArg(0, p); k.setArg(1, b); k.setArg(2, in.bins); k.setArg(3, e);
+		run(k, cl::NDRange(in.bins), cl::NullRange);
+		return FirstBin(Reference::Stretch(levels, in.edges), readInts(b, in.bins));
+	});
+	add("compose", [&](const Input& in) {
+		vector<int> expected(in.bins);
+		for (int i = 0; i < in.bins; i++) {
+			expected[i] = in.composeTable[in.table[i]];
+		}
+		cl::Kernel k(program, "compose");
+		cl::Buffer b = buffer(in.table), t = buffer(in.composeTable);
+		k.setArg(0, b); k.setArg(1, t); k.setArg(2, in.bins);
+		run(k, cl::NDRange(in.bins), cl::NullRange);
+		return FirstBin(expected, readInts(b, in.bins));
+	});
+
+	// Per pixel
+	auto greyscale = [&](const char* name, bool precise) {
+		return [&, name, precise](const Input& in) {
+			int plane = in.Plane();
+			vector<unsigned char> expected(in.planar.size());
+			for (int p = 0; p < plane; p++) {
+				int r = in.planar[p], g = in.planar[plane + p], b = in.planar[2 * plane + p];
+				expected[p] = expected[plane + p] = expected[2 * plane + p] = precise ? Reference::GreyDouble(r, g, b) : Reference::Grey(r, g, b);
+			}
+			cl::Kernel k(program, name);
+			cl::Buffer a = buffer(in.planar), b = buffer(vector<unsigned char>(in.planar.size()));
+			k.setArg(0, a); k.setArg(1, b);
+			run(k, cl::NDRange(in.planar.size()), cl::NullRange);
+			return FirstPixel(expected, readBytes(b, in.planar.size()), in.width, in.height, in.channels);
+		};
+	};
+	add("rgb2grey_fixed", greyscale("rgb2grey_fixed", false), colour);
+	if (HasKernel(program, "rgb2grey")) {
+		add("rgb2grey", greyscale("rgb2grey", true), colour);
+	}
+	add("identity", [&](const Input& in) {
+		cl::Kernel k(program, "identity");
+		cl::Buffer a = buffer(in.planar), b = buffer(vector<unsigned char>(in.planar.size()));
+		k.setArg(0, a); k.setArg(1, b);
+		run(k, cl::NDRange(in.planar.size()), cl::NullRange);
+		return FirstPixel(in.planar, readBytes(b, in.planar.size()), in.width, in.height, in.channels);
+	});
+	add("lookup", [&](const Input& in) {
+		cl::Kernel k(program, "lookup");
+		cl::Buffer a = buffer(in.planar), t = buffer(in.table), c = buffer(vector<unsigned char>(in.planar.size())), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, t); k.setArg(2, c); k.setArg(3, in.bins); k.setArg(4, e);
+		run(k, cl::NDRange(in.planar.size()), cl::NullRange);
+		return FirstPixel(Reference::Lookup(in.planar, in.table, in.edges), readBytes(c, in.planar.size()), in.width, in.height, in.channels);
+	});
+	add("lookup_channels", [&](const Input& in) {
+		int plane = in.Plane();
+		vector<unsigned char> expected(in.planar.size());
+		for (size_t i = 0; i < in.planar.size(); i++) {
+			expected[i] = (unsigned char)in.channelTables[(i / plane) * in.bins + Reference::BinOf(in.planar[i], in.edges)];
+		}
+		cl::Kernel k(program, "lookup_channels");
+		cl::Buffer a = buffer(in.planar), t = buffer(in.channelTables), c = buffer(vector<unsigned char>(in.planar.size())), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, t); k.setArg(2, c); k.setArg(3, plane); k.setArg(4, in.bins); k.setArg(5, e);
+		run(k, cl::NDRange(in.planar.size()), cl::NullRange);
+		return FirstPixel(expected, readBytes(c, in.planar.size()), in.width, in.height, in.channels);
+	}, colour);
+	add("lookup_roi", [&](const Input& in) {
+		// Only the rectangle is written, the output starts as a copy of the input so the rest should stay as it is
+		vector<unsigned char> expected = in.planar;
+		for (int c = 0; c < in.channels; c++) {
+			for (int y = in.y0; y < in.y0 + in.roiHeight; y++) {
+				for (int x = in.x0; x < in.x0 + in.roiWidth; x++) {
+					size_t i = (size_t)c * in.Plane() + (size_t)y * in.width + x;
+					expected[i] = (unsigned char)in.table[Reference::BinOf(in.planar[i], in.edges)];
+				}
+			}
+		}
+		cl::Kernel k(program, "lookup_roi");
+		cl::Buffer a = buffer(in.planar), t = buffer(in.table), c = buffer(in.planar), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, t); k.setArg(2, c); k.setArg(3, in.width); k.setArg(4, in.Plane()); k.setArg(5, in.channels);
+		k.setArg(6, in.x0); k.setArg(7, in.y0); k.setArg(8, in.roiWidth); k.setArg(9, in.roiHeight); k.setArg(10, in.bins); k.setArg(11, e);
+		run(k, grid(in.roiWidth, in.roiHeight), cl::NDRange(tile, tile));
+		return FirstPixel(expected, readBytes(c, in.planar.size()), in.width, in.height, in.channels);
+	});
+	add("lookup_masked", [&](const Input& in) {
+		vector<unsigned char> expected = in.planar;
+		for (size_t i = 0; i < in.planar.size(); i++) {
+			if (in.mask[i % in.Plane()]) {
+				expected[i] = (unsigned char)in.table[Reference::BinOf(in.planar[i], in.edges)];
+			}
+		}
+		cl::Kernel k(program, "lookup_masked");
+		cl::Buffer a = buffer(in.planar), m = buffer(in.mask), t = buffer(in.table), c = buffer(vector<unsigned char>(in.planar.size())), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, m); k.setArg(2, t); k.setArg(3, c); k.setArg(4, in.Plane()); k.setArg(5, in.bins); k.setArg(6, e);
+		run(k, cl::NDRange(in.planar.size()), cl::NullRange);
+		return FirstPixel(expected, readBytes(c, in.planar.size()), in.width, in.height, in.channels);
+	});
+	add("view_lookup", [&](const Input& in) {
+		// Planar in, interleaved out, so the strides of both sides are checked
+		vector<unsigned char> expected = Reference::Lookup(in.interleaved, in.table, in.edges);
+		cl::Kernel k(program, "view_lookup");
+		cl::Buffer a = buffer(in.planar), t = buffer(in.table), c = buffer(vector<unsigned char>(in.planar.size())), e = buffer(in.binsizes);
+		k.setArg(0, a); k.setArg(1, t); k.setArg(2, c); k.setArg(3, in.width); k.setArg(4, in.height); k.setArg(5, (cl_ulong)in.width); k.setArg(6, (cl_ulong)1); k.setArg(7, (cl_ulong)in.Plane());
+		k.setArg(8, (cl_ulong)in.width * in.channels); k.setArg(9, (cl_ulong)in.channels); k.setArg(10, (cl_ulong)1); k.setArg(11, in.channels); k.setArg(12, in.bins); k.setArg(13, e);
+		run(k, grid(in.width, in.height), cl::NullRange);
+		return FirstPixel(expected, readBytes(c, in.planar.size()), in.width, in.height, in.channels, true);
+	});
+	add("hash_blocks", [&](const Input& in) {
+		cl::Kernel k(program, "hash_blocks");
+		cl::Buffer a = buffer(in.planar), p(context, CL_MEM_READ_WRITE, groups * sizeof(cl_ulong));
+		k.setArg(0, a); k.setArg(1, p); k.setArg(2, cl::Local(L * sizeof(cl_ulong))); k.setArg(3, (cl_ulong)in.planar.size());
+		run(k, cl::NDRange(groups * L), cl::NDRange(L));
+		vector<cl_ulong> partials(groups);
+		queue.enqueueReadBuffer(p, CL_TRUE, 0, groups * sizeof(cl_ulong), partials.data());
+		uint64_t hash = 0;
+		for (cl_ulong partial : partials) {
+			hash += partial;
+		}
+		return FirstBin(vector<uint64_t>{ Reference::Hash(in.planar) }, vector<uint64_t>{ hash });
+	});
+
+	// Backends, the whole default pipeline: the grey histogram, scanned and normalised, applied to every colour channel.
+	// Each bin count gets its own equalisers, made the first time it comes up.
+	map<int, unique_ptr<Equaliser>> equalisers, zeroCopyEqualisers;
+	map<int, unique_ptr<AsyncEqualiser>> asyncEqualisers;
+	auto equaliser = [&](map<int, unique_ptr<Equaliser>>& made, int bins, bool zeroCopy) -> Equaliser& {
+		if (!made[bins]) {
+			made[bins].reset(new Equaliser(context, program, bins));
+			made[bins]->SetZeroCopy(zeroCopy);
+		}
+		return *made[bins];
+	};
+	auto equalised = [](const Input& in, const vector<unsigned char>& image) { return Reference::Lookup(image, in.table, in.edges); };
+	add("Equaliser", [&](const Input& in) {
+		vector<unsigned char> output(in.planar.size());
+		vector<int> lut = equaliser(equalisers, in.bins, false).Equalise(in.planar.data(), output.data(), in.planar.size(), in.channels);
+		string mismatch = FirstBin(in.table, lut);
+		return mismatch.empty() ? FirstPixel(equalised(in, in.planar), output, in.width, in.height, in.channels) : "table " + mismatch;
+	});
+	auto views = [&](bool zeroCopy) {
+		return [&, zeroCopy](const Input& in) {
+			vector<unsigned char> source = in.planar, output(in.planar.size());
+			ImageView input = ImageView::Planar(source.data(), in.width, in.height, in.channels);
+			ImageView result = ImageView::Interleaved(output.data(), in.width, in.height, in.channels);
+			vector<int> lut = equaliser(zeroCopy ? zeroCopyEqualisers : equalisers, in.bins, zeroCopy).Equalise(input, result);
+			string mismatch = FirstBin(in.table, lut);
+			return mismatch.empty() ? FirstPixel(equalised(in, in.interleaved), output, in.width, in.height, in.channels, true) : "table " + mismatch;
+		};
+	};
+	add("Equaliser views", views(false));
+	add("Equaliser zero copy", views(true));
+	add("AsyncEqualiser", [&](const Input& in) {
+		if (!asyncEqualisers[in.bins]) {
+			asyncEqualisers[in.bins].reset(new AsyncEqualiser(context, program, 2, in.bins));
+		}
+		vector<unsigned char> output(in.planar.size());
+		vector<int> lut = asyncEqualisers[in.bins]->Submit(in.planar.data(), output.data(), in.width, in.height, in.channels).get();
+		string mismatch = FirstBin(in.table, lut);
+		return mismatch.empty() ? FirstPixel(equalised(in, in.planar), output, in.width, in.height, in.channels) : "table " + mismatch;
+	});
+	// The lookup table cache of batch mode (-cache, and -cache-outputs with outputs kept): every image goes through twice,
+	// the second time has to be a hit and give the same table and output. The key has no bin count, so a cache per bin count.
+	map<int, unique_ptr<LutCache>> tableCaches, outputCaches;
+	map<int, unique_ptr<Equaliser>> tableCacheEqualisers, outputCacheEqualisers;
+	auto cached = [&](bool keepOutputs) {
+		return [&, keepOutputs](const Input& in) {
+			map<int, unique_ptr<LutCache>>& caches = keepOutputs ? outputCaches : tableCaches;
+			if (!caches[in.bins]) {
+				caches[in.bins].reset(new LutCache((size_t)64 << 20, keepOutputs));
+			}
+			LutCache& cache = *caches[in.bins];
+			Equaliser& cachedEqualiser = equaliser(keepOutputs ? outputCacheEqualisers : tableCacheEqualisers, in.bins, false);
+			cachedEqualiser.SetCache(&cache);
+			for (int pass = 0; pass < 2; pass++) {
+				size_t hits = cache.hits;
+				vector<unsigned char> output(in.planar.size());
+				vector<int> lut = cachedEqualiser.Equalise(in.planar.data(), output.data(), in.planar.size(), in.channels);
+				if (pass == 1 && cache.hits != hits + 1) {
+					return string("the second pass missed the cache");
+				}
+				string mismatch = FirstBin(in.table, lut);
+				mismatch = mismatch.empty() ? FirstPixel(equalised(in, in.planar), output, in.width, in.height, in.channels) : "table " + mismatch;
+				if (!mismatch.empty()) {
+					return (pass == 0 ? "first pass, " : "second pass, ") + mismatch;
+				}
+			}
+			return string();
+		};
+	};
+	add("Equaliser cache", cached(false));
+	add("Equaliser cache outputs", cached(true));
+
+	// The C interface, planar in and interleaved out: histeq_equalise, and histeq_submit with histeq_wait and the table from
+	// the callback. One handle per bin count, with its own program built from the same file.
+	map<int, shared_ptr<histeq_equaliser>> handles;
+	auto handle = [&](int bins) {
+		if (!handles[bins]) {
+			histeq_equaliser* made = histeq_create(platform_id, device_id, "kernels/my_kernels.cl", bins, 0);
+			if (made == NULL) {
+				throw runtime_error("histeq_create failed for " + to_string(bins) + " bins: " + histeq_last_error(NULL));
+			}
+			handles[bins] = shared_ptr<histeq_equaliser>(made, histeq_destroy);
+		}
+		return handles[bins].get();
+	};
+	auto histeqViews = [](const Input& in, vector<unsigned char>& source, vector<unsigned char>& output, histeq_view& input, histeq_view& result) {
+		input = { source.data(), in.width, in.height, in.channels, (size_t)in.width, (size_t)in.Plane(), HISTEQ_PLANAR };
+		result = { output.data(), in.width, in.height, in.channels, (size_t)in.width * in.channels, 1, HISTEQ_INTERLEAVED };
+	};
+	add("histeq_equalise", [&](const Input& in) {
+		vector<unsigned char> source = in.planar, output(in.planar.size());
+		vector<int> lut(in.bins);
+		histeq_view input, result;
+		histeqViews(in, source, output, input, result);
+		histeq_equaliser* library = handle(in.bins);
+		if (histeq_equalise(library, &input, &result, lut.data()) != 0) {
+			return string("histeq_equalise: ") + histeq_last_error(library);
+		}
+		string mismatch = FirstBin(in.table, lut);
+		return mismatch.empty() ? FirstPixel(equalised(in, in.interleaved), output, in.width, in.height, in.channels, true) : "table " + mismatch;
+	});
+	add("histeq_submit", [&](const Input& in) {
+		vector<unsigned char> source = in.planar, output(in.planar.size());
+		vector<int> lut;
+		histeq_view input, result;
+		histeqViews(in, source, output, input, result);
+		histeq_equaliser* library = handle(in.bins);
+		histeq_callback keep = [](int status, const int* table, int bins, void* user) {
+			if (status == 0) {
+				((vector<int>*)user)->assign(table, table + bins);
+			}
+		};
+		if (histeq_submit(library, &input, &result, keep, &lut) != 0 || histeq_wait(library) != 0) {
+			return string("histeq_submit: ") + histeq_last_error(library);
+		}
+		string mismatch = FirstBin(in.table, lut);
+		return mismatch.empty() ? FirstPixel(equalised(in, in.interleaved), output, in.width, in.height, in.channels, true) : "table " + mismatch;
+	});
+
+#ifdef __cpp_impl_coroutine
+	// The coroutine batch (-co), from a PGM or PPM file to <name>_equalised through the file threads. It only counts 256 bins.
+	filesystem::path folder = filesystem::temp_directory_path();
+	add("CoroutineBatch", [&](const Input& in) {
+		string source = (folder / ("verify_" + to_string(in.index) + (in.channels == 3 ? ".ppm" : ".pgm"))).string();
+		string target = (folder / ("verify_" + to_string(in.index) + "_equalised")).string();
+		Pnm image(in.width, in.height, in.channels);
+		copy(in.interleaved.begin(), in.interleaved.end(), image.Pixels());
+		vector<unsigned char> file = image.Encode();
+		ofstream(source, ios::binary).write((const char*)file.data(), file.size());
+
+		vector<string> filenames = { source };
+		CoroutineBatch batch(context, program, filenames, false, [&](const string&) { return target; });
+		batch.Run(1);
+		ifstream written(target, ios::binary);
+		vector<unsigned char> read((istreambuf_iterator<char>(written)), istreambuf_iterator<char>());
+		written.close();
+		filesystem::remove(source);
+		filesystem::remove(target);
+		if (batch.failed != 0) {
+			return string("the batch failed");
+		}
+		Pnm output = Pnm::Decode(read);
+		vector<unsigned char> pixels(output.Pixels(), output.Pixels() + output.Size());
+		return FirstPixel(equalised(in, in.interleaved), pixels, in.width, in.height, in.channels, true);
+	}, [](const Input& in) { return in.bins == 256; });
+#endif
+
+	add("SlidingAHE", [&](const Input& in) {
+		int radius = 1 + in.index % 8;
+		vector<unsigned char> output(in.planar.size()), expected;
+		SlidingAHE(radius).Apply(in.planar.data(), output.data(), in.width, in.height, in.channels);
+		for (int c = 0; c < in.channels; c++) {
+			vector<unsigned char> plane = Reference::AdaptiveEqualise(in.planar.data() + (size_t)c * in.Plane(), in.width, in.height, radius);
+			expected.insert(expected.end(), plane.begin(), plane.end());
+		}
+		return FirstPixel(expected, output, in.width, in.height, in.channels);
+	}, [](const Input& in) { return in.Plane() <= 128 * 128; }); // counting every window is slow
+
+	// Leave out the variants the filter does not pick
+	vector<Variant> picked;
+	for (const Variant& variant : variants) {
+		if (variant.name.find(filter) != string::npos) {
+			picked.push_back(variant);
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		Input input = Generate(i, seed + i, maxWidth, maxHeight);
+		for (Variant& variant : picked) {
+			if (!variant.applies(input)) {
+				continue;
+			}
+			string mismatch;
+			try {
+				mismatch = variant.run(input);
+			}
+			catch (const cl::Error& err) {
+				mismatch = string("OpenCL error in ") + err.what() + ", " + getErrorString(err.err());
+			}
+			catch (const exception& err) {
+				mismatch = err.what();
+			}
+			variant.cases++;
+			if (!mismatch.empty()) {
+				if (variant.failures++ == 0) {
+					variant.first = input.Describe() + ": " + mismatch;
+				}
+			}
+		}
+		if ((i + 1) % 100 == 0) {
+			std::cout << i + 1 << " images checked" << std::endl;
+		}
+	}
+
+	int failed = 0;
+	std::cout << left << setw(36) << "variant" << right << setw(8) << "cases" << setw(10) << "failed" << "  first mismatch" << std::endl;
+	for (const Variant& variant : picked) {
+		std::cout << left << setw(36) << variant.name << right << setw(8) << variant.cases << setw(10) << variant.failures << "  "
+			<< (variant.failures ? variant.first : "-") << (variant.known && variant.failures ? " (known)" : "") << std::endl;
+		if (variant.failures && !variant.known) {
+			failed++;
+		}
+	}
+	std::cout << (failed ? to_string(failed) + " variant(s) did not match" : "Every variant matched") << std::endl;
+	return failed;
+}
+
+int main(int argc, char **argv) {
+	int platform_id = 0;
+	int device_id = 0;
+	bool all = false;
+	int count = 1000;
+	int maxWidth = 512, maxHeight = 512;
+	uint64_t seed = 0;
+	string filter = "";
+
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
+		else if (strcmp(argv[i], "-all") == 0) { all = true; }
+		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+		else if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) { count = atoi(argv[++i]); }
+		else if ((strcmp(argv[i], "-max") == 0) && (i < (argc - 1))) { sscanf(argv[++i], "%dx%d", &maxWidth, &maxHeight); }
+		else if ((strcmp(argv[i], "-seed") == 0) && (i < (argc - 1))) { seed = strtoull(argv[++i], NULL, 10); }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { filter = argv[++i]; }
+		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+	}
+
+	try {
+		if (count < 1 || maxWidth < 1 || maxHeight < 1) {
+			throw runtime_error("bad -n or -max");
+		}
+		// Every device of every platform with -all, each one is a backend of its own
+		vector<pair<int, int>> devices = { { platform_id, device_id } };
+		if (all) {
+			devices.clear();
+			vector<cl::Platform> platforms;
+			cl::Platform::get(&platforms);
+			for (size_t p = 0; p < platforms.size(); p++) {
+				vector<cl::Device> platformDevices;
+				platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &platformDevices);
+				for (size_t d = 0; d < platformDevices.size(); d++) {
+					devices.push_back({ (int)p, (int)d });
+				}
+			}
+		}
+
+		int failed = 0;
+		for (const pair<int, int>& device : devices) {
+			std::cout << "Runing on " << GetPlatformName(device.first) << ", " << GetDeviceName(device.first, device.second) << std::endl;
+			failed += Verify(device.first, device.second, count, seed, maxWidth, maxHeight, filter);
+		}
+		return failed ? 1 : 0;
+	}
+	catch (const cl::Error& err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		return 1;
+	}
+	catch (const exception& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdexcept>
+
+#include "Utils.h"
+
+using namespace std;
+
+// Asynchronous equalisation: Submit() enqueues the whole pipeline for an image and returns a future straight away.
+// The commands of one image are chained by event wait lists (upload and clear, view_histogram, cumulativeHistogram,
+// normalise_fixed, lookup, download) on an out-of-order queue where the device has one, so several images overlap
+// on the device. Completion is signalled by clSetEventCallback on a marker after the downloads. The callback runs on the
+// OpenCL runtime's thread, where only short work is allowed, so it just fulfils the future and frees the slot; one
+// dispatcher thread enqueues the images, so no host thread blocks per image.
+// Memory is bounded by the slots: each slot owns one set of device buffers, and at most that many images are on the
+// device at once. Images submitted while every slot is busy wait in a queue that only holds their pointers, so hundreds
+// can be submitted from one thread. The caller's input and output have to stay valid until the future is ready.
+class AsyncEqualiser {
+public:
+	AsyncEqualiser(const cl::Context& context, const cl::Program& program, int slots = 8, int hist = 256)
+		: context(context), program(program), hist(hist), histogramSize(hist * sizeof(int)) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		// An in-order queue gives the same results, the wait lists just cannot let images overlap there.
+		cl_command_queue_properties properties = device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+		queue = cl::CommandQueue(context, device, properties);
+
+		vector<int> binvals(hist);
+		for (int i = 0; i < hist; i++) {
+			binvals[i] = i * (256 / hist);
+		}
+		binsizeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, histogramSize);
+		queue.enqueueWriteBuffer(binsizeBuffer, CL_TRUE, 0, histogramSize, &binvals[0]);
+
+		for (int s = 0; s < slots; s++) {
+			this->slots.emplace_back(new Slot(this));
+			free.push_back(this->slots.back().get());
+		}
+		dispatcher = thread([this]() { Dispatch(); });
+	}
+
+	~AsyncEqualiser() {
+		Wait();
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		startable.notify_all();
+		dispatcher.join();
+	}
+
+	// Equalises width x height pixels with channels planes (the CImg layout) from input into output.
+	// The future holds the lookup table, or the OpenCL error if the pipeline failed.
+	future<vector<int>> Submit(const unsigned char* input, unsigned char* output, int width, int height, int channels) {
+		Request request{ input, output, width, height, channels, promise<vector<int>>() };
+		future<vector<int>> result = request.done.get_future();
+
+		{
+			lock_guard<mutex> guard(lock);
+			inFlight++;
+			waiting.push_back(move(request));
+		}
+		startable.notify_all();
+		return result;
+	}
+
+	// Blocks until every submitted image is done.
+	void Wait() {
+		unique_lock<mutex> guard(lock);
+		idle.wait(guard, [this]() { return inFlight == 0; });
+	}
+
+	// Images submitted and not finished yet, on the device or waiting for a slot
+	size_t InFlight() {
+		lock_guard<mutex> guard(lock);
+		return inFlight;
+	}
+
+private:
+	struct Request {
+		const unsigned char* input;
+		unsigned char* output;
+		int width;
+		int height;
+		int channels;
+		promise<vector<int>> done;
+	};
+
+	// One set of device buffers and kernels, used by one image at a time.
+	struct Slot {
+		Slot(AsyncEqualiser* owner) : owner(owner),
+			histogram(owner->context, CL_MEM_READ_WRITE, owner->histogramSize),
+			cumulative(owner->context, CL_MEM_READ_WRITE, owner->histogramSize),
+			normalised(owner->context, CL_MEM_READ_WRITE, owner->histogramSize),
+			kernel_histogram(owner->program, "view_histogram"),
+			kernel_scan(owner->program, "cumulativeHistogram"),
+			kernel_normalise(owner->program, "normalise_fixed"),
+			kernel_lookup(owner->program, "lookup") {}
+
+		AsyncEqualiser* owner;
+		Request request;
+		vector<int> lut;
+		cl::Buffer input, output, histogram, cumulative, normalised;
+		cl::Kernel kernel_histogram, kernel_scan, kernel_normalise, kernel_lookup;
+		size_t capacity = 0;
+		cl::Event done;
+	};
+
+	// The dispatcher thread: starts the waiting images in order, each one as soon as a slot is free.
+	void Dispatch() {
+		unique_lock<mutex> guard(lock);
+		while (true) {
+			startable.wait(guard, [this]() { return stopping || (!waiting.empty() && !free.empty()); });
+			if (waiting.empty()) {
+				return;
+			}
+			Slot* slot = free.back();
+			free.pop_back();
+			Request request = move(waiting.front());
+			waiting.pop_front();
+			guard.unlock();
+			bool started = Start(slot, move(request));
+			guard.lock();
+			if (!started) {
+				Release(slot);
+			}
+		}
+	}
+
+	// Enqueues the pipeline of request on slot, and the callback that finishes it. On failure the future gets the
+	// error and false is returned, the slot is then still the caller's.
+	bool Start(Slot* slot, Request request) {
+		slot->request = move(request);
+		const Request& r = slot->request;
+		size_t size = (size_t)r.width * r.height * r.channels;
+
+		try {
+			if (size > slot->capacity) {
+				slot->input = cl::Buffer(context, CL_MEM_READ_ONLY, size);
+				slot->output = cl::Buffer(context, CL_MEM_WRITE_ONLY, size);
+				slot->capacity = size;
+			}
+			slot->lut.assign(hist, 0);
+			cl::Event uploaded, cleared, counted, scanned, normalised, mapped, downloaded, tableRead;
+
+			queue.enqueueWriteBuffer(slot->input, CL_FALSE, 0, size, r.input, NULL, &uploaded);
+			queue.enqueueFillBuffer(slot->histogram, 0, 0, histogramSize, NULL, &cleared);
+
+			vector<cl::Event> ready = { uploaded, cleared };
+			slot->kernel_histogram.setArg(0, slot->input);
+			slot->kernel_histogram.setArg(1, slot->histogram);
+			slot->kernel_histogram.setArg(2, cl::Local(histogramSize));
+			slot->kernel_histogram.setArg(3, r.width);
+			slot->kernel_histogram.setArg(4, r.height);
+			slot->kernel_histogram.setArg(5, (cl_ulong)r.width); // row pitch
+			slot->kernel_histogram.setArg(6, (cl_ulong)1); // pixel stride
+			slot->kernel_histogram.setArg(7, (cl_ulong)r.width * r.height); // channel stride
+			slot->kernel_histogram.setArg(8, r.channels);
+			slot->kernel_histogram.setArg(9, hist);
+			slot->kernel_histogram.setArg(10, binsizeBuffer);
+			queue.enqueueNDRangeKernel(slot->kernel_histogram, cl::NullRange, cl::NDRange((r.width + 15) / 16 * 16, (r.height + 15) / 16 * 16), cl::NDRange(16, 16), &ready, &counted);
+
+			vector<cl::Event> afterCount = { counted };
+			slot->kernel_scan.setArg(0, slot->histogram);
+			slot->kernel_scan.setArg(1, slot->cumulative);
+			slot->kernel_scan.setArg(2, cl::Local(histogramSize));
+			slot->kernel_scan.setArg(3, cl::Local(histogramSize));
+			queue.enqueueNDRangeKernel(slot->kernel_scan, cl::NullRange, cl::NDRange(hist), cl::NDRange(hist), &afterCount, &scanned);
+
+			vector<cl::Event> afterScan = { scanned };
+			slot->kernel_normalise.setArg(0, slot->cumulative);
+			slot->kernel_normalise.setArg(1, slot->normalised);
+			slot->kernel_normalise.setArg(2, hist);
+			queue.enqueueNDRangeKernel(slot->kernel_normalise, cl::NullRange, cl::NDRange(hist), cl::NullRange, &afterScan, &normalised);
+
+			vector<cl::Event> afterNormalise = { normalised };
+			slot->kernel_lookup.setArg(0, slot->input);
+			slot->kernel_lookup.setArg(1, slot->normalised);
+			slot->kernel_lookup.setArg(2, slot->output);
+			slot->kernel_lookup.setArg(3, hist);
+			slot->kernel_lookup.setArg(4, binsizeBuffer);
+			queue.enqueueNDRangeKernel(slot->kernel_lookup, cl::NullRange, cl::NDRange(size), cl::NullRange, &afterNormalise, &mapped);
+			queue.enqueueReadBuffer(slot->normalised, CL_FALSE, 0, histogramSize, &slot->lut[0], &afterNormalise, &tableRead);
+
+			vector<cl::Event> afterLookup = { mapped };
+			queue.enqueueReadBuffer(slot->output, CL_FALSE, 0, size, r.output, &afterLookup, &downloaded);
+
+			vector<cl::Event> finished = { downloaded, tableRead };
+			queue.enqueueMarkerWithWaitList(&finished, &slot->done);
+			slot->done.setCallback(CL_COMPLETE, &AsyncEqualiser::Finished, slot);
+			queue.flush();
+			return true;
+		}
+		catch (const exception&) {
+			slot->request.done.set_exception(current_exception());
+			return false;
+		}
+	}
+
+	// Runs on an OpenCL runtime thread when the marker after an image's downloads completes, or fails. Only fulfils
+	// the future and frees the slot, the dispatcher starts the next image.
+	static void CL_CALLBACK Finished(cl_event, cl_int status, void* data) {
+		Slot* slot = (Slot*)data;
+		if (status < 0) {
+			slot->request.done.set_exception(make_exception_ptr(cl::Error(status, "asynchronous equalisation")));
+		}
+		else {
+			slot->request.done.set_value(move(slot->lut));
+		}
+		lock_guard<mutex> guard(slot->owner->lock);
+		slot->owner->Release(slot);
+	}
+
+	// Puts a slot whose image is done back on the free list, with lock held.
+	void Release(Slot* slot) {
+		inFlight--;
+		free.push_back(slot);
+		startable.notify_all();
+		idle.notify_all();
+	}
+
+	cl::Context context;
+	cl::Program program;
+	cl::CommandQueue queue;
+	int hist;
+	size_t histogramSize;
+	cl::Buffer binsizeBuffer;
+
+	vector<unique_ptr<Slot>> slots;
+	vector<Slot*> free;
+	deque<Request> waiting;
+	size_t inFlight = 0;
+	bool stopping = false;
+	mutex lock;
+	condition_variable startable; // a waiting image and a free slot, or stopping
+	condition_variable idle;
+	thread dispatcher;
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Summary statistics of repeated timings, after outlier rejection.
+struct Stats {
+	double min = 0;
+	double median = 0;
+	double p95 = 0;
+	double mean = 0;
+	double stddev = 0;
+	int rejected = 0; // samples dropped as outliers
+	vector<double> kept; // the samples left, sorted
+};
+
+// The value at fraction q (0..1) of sorted samples, interpolated between neighbours.
+inline double Quantile(const vector<double>& sorted, double q) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	double at = q * (sorted.size() - 1);
+	size_t below = (size_t)at;
+	size_t above = min(below + 1, sorted.size() - 1);
+	return sorted[below] + (sorted[above] - sorted[below]) * (at - below);
+}
+
+// Median absolute deviation, scaled by 1.4826 so it estimates the standard deviation of normal noise.
+inline double Mad(const vector<double>& samples, double median) {
+	vector<double> deviations;
+	for (double sample : samples) {
+		deviations.push_back(fabs(sample - median));
+	}
+	sort(deviations.begin(), deviations.end());
+	return 1.4826 * Quantile(deviations, 0.5);
+}
+
+// Drops the samples more than 3 MADs from the median (interrupts, clock changes, a late JIT) and summarises the rest.
+// The median and MAD are not pulled about by the outliers themselves, unlike the mean and standard deviation.
+inline Stats Summarise(vector<double> samples) {
+	Stats stats;
+	sort(samples.begin(), samples.end());
+	double median = Quantile(samples, 0.5);
+	double mad = Mad(samples, median);
+	for (double sample : samples) {
+		if (mad == 0 || fabs(sample - median) <= 3 * mad) {
+			stats.kept.push_back(sample);
+		}
+	}
+	stats.rejected = (int)(samples.size() - stats.kept.size());
+	if (stats.kept.empty()) {
+		return stats;
+	}
+	stats.min = stats.kept.front();
+	stats.median = Quantile(stats.kept, 0.5);
+	stats.p95 = Quantile(stats.kept, 0.95);
+	for (double sample : stats.kept) {
+		stats.mean += sample;
+	}
+	stats.mean /= stats.kept.size();
+	for (double sample : stats.kept) {
+		stats.stddev += (sample - stats.mean) * (sample - stats.mean);
+	}
+	stats.stddev = stats.kept.size() > 1 ? sqrt(stats.stddev / (stats.kept.size() - 1)) : 0;
+	return stats;
+}
+
+// One kernel at one problem size. The work counts are per launch and give the rates from the median time.
+struct BenchmarkResult {
+	string kernel;
+	int width = 0;
+	int height = 0;
+	int bins = 0;
+	string distribution; // of the synthetic input
+	double pixels = 0;
+	double bytes = 0; // global memory read and written
+	double written = 0; // of those bytes
+	double atomics = 0;
+	double rooflinePercent = -1; // of the median time, below 0 without a roofline calibration
+	Stats ns;
+};
+
+// Characters that cannot go into a JSON string as they are
+inline string JsonEscape(const string& text) {
+	string escaped;
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += c;
+		}
+		else if ((unsigned char)c < 0x20) {
+			escaped += ' ';
+		}
+		else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+// Writes a run as JSON, one object per result with the statistics, the rates and the kept samples, so runs from
+// different commits or hosts can be compared later. calibration holds the measured roofs, if any.
+inline void WriteJson(ostream& out, const string& platform, const string& device, int warmup, int repetitions, const vector<BenchmarkResult>& results,
+	const vector<pair<string, double>>& calibration = {}) {
+	out << setprecision(10);
+	out << "{\n";
+	out << "\t\"platform\": \"" << JsonEscape(platform) << "\",\n";
+	out << "\t\"device\": \"" << JsonEscape(device) << "\",\n";
+	out << "\t\"warmup\": " << warmup << ",\n";
+	out << "\t\"repetitions\": " << repetitions << ",\n";
+	if (!calibration.empty()) {
+		out << "\t\"roofline\": {";
+		for (size_t c = 0; c < calibration.size(); c++) {
+			out << (c ? ", " : " ") << "\"" << JsonEscape(calibration[c].first) << "\": " << calibration[c].second;
+		}
+		out << " },\n";
+	}
+	out << "\t\"results\": [\n";
+	for (size_t r = 0; r < results.size(); r++) {
+		const BenchmarkResult& result = results[r];
+		double seconds = result.ns.median * 1e-9;
+		out << "\t\t{\n";
+		out << "\t\t\t\"kernel\": \"" << JsonEscape(result.kernel) << "\",\n";
+		out << "\t\t\t\"width\": " << result.width << ",\n";
+		out << "\t\t\t\"height\": " << result.height << ",\n";
+		out << "\t\t\t\"bins\": " << result.bins << ",\n";
+		out << "\t\t\t\"distribution\": \"" << JsonEscape(result.distribution) << "\",\n";
+		out << "\t\t\t\"rejected\": " << result.ns.rejected << ",\n";
+		out << "\t\t\t\"min_ns\": " << result.ns.min << ",\n";
+		out << "\t\t\t\"median_ns\": " << result.ns.median << ",\n";
+		out << "\t\t\t\"p95_ns\": " << result.ns.p95 << ",\n";
+		out << "\t\t\t\"mean_ns\": " << result.ns.mean << ",\n";
+		out << "\t\t\t\"stddev_ns\": " << result.ns.stddev << ",\n";
+		out << "\t\t\t\"pixels_per_s\": " << (seconds > 0 ? result.pixels / seconds : 0) << ",\n";
+		out << "\t\t\t\"bytes_per_s\": " << (seconds > 0 ? result.bytes / seconds : 0) << ",\n";
+		out << "\t\t\t\"atomics_per_s\": " << (seconds > 0 ? result.atomics / seconds : 0) << ",\n";
+		if (result.rooflinePercent >= 0) {
+			out << "\t\t\t\"roofline_percent\": " << result.rooflinePercent << ",\n";
+		}
+		out << "\t\t\t\"samples_ns\": [";
+		for (size_t s = 0; s < result.ns.kept.size(); s++) {
+			out << (s ? ", " : "") << result.ns.kept[s];
+		}
+		out << "]\n";
+		out << "\t\t}" << (r + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n";
+	out << "}\n";
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+
+#include "Utils.h"
+#include "Coroutines.h"
+#include "Pnm.h"
+
+using namespace std;
+
+// Coroutine batch mode (-co): each job is one straight-line coroutine that reads, decodes, uploads, counts, scans and
+// normalises, applies, downloads, encodes and writes one image after another, co_awaiting every step. Device steps resume
+// through event callbacks and file steps through the FileIo threads, so a few pool threads drive every job and none of
+// them blocks. Each job waits for its own commands, so they need no wait lists on the shared out-of-order queue.
+// Images are binary PGM or PPM, equalised as they are stored (interleaved) through the view kernels, and each one is
+// written to the file outputName gives for it.
+class CoroutineBatch {
+public:
+	CoroutineBatch(const cl::Context& context, const cl::Program& program, const vector<string>& filenames, bool threadsIo,
+		const function<string(const string&)>& outputName)
+		: io(MakeFileIo(threadsIo)), context(context), program(program), filenames(filenames), outputName(outputName) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		queue = cl::CommandQueue(context, device, device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+		vector<int> binvals(256);
+		for (int i = 0; i < 256; i++) {
+			binvals[i] = i;
+		}
+		binsizeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, histogramSize);
+		queue.enqueueWriteBuffer(binsizeBuffer, CL_TRUE, 0, histogramSize, &binvals[0]);
+	}
+
+	// Starts the jobs and waits until they have run out of images.
+	void Run(int jobs) {
+		int running = jobs;
+		mutex done;
+		condition_variable finished;
+		for (int j = 0; j < jobs; j++) {
+			Spawn(Job(), [&](exception_ptr) {
+				lock_guard<mutex> guard(done);
+				running--;
+				finished.notify_all();
+			});
+		}
+		unique_lock<mutex> guard(done);
+		finished.wait(guard, [&]() { return running == 0; });
+	}
+
+	atomic<size_t> pixels{ 0 };
+	atomic<size_t> failed{ 0 };
+	unique_ptr<FileIo> io;
+
+private:
+	Task<void> Job() {
+		cl::Buffer input, output;
+		cl::Buffer histogram(context, CL_MEM_READ_WRITE, histogramSize);
+		cl::Buffer cumulative(context, CL_MEM_READ_WRITE, histogramSize);
+		cl::Buffer normalised(context, CL_MEM_READ_WRITE, histogramSize);
+		cl::Kernel kernel_histogram(program, "view_histogram");
+		cl::Kernel kernel_scan(program, "cumulativeHistogram");
+		cl::Kernel kernel_normalise(program, "normalise_fixed");
+		cl::Kernel kernel_lookup(program, "view_lookup");
+		size_t capacity = 0;
+
+		for (size_t k = next++; k < filenames.size(); k = next++) {
+			const string& filename = filenames[k];
+			try {
+				// Read and decode, the pixels stay in the buffer they were read into
+				Pnm image = Pnm::Decode(co_await ReadFile(*io, filename, pool));
+				size_t size = image.Size();
+				cl_ulong rowPitch = (cl_ulong)image.width * image.channels;
+				if (size > capacity) {
+					input = cl::Buffer(context, CL_MEM_READ_ONLY, size);
+					output = cl::Buffer(context, CL_MEM_WRITE_ONLY, size);
+					capacity = size;
+				}
+
+				// Upload
+				cl::Event uploaded, cleared;
+				queue.enqueueWriteBuffer(input, CL_FALSE, 0, size, image.Pixels(), NULL, &uploaded);
+				queue.enqueueFillBuffer(histogram, 0, 0, histogramSize, NULL, &cleared);
+				queue.flush();
+				co_await Completed(uploaded, pool);
+				co_await Completed(cleared, pool);
+
+				// Histogram
+				cl::Event counted;
+				cl::NDRange global((image.width + 15) / 16 * 16, (image.height + 15) / 16 * 16);
+				kernel_histogram.setArg(0, input);
+				kernel_histogram.setArg(1, histogram);
+				kernel_histogram.setArg(2, cl::Local(histogramSize));
+				kernel_histogram.setArg(3, image.width);
+				kernel_histogram.setArg(4, image.height);
+				kernel_histogram.setArg(5, rowPitch);
+				kernel_histogram.setArg(6, (cl_ulong)image.channels); // pixel stride
+				kernel_histogram.setArg(7, (cl_ulong)1); // channel stride
+				kernel_histogram.setArg(8, image.channels);
+				kernel_histogram.setArg(9, 256);
+				kernel_histogram.setArg(10, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_histogram, cl::NullRange, global, cl::NDRange(16, 16), NULL, &counted);
+				queue.flush();
+				co_await Completed(counted, pool);
+
+				// Scan and lookup table
+				cl::Event scanned, tabled;
+				kernel_scan.setArg(0, histogram);
+				kernel_scan.setArg(1, cumulative);
+				kernel_scan.setArg(2, cl::Local(histogramSize));
+				kernel_scan.setArg(3, cl::Local(histogramSize));
+				queue.enqueueNDRangeKernel(kernel_scan, cl::NullRange, cl::NDRange(256), cl::NDRange(256), NULL, &scanned);
+				vector<cl::Event> afterScan = { scanned };
+				kernel_normalise.setArg(0, cumulative);
+				kernel_normalise.setArg(1, normalised);
+				kernel_normalise.setArg(2, 256);
+				queue.enqueueNDRangeKernel(kernel_normalise, cl::NullRange, cl::NDRange(256), cl::NullRange, &afterScan, &tabled);
+				queue.flush();
+				co_await Completed(tabled, pool);
+
+				// Apply
+				cl::Event mapped;
+				kernel_lookup.setArg(0, input);
+				kernel_lookup.setArg(1, normalised);
+				kernel_lookup.setArg(2, output);
+				kernel_lookup.setArg(3, image.width);
+				kernel_lookup.setArg(4, image.height);
+				kernel_lookup.setArg(5, rowPitch);
+				kernel_lookup.setArg(6, (cl_ulong)image.channels);
+				kernel_lookup.setArg(7, (cl_ulong)1);
+				kernel_lookup.setArg(8, rowPitch);
+				kernel_lookup.setArg(9, (cl_ulong)image.channels);
+				kernel_lookup.setArg(10, (cl_ulong)1);
+				kernel_lookup.setArg(11, image.channels);
+				kernel_lookup.setArg(12, 256);
+				kernel_lookup.setArg(13, binsizeBuffer);
+				queue.enqueueNDRangeKernel(kernel_lookup, cl::NullRange, global, cl::NullRange, NULL, &mapped);
+				queue.flush();
+				co_await Completed(mapped, pool);
+
+				// Download, over the input pixels which are no longer needed
+				cl::Event downloaded;
+				queue.enqueueReadBuffer(output, CL_FALSE, 0, size, image.Pixels(), NULL, &downloaded);
+				queue.flush();
+				co_await Completed(downloaded, pool);
+
+				// Encode and write
+				co_await WriteFile(*io, outputName(filename), image.Encode(), pool);
+				pixels += size;
+			}
+			catch (const exception& err) {
+				lock_guard<mutex> guard(report);
+				std::cerr << filename << ": " << err.what() << std::endl;
+				failed++;
+			}
+		}
+	}
+
+	cl::Context context;
+	cl::Program program;
+	cl::CommandQueue queue;
+	cl::Buffer binsizeBuffer;
+	const size_t histogramSize = 256 * sizeof(int);
+	const vector<string>& filenames;
+	function<string(const string&)> outputName;
+	atomic<size_t> next{ 0 };
+	mutex report;
+	ThreadPool pool;
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+// C++20 coroutine building blocks for writing a whole pipeline as straight-line code: a lazily started Task, Spawn to
+// run one without waiting for it, and awaitables for OpenCL events and file I/O. Every coroutine resumes on a ThreadPool,
+// so thousands of jobs share a few threads and none of them blocks on the device or on a file.
+
+#include <coroutine>
+#include <optional>
+#include <exception>
+#include <functional>
+
+#include "Utils.h"
+#include "ThreadPool.h"
+#include "FileIo.h"
+
+using namespace std;
+
+template <typename T> class Task;
+
+// Where a finished Task goes: straight on to the coroutine awaiting it (symmetric transfer), so long chains do not grow the stack.
+struct FinalAwaiter {
+	bool await_ready() noexcept { return false; }
+	template <typename Promise>
+	coroutine_handle<> await_suspend(coroutine_handle<Promise> handle) noexcept {
+		coroutine_handle<> next = handle.promise().continuation;
+		return next ? next : noop_coroutine();
+	}
+	void await_resume() noexcept {}
+};
+
+// What Task<T> and Task<void> have in common: the exception and the coroutine waiting for the result.
+struct TaskPromiseBase {
+	exception_ptr error;
+	coroutine_handle<> continuation;
+
+	suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() {
+		error = current_exception();
+	}
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+	optional<T> value;
+
+	Task<T> get_return_object();
+	void return_value(T result) {
+		value = move(result);
+	}
+	T Result() {
+		if (error) {
+			rethrow_exception(error);
+		}
+		return move(*value);
+	}
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+	Task<void> get_return_object();
+	void return_void() {}
+	void Result() {
+		if (error) {
+			rethrow_exception(error);
+		}
+	}
+};
+
+// A coroutine that starts when it is awaited and gives back a T (or rethrows what it threw).
+template <typename T = void>
+class Task {
+public:
+	typedef TaskPromise<T> promise_type;
+
+	explicit Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+	Task(Task&& other) noexcept : handle(other.handle) {
+		other.handle = NULL;
+	}
+	Task(const Task&) = delete;
+	~Task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+	coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+	T await_resume() {
+		return handle.promise().Result();
+	}
+
+private:
+	coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// A fire and forget coroutine, it frees itself when it finishes.
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return {}; }
+		suspend_never initial_suspend() noexcept { return {}; }
+		suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { terminate(); }
+	};
+};
+
+// Runs task without waiting for it, done gets whatever it threw (NULL if nothing) once it has finished.
+inline Detached Spawn(Task<void> task, function<void(exception_ptr)> done) {
+	exception_ptr error;
+	try {
+		co_await task;
+	}
+	catch (...) {
+		error = current_exception();
+	}
+	done(error);
+}
+
+// co_await Schedule(pool) moves the coroutine onto one of the pool's threads.
+inline auto Schedule(ThreadPool& pool) {
+	struct Awaiter {
+		ThreadPool& pool;
+		bool await_ready() { return false; }
+		void await_suspend(coroutine_handle<> handle) { pool.Post([handle]() { handle.resume(); }); }
+		void await_resume() {}
+	};
+	return Awaiter{ pool };
+}
+
+// co_await Completed(event, pool) resumes on the pool once the command behind event has finished, through
+// clSetEventCallback, so no thread waits on the device. A failed command is thrown as a cl::Error from the co_await.
+// The queue has to be flushed before waiting, or the command may never be submitted.
+struct EventAwaiter {
+	cl::Event event;
+	ThreadPool& pool;
+	cl_int status = CL_COMPLETE;
+	coroutine_handle<> handle = nullptr;
+
+	bool await_ready() {
+		return false;
+	}
+	void await_suspend(coroutine_handle<> awaiting) {
+		handle = awaiting;
+		// The callback can run before setCallback returns, nothing may use this afterwards.
+		event.setCallback(CL_COMPLETE, &EventAwaiter::Done, this);
+	}
+	void await_resume() {
+		if (status < 0) {
+			throw cl::Error(status, "co_await on an OpenCL event");
+		}
+	}
+	static void CL_CALLBACK Done(cl_event, cl_int status, void* data) {
+		EventAwaiter* self = (EventAwaiter*)data;
+		self->status = status;
+		coroutine_handle<> handle = self->handle;
+		self->pool.Post([handle]() { handle.resume(); });
+	}
+};
+
+inline EventAwaiter Completed(const cl::Event& event, ThreadPool& pool) {
+	return EventAwaiter{ event, pool };
+}
+
+// co_await ReadFile(io, path, pool) gives the bytes of the file, resuming on the pool rather than the I/O thread.
+struct ReadAwaiter {
+	FileIo& io;
+	string path;
+	ThreadPool& pool;
+	vector<unsigned char> data = {};
+	exception_ptr error = nullptr;
+
+	bool await_ready() {
+		return false;
+	}
+	void await_suspend(coroutine_handle<> handle) {
+		io.Read(path, [this, handle](vector<unsigned char>&& bytes, exception_ptr failure) {
+			data = move(bytes);
+			error = failure;
+			pool.Post([handle]() { handle.resume(); });
+		});
+	}
+	vector<unsigned char> await_resume() {
+		if (error) {
+			rethrow_exception(error);
+		}
+		return move(data);
+	}
+};
+
+inline ReadAwaiter ReadFile(FileIo& io, const string& path, ThreadPool& pool) {
+	return ReadAwaiter{ io, path, pool };
+}
+
+// co_await WriteFile(io, path, data, pool) resumes on the pool once the file has been written.
+struct WriteAwaiter {
+	FileIo& io;
+	string path;
+	vector<unsigned char> data;
+	ThreadPool& pool;
+	exception_ptr error = nullptr;
+
+	bool await_ready() {
+		return false;
+	}
+	void await_suspend(coroutine_handle<> handle) {
+		io.Write(path, move(data), [this, handle](exception_ptr failure) {
+			error = failure;
+			pool.Post([handle]() { handle.resume(); });
+		});
+	}
+	void await_resume() {
+		if (error) {
+			rethrow_exception(error);
+		}
+	}
+};
+
+inline WriteAwaiter WriteFile(FileIo& io, const string& path, vector<unsigned char> data, ThreadPool& pool) {
+	return WriteAwaiter{ io, path, move(data), pool };
+}
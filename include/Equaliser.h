@@ -0,0 +1,289 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
+#include "Utils.h"
+#include "LutCache.h"
+#include "ImageView.h"
+
+using namespace std;
+
+// Reusable equalisation of one image after another on the device, the engine behind the batch mode.
+// The device buffers are kept between images and only grow when a bigger image arrives. The pipeline is the default
+// one from main(): rgb2grey_fixed (or identity), local_global_persistent, cumulativeHistogram, normalise_fixed and lookup.
+// The persistent histogram launch does not need the image size to be a multiple of the work-group size, so any image works.
+// With a LutCache set, the image is hashed on the device (hash_blocks) straight after the upload and a hit skips to lookup,
+// or to a copy of the stored output. Strided images (ImageView) go through the view_ kernels instead.
+// This class and ImageView are the C++ side of the library API, histeq.h wraps them for C callers.
+// An Equaliser is not thread safe, it is used from one thread at a time: histeq.h runs every call on one worker thread
+// per handle, and AsyncEqualiser is the one for overlapping images.
+class Equaliser {
+public:
+	Equaliser(const cl::Context& context, const cl::Program& program, int hist = 256)
+		: context(context), program(program), queue(context), hist(hist), histogramSize(hist * sizeof(int)) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		groups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+
+		vector<int> binvals(hist);
+		for (int i = 0; i < hist; i++) {
+			binvals[i] = i * (256 / hist);
+		}
+		binsizeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, histogramSize);
+		intensityHistogram = cl::Buffer(context, CL_MEM_READ_WRITE, histogramSize);
+		cumulativeHistogram = cl::Buffer(context, CL_MEM_READ_WRITE, histogramSize);
+		normalisedHistogram = cl::Buffer(context, CL_MEM_READ_WRITE, histogramSize);
+		hashPartials = cl::Buffer(context, CL_MEM_READ_WRITE, groups * sizeof(cl_ulong));
+		queue.enqueueWriteBuffer(binsizeBuffer, CL_TRUE, 0, histogramSize, &binvals[0]);
+	}
+
+	// Optional, the cache has to outlive the Equaliser. NULL turns caching off.
+	void SetCache(LutCache* lutCache) {
+		cache = lutCache;
+	}
+
+	// With zero copy on, views are wrapped in host pointer buffers (CL_MEM_USE_HOST_PTR) instead of being transferred, and
+	// the kernels use the caller's strides as they are. CPU and integrated GPU devices then work on the caller's memory
+	// directly, other devices let the driver move the pixels. The output is mapped before Equalise returns so it is up to date.
+	void SetZeroCopy(bool on) {
+		zeroCopy = on;
+	}
+
+	// Equalises size bytes of input stored like CImg (one channel after another, spectrum channels) into output,
+	// and returns the lookup table that was used.
+	vector<int> Equalise(const unsigned char* input, unsigned char* output, size_t size, int spectrum) {
+		vector<int> lut(hist);
+		Reserve(size);
+		queue.enqueueWriteBuffer(imageInput, CL_FALSE, 0, size, input);
+
+		uint64_t key = 0;
+		if (cache != NULL) {
+			key = Hash(size, spectrum);
+			vector<unsigned char> stored;
+			if (cache->Find(key, lut, cache->KeepsOutputs() ? &stored : NULL)) {
+				if (stored.size() == size) {
+					copy(stored.begin(), stored.end(), output);
+					return lut;
+				}
+				queue.enqueueWriteBuffer(normalisedHistogram, CL_FALSE, 0, histogramSize, &lut[0]);
+				Lookup(output, size);
+				return lut;
+			}
+		}
+
+		queue.enqueueFillBuffer(intensityHistogram, 0, 0, histogramSize);
+
+		cl::Kernel kernel_grey(program, spectrum == 3 ? "rgb2grey_fixed" : "identity");
+		kernel_grey.setArg(0, imageInput);
+		kernel_grey.setArg(1, greyImage);
+		queue.enqueueNDRangeKernel(kernel_grey, cl::NullRange, cl::NDRange(size), cl::NullRange);
+
+		cl::Kernel kernel_histogram(program, "local_global_persistent");
+		kernel_histogram.setArg(0, greyImage);
+		kernel_histogram.setArg(1, intensityHistogram);
+		kernel_histogram.setArg(2, cl::Local(histogramSize));
+		kernel_histogram.setArg(3, cl::Local(256 * sizeof(int)));
+		kernel_histogram.setArg(4, (int)size);
+		kernel_histogram.setArg(5, hist);
+		kernel_histogram.setArg(6, binsizeBuffer);
+		queue.enqueueNDRangeKernel(kernel_histogram, cl::NullRange, cl::NDRange(groups * 256), cl::NDRange(256));
+		BuildLut(lut);
+
+		Lookup(output, size);
+		if (cache != NULL) {
+			cache->Insert(key, lut, output, size);
+		}
+		return lut;
+	}
+
+	// Equalises a strided view into another view with the same size and channels, the layouts can differ, and input and
+	// output can be the same view to equalise in place. Dense views are transferred as they are, padded rows and sub-images
+	// are packed by rect transfers on the way to the device and unpacked on the way back, and with zero copy the kernels
+	// work on the caller's strides directly. The histogram and lookup run as 2D launches on the strided data, with 64-bit
+	// strides. The cache is not used.
+	vector<int> Equalise(const ImageView& input, const ImageView& output) {
+		if (input.width != output.width || input.height != output.height || input.channels != output.channels) {
+			throw runtime_error("the input and output views must have the same size and channels");
+		}
+		vector<int> lut(hist);
+		ImageView packedInput = zeroCopy ? input : Packed(input);
+		ImageView packedOutput = zeroCopy ? output : Packed(output);
+		cl::Buffer inputBuffer, outputBuffer;
+		if (zeroCopy && input.data == output.data) {
+			// In place, one buffer for both so the same host memory is not wrapped twice
+			inputBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, max(Span(input), Span(output)), input.data);
+			outputBuffer = inputBuffer;
+		}
+		else if (zeroCopy) {
+			inputBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, Span(input), input.data);
+			outputBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, Span(output), output.data);
+		}
+		else {
+			Reserve((size_t)input.width * input.height * input.channels);
+			inputBuffer = imageInput;
+			outputBuffer = intensityMap;
+			Transfer(imageInput, input, packedInput, true);
+		}
+		queue.enqueueFillBuffer(intensityHistogram, 0, 0, histogramSize);
+
+		cl::NDRange global((input.width + 15) / 16 * 16, (input.height + 15) / 16 * 16);
+		cl::Kernel kernel_histogram(program, "view_histogram");
+		kernel_histogram.setArg(0, inputBuffer);
+		kernel_histogram.setArg(1, intensityHistogram);
+		kernel_histogram.setArg(2, cl::Local(histogramSize));
+		kernel_histogram.setArg(3, input.width);
+		kernel_histogram.setArg(4, input.height);
+		kernel_histogram.setArg(5, (cl_ulong)packedInput.rowPitch);
+		kernel_histogram.setArg(6, (cl_ulong)packedInput.PixelStride());
+		kernel_histogram.setArg(7, (cl_ulong)packedInput.channelStride);
+		kernel_histogram.setArg(8, input.channels);
+		kernel_histogram.setArg(9, hist);
+		kernel_histogram.setArg(10, binsizeBuffer);
+		queue.enqueueNDRangeKernel(kernel_histogram, cl::NullRange, global, cl::NDRange(16, 16));
+		BuildLut(lut);
+
+		cl::Kernel kernel_lookup(program, "view_lookup");
+		kernel_lookup.setArg(0, inputBuffer);
+		kernel_lookup.setArg(1, normalisedHistogram);
+		kernel_lookup.setArg(2, outputBuffer);
+		kernel_lookup.setArg(3, input.width);
+		kernel_lookup.setArg(4, input.height);
+		kernel_lookup.setArg(5, (cl_ulong)packedInput.rowPitch);
+		kernel_lookup.setArg(6, (cl_ulong)packedInput.PixelStride());
+		kernel_lookup.setArg(7, (cl_ulong)packedInput.channelStride);
+		kernel_lookup.setArg(8, (cl_ulong)packedOutput.rowPitch);
+		kernel_lookup.setArg(9, (cl_ulong)packedOutput.PixelStride());
+		kernel_lookup.setArg(10, (cl_ulong)packedOutput.channelStride);
+		kernel_lookup.setArg(11, input.channels);
+		kernel_lookup.setArg(12, hist);
+		kernel_lookup.setArg(13, binsizeBuffer);
+		queue.enqueueNDRangeKernel(kernel_lookup, cl::NullRange, global, cl::NullRange);
+		if (zeroCopy) {
+			void* mapped = queue.enqueueMapBuffer(outputBuffer, CL_TRUE, CL_MAP_READ, 0, Span(output));
+			queue.enqueueUnmapMemObject(outputBuffer, mapped);
+			queue.finish();
+		}
+		else {
+			Transfer(intensityMap, output, packedOutput, false);
+		}
+		return lut;
+	}
+
+private:
+	// Scans and normalises intensityHistogram into normalisedHistogram, and starts reading the table into lut.
+	void BuildLut(vector<int>& lut) {
+		cl::Kernel kernel_cumulativeHistogram(program, "cumulativeHistogram");
+		kernel_cumulativeHistogram.setArg(0, intensityHistogram);
+		kernel_cumulativeHistogram.setArg(1, cumulativeHistogram);
+		kernel_cumulativeHistogram.setArg(2, cl::Local(histogramSize));
+		kernel_cumulativeHistogram.setArg(3, cl::Local(histogramSize));
+		queue.enqueueNDRangeKernel(kernel_cumulativeHistogram, cl::NullRange, cl::NDRange(hist), cl::NDRange(hist));
+
+		cl::Kernel kernel_normalise(program, "normalise_fixed");
+		kernel_normalise.setArg(0, cumulativeHistogram);
+		kernel_normalise.setArg(1, normalisedHistogram);
+		kernel_normalise.setArg(2, hist);
+		queue.enqueueNDRangeKernel(kernel_normalise, cl::NullRange, cl::NDRange(hist), cl::NullRange);
+		queue.enqueueReadBuffer(normalisedHistogram, CL_FALSE, 0, histogramSize, &lut[0]);
+	}
+
+	// True when a view has no gaps, no row padding and (when planar) each channel straight after the one before.
+	static bool Dense(const ImageView& view) {
+		return view.rowPitch == view.width * view.PixelStride() && (view.layout == ImageView::INTERLEAVED || view.channelStride == view.rowPitch * view.height);
+	}
+
+	// The layout a view is given on the device: the same channel order with the row padding removed.
+	static ImageView Packed(const ImageView& view) {
+		return view.layout == ImageView::PLANAR ? ImageView::Planar(NULL, view.width, view.height, view.channels)
+			: ImageView::Interleaved(NULL, view.width, view.height, view.channels);
+	}
+
+	// Bytes from the first pixel of a view to just past its last one.
+	static size_t Span(const ImageView& view) {
+		return (view.height - 1) * view.rowPitch + (view.width - 1) * view.PixelStride() + (view.channels - 1) * view.channelStride + 1;
+	}
+
+	// Copies the pixels of view to (write) or from the device buffer laid out as packed, one rect transfer per plane.
+	// A dense view is already laid out as packed, so it is one plain transfer.
+	void Transfer(const cl::Buffer& buffer, const ImageView& view, const ImageView& packed, bool write) {
+		if (Dense(view)) {
+			if (write) {
+				queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, Span(view), view.data);
+			}
+			else {
+				queue.enqueueReadBuffer(buffer, CL_TRUE, 0, Span(view), view.data);
+			}
+			return;
+		}
+		int planes = view.layout == ImageView::PLANAR ? view.channels : 1;
+		array<size_t, 3> hostOrigin = { 0, 0, 0 };
+		array<size_t, 3> region = { view.width * view.PixelStride(), (size_t)view.height, 1 };
+		for (int c = 0; c < planes; c++) {
+			array<size_t, 3> bufferOrigin = { 0, 0, (size_t)c };
+			unsigned char* host = view.data + c * view.channelStride;
+			if (write) {
+				queue.enqueueWriteBufferRect(buffer, CL_FALSE, bufferOrigin, hostOrigin, region, packed.rowPitch, packed.rowPitch * view.height, view.rowPitch, 0, host);
+			}
+			else {
+				queue.enqueueReadBufferRect(buffer, c == planes - 1, bufferOrigin, hostOrigin, region, packed.rowPitch, packed.rowPitch * view.height, view.rowPitch, 0, host);
+			}
+		}
+	}
+
+	// Makes sure the image buffers can hold size bytes
+	void Reserve(size_t size) {
+		if (size > capacity) {
+			imageInput = cl::Buffer(context, CL_MEM_READ_ONLY, size);
+			greyImage = cl::Buffer(context, CL_MEM_READ_WRITE, size);
+			intensityMap = cl::Buffer(context, CL_MEM_WRITE_ONLY, size);
+			capacity = size;
+		}
+	}
+
+	// Hashes the uploaded image on the device, the size and channel count are part of the key too.
+	// A hit skips the histogram, so the key is needed before the histogram is launched and the hash is its own pass
+	// over the uploaded image, with a blocking read of the partials, rather than part of the histogram pass.
+	uint64_t Hash(size_t size, int spectrum) {
+		vector<cl_ulong> partials(groups);
+		cl::Kernel kernel_hash(program, "hash_blocks");
+		kernel_hash.setArg(0, imageInput);
+		kernel_hash.setArg(1, hashPartials);
+		kernel_hash.setArg(2, cl::Local(256 * sizeof(cl_ulong)));
+		kernel_hash.setArg(3, (cl_ulong)size);
+		queue.enqueueNDRangeKernel(kernel_hash, cl::NullRange, cl::NDRange(groups * 256), cl::NDRange(256));
+		queue.enqueueReadBuffer(hashPartials, CL_TRUE, 0, groups * sizeof(cl_ulong), &partials[0]);
+
+		uint64_t key = size * 0x9E3779B97F4A7C15ULL ^ (uint64_t)spectrum;
+		for (cl_ulong partial : partials) {
+			key += partial;
+		}
+		return key;
+	}
+
+	// Applies normalisedHistogram to the uploaded image and reads the result into output.
+	void Lookup(unsigned char* output, size_t size) {
+		cl::Kernel kernel_lookup(program, "lookup");
+		kernel_lookup.setArg(0, imageInput);
+		kernel_lookup.setArg(1, normalisedHistogram);
+		kernel_lookup.setArg(2, intensityMap);
+		kernel_lookup.setArg(3, hist);
+		kernel_lookup.setArg(4, binsizeBuffer);
+		queue.enqueueNDRangeKernel(kernel_lookup, cl::NullRange, cl::NDRange(size), cl::NullRange);
+		queue.enqueueReadBuffer(intensityMap, CL_TRUE, 0, size, output);
+	}
+
+	cl::Context context;
+	cl::Program program;
+	cl::CommandQueue queue;
+	int hist;
+	size_t histogramSize;
+	int groups;
+	LutCache* cache = NULL;
+	bool zeroCopy = false;
+
+	cl::Buffer binsizeBuffer, intensityHistogram, cumulativeHistogram, normalisedHistogram, hashPartials;
+	cl::Buffer imageInput, greyImage, intensityMap;
+	size_t capacity = 0;
+};
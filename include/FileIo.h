@@ -0,0 +1,576 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+
+#include "ThreadPool.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
+
+using namespace std;
+
+// Whole file reads and writes that complete through a callback instead of blocking the caller.
+// The callbacks run on an I/O thread, so they should only hand the result on (post it to a pool, resume a coroutine).
+class FileIo {
+public:
+	typedef function<void(vector<unsigned char>&&, exception_ptr)> ReadDone;
+	typedef function<void(exception_ptr)> WriteDone;
+
+	virtual ~FileIo() {}
+	virtual void Read(const string& path, ReadDone done) = 0;
+	virtual void Write(const string& path, vector<unsigned char> data, WriteDone done) = 0;
+	virtual const char* Name() const = 0;
+	// What calls counts, "system calls" or "library calls"
+	virtual const char* CallsName() const = 0;
+
+	// What has been done so far, for the batch summary
+	atomic<size_t> files{ 0 };
+	atomic<size_t> bytesRead{ 0 };
+	atomic<size_t> bytesWritten{ 0 };
+	atomic<size_t> calls{ 0 };
+};
+
+// Ordinary blocking file calls run on a few I/O threads, which works on every platform.
+// calls counts the C library calls made (fopen, fseek, ftell, fread, fwrite, fclose), not system calls: how many system
+// calls those become depends on the C library's buffering, so the two backends' counts are not the same measure.
+class ThreadPoolIo : public FileIo {
+public:
+	ThreadPoolIo(int threads = 4) : pool(threads) {}
+
+	void Read(const string& path, ReadDone done) override {
+		pool.Post([this, path, done]() {
+			FILE* file = NULL;
+			try {
+				file = fopen(path.c_str(), "rb");
+				calls++;
+				if (!file) {
+					throw runtime_error("could not open " + path);
+				}
+				fseek(file, 0, SEEK_END);
+				long size = ftell(file);
+				fseek(file, 0, SEEK_SET);
+				vector<unsigned char> data(size > 0 ? size : 0);
+				size_t read = fread(data.data(), 1, data.size(), file);
+				fclose(file);
+				calls += 4;
+				file = NULL;
+				if (size < 0 || read != data.size()) {
+					throw runtime_error("could not read " + path);
+				}
+				files++;
+				bytesRead += read;
+				done(move(data), NULL);
+			}
+			catch (...) {
+				if (file) {
+					fclose(file);
+				}
+				done(vector<unsigned char>(), current_exception());
+			}
+		});
+	}
+
+	void Write(const string& path, vector<unsigned char> data, WriteDone done) override {
+		pool.Post([this, path, data = move(data), done]() {
+			try {
+				FILE* file = fopen(path.c_str(), "wb");
+				calls++;
+				if (!file) {
+					throw runtime_error("could not create " + path);
+				}
+				size_t written = fwrite(data.data(), 1, data.size(), file);
+				bool closed = fclose(file) == 0;
+				calls += 2;
+				if (written != data.size() || !closed) {
+					throw runtime_error("could not write " + path);
+				}
+				files++;
+				bytesWritten += written;
+				done(NULL);
+			}
+			catch (...) {
+				done(current_exception());
+			}
+		});
+	}
+
+	const char* Name() const override {
+		return "thread pool";
+	}
+
+	const char* CallsName() const override {
+		return "library calls";
+	}
+
+private:
+	ThreadPool pool;
+};
+
+#ifdef HAVE_IO_URING
+// Linux io_uring through its raw system calls, no liburing needed. One ring thread turns every request into a small
+// chain of ring operations (open and statx, then reads or writes until done, then close) and submits whatever all the
+// requests in flight have ready with one io_uring_enter, which also waits for the next completions. With many files in
+// flight that is a few system calls per batch of files instead of several per file. Reads go straight into the vector
+// handed to the callback and writes come straight out of the caller's vector, with no bounce buffer.
+// Buffers are not registered with the ring: every file has its own, so registering them would cost a system call (and
+// pinning) per file, which is what this is here to avoid.
+// The constructor throws if the kernel has no io_uring or lacks the operations used (before 5.6), see MakeFileIo.
+// If io_uring_enter itself fails later, every request in the ring and every one after it fails through its callback
+// with that error, as ThreadPoolIo reports its failures, and the ring thread stops.
+class UringIo : public FileIo {
+public:
+	UringIo(unsigned entries = 256) {
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ring = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if (ring < 0) {
+			throw runtime_error("io_uring is not available");
+		}
+		try {
+			Map(params);
+			Probe();
+		}
+		catch (...) {
+			Unmap();
+			close(ring);
+			throw;
+		}
+		// Each request has at most two operations in the ring, plus the one waiting on wake, within the completion queue
+		maxActive = params.sq_entries / 2 - 1;
+		wake = eventfd(0, EFD_CLOEXEC);
+		worker = thread([this]() { Run(); });
+	}
+
+	~UringIo() {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		Wake();
+		worker.join();
+		Unmap();
+		close(wake);
+		close(ring);
+		for (Op* op : retired) {
+			delete op;
+		}
+	}
+
+	void Read(const string& path, ReadDone done) override {
+		Op* op = new Op();
+		op->path = path;
+		op->readDone = move(done);
+		Post(op);
+	}
+
+	void Write(const string& path, vector<unsigned char> data, WriteDone done) override {
+		Op* op = new Op();
+		op->write = true;
+		op->path = path;
+		op->data = move(data);
+		op->writeDone = move(done);
+		Post(op);
+	}
+
+	const char* Name() const override {
+		return "io_uring";
+	}
+
+	// Every io_uring_enter and every eventfd write that wakes the ring thread counts, the ring makes no other system calls
+	// once it is set up (the eventfd is read through the ring)
+	const char* CallsName() const override {
+		return "system calls";
+	}
+
+private:
+	// One file request as it goes through the ring
+	struct alignas(8) Op {
+		bool write = false;
+		string path;
+		vector<unsigned char> data;
+		ReadDone readDone;
+		WriteDone writeDone;
+		struct statx stat;
+		int fd = -1;
+		int error = 0; // errno of the first failure
+		int outstanding = 0; // operations in the ring
+		bool opened = false; // the open (and statx) have completed
+		size_t transferred = 0;
+	};
+
+	// What a completion was for, kept in the low bits of its user_data beside the Op pointer. 0 is the wake read.
+	enum Kind { OPEN = 1, STAT = 2, TRANSFER = 3, CLOSE = 4 };
+
+	void Map(const io_uring_params& params) {
+		sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single) {
+			sqBytes = cqBytes = max(sqBytes, cqBytes);
+		}
+		sq = (unsigned char*)mmap(NULL, sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+		if (sq == MAP_FAILED) {
+			sq = NULL;
+			throw runtime_error("could not map the io_uring submission queue");
+		}
+		cq = single ? sq : (unsigned char*)mmap(NULL, cqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			cq = NULL;
+			throw runtime_error("could not map the io_uring completion queue");
+		}
+		sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)mmap(NULL, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			sqes = NULL;
+			throw runtime_error("could not map the io_uring entries");
+		}
+		sqHead = (unsigned*)(sq + params.sq_off.head);
+		sqTail = (unsigned*)(sq + params.sq_off.tail);
+		sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+		sqArray = (unsigned*)(sq + params.sq_off.array);
+		sqEntries = params.sq_entries;
+		cqHead = (unsigned*)(cq + params.cq_off.head);
+		cqTail = (unsigned*)(cq + params.cq_off.tail);
+		cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+	}
+
+	void Unmap() {
+		if (sqes) {
+			munmap(sqes, sqeBytes);
+		}
+		if (cq && cq != sq) {
+			munmap(cq, cqBytes);
+		}
+		if (sq) {
+			munmap(sq, sqBytes);
+		}
+	}
+
+	// Checks that the kernel knows every operation used
+	void Probe() {
+		const int ops = 64;
+		vector<unsigned char> memory(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op), 0);
+		io_uring_probe* probe = (io_uring_probe*)memory.data();
+		if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe, ops) < 0) {
+			throw runtime_error("io_uring is too old");
+		}
+		for (int op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+				throw runtime_error("io_uring lacks file operations");
+			}
+		}
+	}
+
+	void Post(Op* op) {
+		bool sleeping;
+		exception_ptr error;
+		{
+			lock_guard<mutex> guard(lock);
+			error = broken;
+			if (!error) {
+				incoming.push_back(op);
+			}
+			sleeping = waiting;
+			waiting = false;
+		}
+		if (error) {
+			Done(op, error);
+			delete op;
+			return;
+		}
+		// Only a ring thread blocked in io_uring_enter needs waking, a busy one picks the request up on its next round
+		if (sleeping) {
+			Wake();
+		}
+	}
+
+	void Wake() {
+		uint64_t one = 1;
+		if (write(wake, &one, sizeof(one)) == sizeof(one)) {
+			calls++;
+		}
+	}
+
+	void Run() {
+		try {
+			Ring();
+		}
+		catch (const exception&) {
+			Fail(current_exception());
+		}
+	}
+
+	void Ring() {
+		ArmWake();
+		while (true) {
+			vector<Op*> starting;
+			{
+				lock_guard<mutex> guard(lock);
+				while (!incoming.empty() && active < maxActive) {
+					starting.push_back(incoming.front());
+					incoming.pop_front();
+					active++;
+				}
+				if (stopping && incoming.empty() && active == 0) {
+					break;
+				}
+				waiting = true;
+			}
+			for (Op* op : starting) {
+				Start(op);
+			}
+			// Submits everything queued and sleeps until something completes (at least the wake read is always there)
+			Enter(1, IORING_ENTER_GETEVENTS);
+			{
+				lock_guard<mutex> guard(lock);
+				waiting = false;
+			}
+			Reap();
+		}
+	}
+
+	// The ring has failed: the requests in it and those still to start fail with error, and so does every later Post.
+	// The requests that were in the ring are only freed with the ring, as the kernel may still be using their buffers.
+	void Fail(exception_ptr error) {
+		deque<Op*> failing;
+		{
+			lock_guard<mutex> guard(lock);
+			broken = error;
+			failing.swap(incoming);
+			active = 0;
+		}
+		for (Op* op : inRing) {
+			if (op->fd >= 0) {
+				close(op->fd);
+				calls++;
+			}
+			Done(op, error);
+			retired.push_back(op);
+		}
+		inRing.clear();
+		for (Op* op : failing) {
+			Done(op, error);
+			delete op;
+		}
+	}
+
+	// The next free submission entry, cleared. A full queue is submitted first.
+	io_uring_sqe* Next(Op* op, Kind kind, int opcode) {
+		unsigned tail = *sqTail;
+		if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+			Enter(0, 0);
+		}
+		unsigned index = tail & sqMask;
+		io_uring_sqe* sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->user_data = (uint64_t)(uintptr_t)op | kind;
+		sqArray[index] = index;
+		if (op) {
+			op->outstanding++;
+		}
+		pendingSubmit++;
+		return sqe;
+	}
+
+	// Makes the entry filled in by Next visible to the kernel
+	void Queue() {
+		__atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+	}
+
+	void Enter(unsigned minComplete, unsigned flags) {
+		while (true) {
+			long submitted = syscall(__NR_io_uring_enter, ring, pendingSubmit, minComplete, flags, NULL, 0);
+			calls++;
+			if (submitted >= 0) {
+				pendingSubmit -= (unsigned)submitted;
+				return;
+			}
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				throw runtime_error(string("io_uring_enter failed: ") + strerror(errno));
+			}
+		}
+	}
+
+	void ArmWake() {
+		io_uring_sqe* sqe = Next(NULL, (Kind)0, IORING_OP_READ);
+		sqe->fd = wake;
+		sqe->addr = (uint64_t)(uintptr_t)&wakeCount;
+		sqe->len = sizeof(wakeCount);
+		Queue();
+	}
+
+	void Start(Op* op) {
+		inRing.insert(op);
+		io_uring_sqe* sqe = Next(op, OPEN, IORING_OP_OPENAT);
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)op->path.c_str();
+		sqe->len = op->write ? 0644 : 0;
+		sqe->open_flags = op->write ? (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC);
+		Queue();
+		if (!op->write) {
+			// The size is asked for beside the open, by path, so the read can follow the open straight away
+			sqe = Next(op, STAT, IORING_OP_STATX);
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uint64_t)(uintptr_t)op->path.c_str();
+			sqe->len = STATX_SIZE;
+			sqe->off = (uint64_t)(uintptr_t)&op->stat;
+			Queue();
+		}
+	}
+
+	void Reap() {
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			io_uring_cqe* cqe = &cqes[head & cqMask];
+			Op* op = (Op*)(uintptr_t)(cqe->user_data & ~(uint64_t)7);
+			Kind kind = (Kind)(cqe->user_data & 7);
+			int result = cqe->res;
+			__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+			if (!op) {
+				ArmWake();
+			}
+			else {
+				Complete(op, kind, result);
+			}
+		}
+	}
+
+	void Complete(Op* op, Kind kind, int result) {
+		op->outstanding--;
+		if (result < 0 && kind != CLOSE && !op->error) {
+			op->error = -result;
+		}
+		if (kind == OPEN && result >= 0) {
+			op->fd = result;
+		}
+		else if (kind == TRANSFER && result >= 0) {
+			if (result == 0) {
+				op->error = EIO; // the file is shorter than its size said
+			}
+			op->transferred += result;
+			(op->write ? bytesWritten : bytesRead) += result;
+		}
+		else if (kind == CLOSE) {
+			op->fd = -1;
+		}
+		if (op->outstanding > 0) {
+			return;
+		}
+		if (!op->opened && !op->error) {
+			op->opened = true;
+			if (!op->write) {
+				op->data.resize(op->stat.stx_size);
+			}
+		}
+		if (!op->error && op->opened && op->transferred < op->data.size()) {
+			io_uring_sqe* sqe = Next(op, TRANSFER, op->write ? IORING_OP_WRITE : IORING_OP_READ);
+			sqe->fd = op->fd;
+			sqe->addr = (uint64_t)(uintptr_t)(op->data.data() + op->transferred);
+			sqe->len = (unsigned)min(op->data.size() - op->transferred, (size_t)1 << 30);
+			sqe->off = op->transferred;
+			Queue();
+		}
+		else if (op->fd >= 0) {
+			io_uring_sqe* sqe = Next(op, CLOSE, IORING_OP_CLOSE);
+			sqe->fd = op->fd;
+			Queue();
+		}
+		else {
+			Finish(op);
+		}
+	}
+
+	void Finish(Op* op) {
+		exception_ptr error;
+		if (op->error) {
+			error = make_exception_ptr(runtime_error(op->path + ": " + strerror(op->error)));
+		}
+		else {
+			files++;
+		}
+		inRing.erase(op);
+		Done(op, error);
+		delete op;
+		lock_guard<mutex> guard(lock);
+		active--;
+	}
+
+	// Hands the result to the request's callback
+	void Done(Op* op, exception_ptr error) {
+		if (op->write) {
+			op->writeDone(error);
+		}
+		else {
+			op->readDone(error ? vector<unsigned char>() : move(op->data), error);
+		}
+	}
+
+	int ring = -1;
+	int wake = -1;
+	uint64_t wakeCount = 0;
+	unsigned char* sq = NULL;
+	unsigned char* cq = NULL;
+	io_uring_sqe* sqes = NULL;
+	size_t sqBytes = 0, cqBytes = 0, sqeBytes = 0;
+	unsigned* sqHead = NULL;
+	unsigned* sqTail = NULL;
+	unsigned* sqArray = NULL;
+	unsigned sqMask = 0, sqEntries = 0;
+	unsigned* cqHead = NULL;
+	unsigned* cqTail = NULL;
+	unsigned cqMask = 0;
+	io_uring_cqe* cqes = NULL;
+	unsigned pendingSubmit = 0;
+
+	thread worker;
+	unordered_set<Op*> inRing; // started and not finished, only used by the ring thread
+	vector<Op*> retired; // in the ring when it failed
+	mutex lock;
+	deque<Op*> incoming;
+	exception_ptr broken; // the error the ring failed with
+	unsigned active = 0;
+	unsigned maxActive = 0;
+	bool waiting = false;
+	bool stopping = false;
+};
+#endif
+
+// io_uring where the kernel has it (unless threads are asked for), otherwise the thread pool.
+inline unique_ptr<FileIo> MakeFileIo(bool threads = false) {
+#ifdef HAVE_IO_URING
+	if (!threads) {
+		try {
+			return unique_ptr<FileIo>(new UringIo());
+		}
+		catch (const runtime_error&) {
+		}
+	}
+#endif
+	return unique_ptr<FileIo>(new ThreadPoolIo());
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+
+// 8-bit pixels owned by the caller, described by strides instead of assumed to be dense, so sub-images, padded rows and
+// interleaved frames from capture APIs can be equalised where they are. Pixel (x, y) of channel c is at
+// data + y * rowPitch + x * PixelStride() + c * channelStride. A planar view (the CImg layout) stores one channel after
+// another, an interleaved view stores the channels of a pixel next to each other.
+struct ImageView {
+	enum Layout { PLANAR, INTERLEAVED };
+
+	unsigned char* data;
+	int width;
+	int height;
+	int channels;
+	size_t rowPitch; // bytes from one row to the next
+	size_t channelStride; // bytes from one channel to the next, 1 when interleaved
+	Layout layout;
+
+	// Bytes from one pixel to the next in a row
+	size_t PixelStride() const {
+		return layout == INTERLEAVED ? channels : 1;
+	}
+
+	// The rectangle x, y, w, h of this view, sharing its pixels.
+	ImageView Sub(int x, int y, int w, int h) const {
+		ImageView view = *this;
+		view.data = data + y * rowPitch + x * PixelStride();
+		view.width = w;
+		view.height = h;
+		return view;
+	}
+
+	// Dense planar pixels, e.g. a CImg image with depth 1. A rowPitch of 0 means rows of width bytes.
+	static ImageView Planar(unsigned char* data, int width, int height, int channels, size_t rowPitch = 0) {
+		rowPitch = rowPitch != 0 ? rowPitch : width;
+		return ImageView{ data, width, height, channels, rowPitch, rowPitch * height, PLANAR };
+	}
+
+	// Interleaved pixels, e.g. RGB or RGBA frames. A rowPitch of 0 means rows of width * channels bytes.
+	static ImageView Interleaved(unsigned char* data, int width, int height, int channels, size_t rowPitch = 0) {
+		rowPitch = rowPitch != 0 ? rowPitch : (size_t)width * channels;
+		return ImageView{ data, width, height, channels, rowPitch, 1, INTERLEAVED };
+	}
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Least recently used cache from an image's content hash to its final lookup table, and optionally to its output image.
+// Pipelines that see the same image many times (re-uploads, retries, sprites) can skip the histogram, scan and normalise
+// on a hit and go straight to lookup, or with outputs kept skip lookup as well and just copy the stored output.
+// The least recently used entries are dropped to stay under maxBytes, counted by the tables and outputs stored.
+class LutCache {
+public:
+	LutCache(size_t maxBytes, bool keepOutputs) : maxBytes(maxBytes), keepOutputs(keepOutputs) {}
+
+	// Looks up key, on a hit copies the table (and the output, if one was kept and output is not NULL) and returns true.
+	bool Find(uint64_t key, vector<int>& lut, vector<unsigned char>* output) {
+		auto found = index.find(key);
+		if (found == index.end()) {
+			misses++;
+			return false;
+		}
+		hits++;
+		entries.splice(entries.begin(), entries, found->second); // now the most recently used
+		lut = found->second->lut;
+		if (output != NULL) {
+			*output = found->second->output;
+		}
+		return true;
+	}
+
+	// Adds the table, and the output when outputs are kept, for key. An output bigger than the whole cache is left out and
+	// only the table kept. Older entries are dropped until it fits.
+	void Insert(uint64_t key, const vector<int>& lut, const unsigned char* output, size_t outputSize) {
+		if (index.count(key) != 0) {
+			return;
+		}
+		Entry entry;
+		entry.key = key;
+		entry.lut = lut;
+		if (keepOutputs && output != NULL) {
+			entry.output.assign(output, output + outputSize);
+		}
+		size_t size = Size(entry);
+		if (size > maxBytes && !entry.output.empty()) {
+			// An output too big to keep on its own still leaves its table worth keeping, a hit then runs lookup again
+			entry.output = vector<unsigned char>();
+			size = Size(entry);
+		}
+		if (size > maxBytes) {
+			return;
+		}
+		while (bytes + size > maxBytes) {
+			bytes -= Size(entries.back());
+			index.erase(entries.back().key);
+			entries.pop_back();
+			evictions++;
+		}
+		entries.push_front(move(entry));
+		index[key] = entries.begin();
+		bytes += size;
+	}
+
+	bool KeepsOutputs() const { return keepOutputs; }
+
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t evictions = 0;
+	size_t bytes = 0;
+
+private:
+	struct Entry {
+		uint64_t key;
+		vector<int> lut;
+		vector<unsigned char> output;
+	};
+
+	static size_t Size(const Entry& entry) {
+		return sizeof(Entry) + entry.lut.size() * sizeof(int) + entry.output.size();
+	}
+
+	size_t maxBytes;
+	bool keepOutputs;
+	list<Entry> entries; // most recently used first
+	unordered_map<uint64_t, list<Entry>::iterator> index;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+#include "ImageView.h"
+
+using namespace std;
+
+// Binary PGM (P5) and PPM (P6) images with up to 255 levels, kept as the whole file in memory. The pixels are left
+// interleaved where they are in the file and equalised through ImageView, so the buffer a file is read into is also the
+// one uploaded from, downloaded into and written out: decoding and encoding only touch the header.
+struct Pnm {
+	int width = 0;
+	int height = 0;
+	int channels = 0; // 1 for P5, 3 for P6
+	vector<unsigned char> data; // the header and then the pixels
+	size_t offset = 0; // where the pixels start in data
+
+	Pnm() {}
+
+	// A black image with its header already written.
+	Pnm(int width, int height, int channels) : width(width), height(height), channels(channels) {
+		string header = Header();
+		offset = header.size();
+		data.assign(offset + Size(), 0);
+		memcpy(data.data(), header.data(), offset);
+	}
+
+	unsigned char* Pixels() {
+		return data.data() + offset;
+	}
+
+	size_t Size() const {
+		return (size_t)width * height * channels;
+	}
+
+	ImageView View() {
+		return ImageView::Interleaved(Pixels(), width, height, channels);
+	}
+
+	// Takes the file over, the pixels are not copied.
+	static Pnm Decode(vector<unsigned char> file) {
+		size_t at = 2;
+		if (file.size() < 2 || file[0] != 'P' || (file[1] != '5' && file[1] != '6')) {
+			throw runtime_error("not a binary PGM or PPM");
+		}
+		// Reads the next number of the header, skipping white space and # comments
+		auto number = [&]() {
+			while (at < file.size() && (isspace(file[at]) || file[at] == '#')) {
+				if (file[at] == '#') {
+					while (at < file.size() && file[at] != '\n') {
+						at++;
+					}
+				}
+				else {
+					at++;
+				}
+			}
+			int value = 0;
+			bool digits = false;
+			while (at < file.size() && isdigit(file[at])) {
+				value = value * 10 + (file[at++] - '0');
+				digits = true;
+			}
+			if (!digits) {
+				throw runtime_error("bad PNM header");
+			}
+			return value;
+		};
+
+		Pnm image;
+		image.channels = file[1] == '5' ? 1 : 3;
+		image.width = number();
+		image.height = number();
+		int levels = number();
+		at++; // the single white space before the pixels
+		if (levels > 255 || image.width <= 0 || image.height <= 0 || file.size() < at + image.Size()) {
+			throw runtime_error("unsupported or truncated PNM");
+		}
+		file.resize(at + image.Size());
+		image.data = move(file);
+		image.offset = at;
+		return image;
+	}
+
+	// Gives the file away with a 255 level header, which leaves this image empty. The header is rewritten in place,
+	// padded with spaces, unless it has grown longer than the original one.
+	vector<unsigned char> Encode() {
+		string header = Header();
+		if (header.size() <= offset) {
+			// The padding goes before the level count, between two numbers where any white space is allowed
+			header.insert(header.size() - 4, offset - header.size(), ' ');
+			memcpy(data.data(), header.data(), offset);
+		}
+		else {
+			vector<unsigned char> file(header.begin(), header.end());
+			file.insert(file.end(), data.begin() + offset, data.end());
+			data.swap(file);
+			offset = header.size();
+		}
+		return move(data);
+	}
+
+private:
+	string Header() const {
+		return string(channels == 1 ? "P5" : "P6") + "\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+	}
+};
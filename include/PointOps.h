@@ -0,0 +1,172 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+// A chain of 8-bit point operations: gamma, levels, contrast stretch, threshold, invert and user tables.
+// Every op maps the 256 intensities to 256 intensities, so the whole chain collapses into one 256 entry table.
+// That table is composed into the equalisation lookup table before lookup runs, so any number of ops costs
+// the same single read and write of the image as plain equalisation.
+class PointOpChain {
+public:
+	PointOpChain() : table(256) {
+		for (int v = 0; v < 256; v++) {
+			table[v] = v;
+		}
+	}
+
+	// out = 255 * (in / 255) ^ (1 / gamma), so a gamma above 1 brightens the midtones and below 1 darkens them.
+	PointOpChain& Gamma(double gamma) {
+		if (gamma <= 0) {
+			throw runtime_error("gamma must be above 0");
+		}
+		return Then([gamma](int v) { return (int)lround(255 * pow(v / 255.0, 1 / gamma)); });
+	}
+
+	// Maps inLow..inHigh linearly onto outLow..outHigh (rounded to nearest), anything outside the input range is clamped.
+	PointOpChain& Levels(int inLow, int inHigh, int outLow = 0, int outHigh = 255) {
+		if (inLow >= inHigh) {
+			throw runtime_error("levels needs the low input level below the high one");
+		}
+		return Then([=](int v) {
+			int range = inHigh - inLow;
+			int clamped = min(max(v, inLow), inHigh) - inLow;
+			return outLow + ((clamped * (outHigh - outLow)) + (outHigh >= outLow ? range / 2 : -range / 2)) / range;
+		});
+	}
+
+	// Contrast stretch, low and high are spread to the full 0..255 range.
+	PointOpChain& Stretch(int low, int high) {
+		return Levels(low, high, 0, 255);
+	}
+
+	// Everything from level up becomes 255, everything below becomes 0.
+	PointOpChain& Threshold(int level) {
+		return Then([level](int v) { return v >= level ? 255 : 0; });
+	}
+
+	PointOpChain& Invert() {
+		return Then([](int v) { return 255 - v; });
+	}
+
+	// A user table of 256 output values, one per input intensity.
+	PointOpChain& Table(const vector<int>& user) {
+		if (user.size() != 256) {
+			throw runtime_error("a user table needs 256 values");
+		}
+		return Then([&user](int v) { return user[v]; });
+	}
+
+	// The composed table, entry v is what the chain turns intensity v into.
+	const vector<int>& Get() const {
+		return table;
+	}
+
+	bool IsIdentity() const {
+		for (int v = 0; v < 256; v++) {
+			if (table[v] != v) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Builds a chain from a comma separated list applied in order, e.g. "gamma=1.2,levels=16:240,invert".
+	// Ops: gamma=g, levels=inLow:inHigh[:outLow:outHigh], stretch=low:high, threshold=level, invert, table=file
+	// (a text file with 256 values).
+	static PointOpChain Parse(const string& spec) {
+		PointOpChain chain;
+		stringstream ops(spec);
+
+		for (string op; getline(ops, op, ',');) {
+			size_t equals = op.find('=');
+			string name = op.substr(0, equals);
+			vector<string> args;
+			if (equals != string::npos) {
+				stringstream values(op.substr(equals + 1));
+				for (string value; getline(values, value, ':');) {
+					args.push_back(value);
+				}
+			}
+			// The whole argument has to be the number, gamma=1.2x or threshold=12abc is refused
+			auto number = [&](const string& arg) {
+				size_t used = 0;
+				double value = 0;
+				try {
+					value = stod(arg, &used);
+				}
+				catch (const exception&) {
+					used = 0;
+				}
+				if (used == 0 || used != arg.size() || !isfinite(value)) {
+					throw runtime_error("bad point op: " + op);
+				}
+				return value;
+			};
+			auto integer = [&](const string& arg) {
+				size_t used = 0;
+				int value = 0;
+				try {
+					value = stoi(arg, &used);
+				}
+				catch (const exception&) {
+					used = 0;
+				}
+				if (used == 0 || used != arg.size()) {
+					throw runtime_error("bad point op: " + op);
+				}
+				return value;
+			};
+
+			if (name == "gamma" && args.size() == 1) {
+				chain.Gamma(number(args[0]));
+			}
+			else if (name == "levels" && (args.size() == 2 || args.size() == 4)) {
+				chain.Levels(integer(args[0]), integer(args[1]), args.size() == 4 ? integer(args[2]) : 0, args.size() == 4 ? integer(args[3]) : 255);
+			}
+			else if (name == "stretch" && args.size() == 2) {
+				chain.Stretch(integer(args[0]), integer(args[1]));
+			}
+			else if (name == "threshold" && args.size() == 1) {
+				chain.Threshold(integer(args[0]));
+			}
+			else if (name == "invert" && args.empty()) {
+				chain.Invert();
+			}
+			else if (name == "table" && args.size() == 1) {
+				ifstream file(args[0]);
+				vector<int> user(256);
+				for (int v = 0; v < 256; v++) {
+					file >> user[v];
+				}
+				if (!file) {
+					throw runtime_error("could not read 256 values from " + args[0]);
+				}
+				chain.Table(user);
+			}
+			else {
+				throw runtime_error("unknown point op: " + op);
+			}
+		}
+		return chain;
+	}
+
+private:
+	// Composes op after the ops already in the chain, the result is clamped to 0..255.
+	PointOpChain& Then(const function<int(int)>& op) {
+		for (int v = 0; v < 256; v++) {
+			table[v] = min(max(op(table[v]), 0), 255);
+		}
+		return *this;
+	}
+
+	vector<int> table;
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+// Plain host versions of what the kernels work out, one pixel or bin at a time. They are written to be obviously right
+// rather than fast, and do not share code or tricks with the kernels (a linear search where a kernel does a binary one),
+// so the correctness harness can hold every kernel and backend to them.
+// Bins are given by edges, the first intensity of every bin, with one more entry of 256 after the last bin.
+struct Reference {
+	// The edges of bins equal bins over 0..255, the layout of every binsizeBuffer: bin j starts at j * (256 / bins).
+	static vector<int> Edges(int bins) {
+		vector<int> edges(bins + 1);
+		for (int j = 0; j < bins; j++) {
+			edges[j] = j * (256 / bins);
+		}
+		edges[bins] = 256;
+		return edges;
+	}
+
+	// The bin value falls in, the last one whose first intensity it has reached.
+	static int BinOf(int value, const vector<int>& edges) {
+		int bin = 0;
+		for (int j = 0; j + 1 < (int)edges.size(); j++) {
+			if (value >= edges[j]) {
+				bin = j;
+			}
+		}
+		return bin;
+	}
+
+	static vector<int> Histogram(const vector<unsigned char>& values, const vector<int>& edges) {
+		vector<int> counts(edges.size() - 1, 0);
+		for (unsigned char value : values) {
+			counts[BinOf(value, edges)]++;
+		}
+		return counts;
+	}
+
+	static vector<int> InclusiveScan(const vector<int>& counts) {
+		vector<int> sums(counts.size());
+		int sum = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			sum += counts[i];
+			sums[i] = sum;
+		}
+		return sums;
+	}
+
+	static vector<int> ExclusiveScan(const vector<int>& counts) {
+		vector<int> sums(counts.size());
+		int sum = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			sums[i] = sum;
+			sum += counts[i];
+		}
+		return sums;
+	}
+
+	// The equalisation table, every cumulative count scaled so the total becomes 255, rounded down.
+	static vector<int> Normalise(const vector<int>& cumulative) {
+		vector<int> table(cumulative.size());
+		long long total = cumulative.back();
+		for (size_t i = 0; i < cumulative.size(); i++) {
+			table[i] = (int)(cumulative[i] * 255LL / total);
+		}
+		return table;
+	}
+
+	// Caps every bin at limit and deals the pixels cut off out again, the same share to every bin and one more to the
+	// first (excess % bins) bins, so nothing is lost.
+	static vector<int> Clip(const vector<int>& counts, int limit) {
+		int bins = (int)counts.size(), excess = 0;
+		for (int count : counts) {
+			excess += max(count - limit, 0);
+		}
+		vector<int> clipped(bins);
+		for (int i = 0; i < bins; i++) {
+			clipped[i] = min(counts[i], limit) + excess / bins + (i < excess % bins ? 1 : 0);
+		}
+		return clipped;
+	}
+
+	// Histogram matching, every bin goes to the lowest level where the reference (a 256 level cumulative histogram) has
+	// reached the same fraction of its pixels, or 255 if it never does.
+	static vector<int> Match(const vector<int>& cumulative, const vector<int>& reference) {
+		vector<int> table(cumulative.size(), 255);
+		long long total = cumulative.back(), referenceTotal = reference[255];
+		for (size_t i = 0; i < cumulative.size(); i++) {
+			for (int level = 0; level < 256; level++) {
+				if (reference[level] * total >= cumulative[i] * referenceTotal) {
+					table[i] = level;
+					break;
+				}
+			}
+		}
+		return table;
+	}
+
+	// The first intensity of the bin where the cumulative histogram first reaches low / 10000 of the pixels, and the last
+	// intensity of the bin where it first reaches high / 10000. An unreached percentile leaves the value in levels alone.
+	static void Percentiles(const vector<int>& cumulative, const vector<int>& edges, int low, int high, int levels[2]) {
+		long long total = cumulative.back();
+		int bins = (int)cumulative.size();
+		for (int i = bins - 1; i >= 0; i--) {
+			if (cumulative[i] * 10000LL >= low * total) {
+				levels[0] = edges[i];
+			}
+		}
+		for (int i = bins - 1; i >= 0; i--) {
+			if (cumulative[i] * 10000LL >= high * total) {
+				levels[1] = edges[i + 1] - 1;
+			}
+		}
+	}
+
+	// A contrast stretch of levels[0]..levels[1] over 0..255, rounded to nearest, for the first intensity of every bin.
+	static vector<int> Stretch(const int levels[2], const vector<int>& edges) {
+		int bins = (int)edges.size() - 1, low = levels[0], high = levels[1];
+		vector<int> table(bins);
+		for (int i = 0; i < bins; i++) {
+			int value = edges[i];
+			if (high <= low) {
+				table[i] = value;
+			}
+			else {
+				value = min(max(value, low), high);
+				table[i] = (int)(((value - low) * 255.0) / (high - low) + 0.5);
+			}
+		}
+		return table;
+	}
+
+	// The grey level of a colour pixel with the Q16 weights of rgb2grey_fixed.
+	static unsigned char Grey(int r, int g, int b) {
+		return (unsigned char)((r * 13933u + g * 46875u + b * 4732u) >> 16);
+	}
+
+	// The grey level of rgb2grey, in double and truncated.
+	static unsigned char GreyDouble(int r, int g, int b) {
+		return (unsigned char)(int)(r * 0.2126 + g * 0.71526 + b * 0.0722);
+	}
+
+	// Every byte through the table of its bin.
+	static vector<unsigned char> Lookup(const vector<unsigned char>& values, const vector<int>& table, const vector<int>& edges) {
+		vector<unsigned char> result(values.size());
+		for (size_t i = 0; i < values.size(); i++) {
+			result[i] = (unsigned char)table[BinOf(values[i], edges)];
+		}
+		return result;
+	}
+
+	// The content hash of hash_blocks: every 16 bytes mixed with their index and every byte left over with its position,
+	// all added up.
+	static uint64_t Hash(const vector<unsigned char>& bytes) {
+		auto mix = [](uint64_t x) {
+			x ^= x >> 33;
+			x *= 0xff51afd7ed558ccdULL;
+			x ^= x >> 33;
+			x *= 0xc4ceb9fe1a85ec53ULL;
+			x ^= x >> 33;
+			return x;
+		};
+		auto word = [&](size_t at) {
+			uint64_t value = 0;
+			for (int b = 7; b >= 0; b--) {
+				value = value << 8 | bytes[at + b]; // little endian, like as_ulong on the device
+			}
+			return value;
+		};
+		uint64_t hash = 0;
+		size_t chunks = bytes.size() / 16;
+		for (size_t c = 0; c < chunks; c++) {
+			hash += mix(word(16 * c) ^ mix(word(16 * c + 8) ^ c));
+		}
+		for (size_t i = chunks * 16; i < bytes.size(); i++) {
+			hash += mix((uint64_t)i << 8 | bytes[i]);
+		}
+		return hash;
+	}
+
+	// Sliding window adaptive equalisation of one plane by counting every window from scratch.
+	static vector<unsigned char> AdaptiveEqualise(const unsigned char* plane, int width, int height, int radius) {
+		vector<unsigned char> result((size_t)width * height);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				long long below = 0, count = 0;
+				for (int wy = max(y - radius, 0); wy <= min(y + radius, height - 1); wy++) {
+					for (int wx = max(x - radius, 0); wx <= min(x + radius, width - 1); wx++) {
+						below += plane[(size_t)wy * width + wx] <= plane[(size_t)y * width + x];
+						count++;
+					}
+				}
+				result[(size_t)y * width + x] = (unsigned char)(below * 255 / count);
+			}
+		}
+		return result;
+	}
+};
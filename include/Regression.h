@@ -0,0 +1,349 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "Benchmark.h"
+
+using namespace std;
+
+// Just enough JSON to read back what WriteJson writes: objects, arrays, strings, numbers, true, false and null.
+struct JsonValue {
+	enum Type { Null, Bool, Number, String, Array, Object } type = Null;
+	double number = 0;
+	string text;
+	vector<JsonValue> items;
+	map<string, JsonValue> members;
+
+	bool Has(const string& key) const {
+		return type == Object && members.count(key) > 0;
+	}
+
+	const JsonValue& operator[](const string& key) const {
+		auto member = members.find(key);
+		if (type != Object || member == members.end()) {
+			throw runtime_error("JSON has no \"" + key + "\"");
+		}
+		return member->second;
+	}
+
+	static JsonValue Parse(const string& json) {
+		size_t at = 0;
+		JsonValue value = ParseValue(json, at);
+		SkipSpace(json, at);
+		if (at != json.size()) {
+			throw runtime_error("trailing characters in JSON");
+		}
+		return value;
+	}
+
+	static JsonValue Load(const string& filename) {
+		ifstream file(filename, ios::binary);
+		if (!file) {
+			throw runtime_error("cannot open " + filename);
+		}
+		stringstream contents;
+		contents << file.rdbuf();
+		return Parse(contents.str());
+	}
+
+private:
+	static void SkipSpace(const string& json, size_t& at) {
+		while (at < json.size() && isspace((unsigned char)json[at])) {
+			at++;
+		}
+	}
+
+	static void Expect(const string& json, size_t& at, char c) {
+		SkipSpace(json, at);
+		if (at >= json.size() || json[at] != c) {
+			throw runtime_error(string("bad JSON, expected '") + c + "' at " + to_string(at));
+		}
+		at++;
+	}
+
+	static string ParseString(const string& json, size_t& at) {
+		Expect(json, at, '"');
+		string text;
+		while (at < json.size() && json[at] != '"') {
+			if (json[at] == '\\' && at + 1 < json.size()) {
+				char escaped = json[++at];
+				text += escaped == 'n' ? '\n' : escaped == 't' ? '\t' : escaped; // \uXXXX is not needed for what is read here
+			}
+			else {
+				text += json[at];
+			}
+			at++;
+		}
+		Expect(json, at, '"');
+		return text;
+	}
+
+	static JsonValue ParseValue(const string& json, size_t& at) {
+		SkipSpace(json, at);
+		if (at >= json.size()) {
+			throw runtime_error("unexpected end of JSON");
+		}
+		JsonValue value;
+		char c = json[at];
+		if (c == '{') {
+			value.type = Object;
+			at++;
+			SkipSpace(json, at);
+			if (at < json.size() && json[at] == '}') {
+				at++;
+				return value;
+			}
+			do {
+				string key = ParseString(json, at);
+				Expect(json, at, ':');
+				value.members[key] = ParseValue(json, at);
+				SkipSpace(json, at);
+			} while (at < json.size() && json[at] == ',' && ++at);
+			Expect(json, at, '}');
+		}
+		else if (c == '[') {
+			value.type = Array;
+			at++;
+			SkipSpace(json, at);
+			if (at < json.size() && json[at] == ']') {
+				at++;
+				return value;
+			}
+			do {
+				value.items.push_back(ParseValue(json, at));
+				SkipSpace(json, at);
+			} while (at < json.size() && json[at] == ',' && ++at);
+			Expect(json, at, ']');
+		}
+		else if (c == '"') {
+			value.type = String;
+			value.text = ParseString(json, at);
+		}
+		else if (json.compare(at, 4, "true") == 0 || json.compare(at, 5, "false") == 0) {
+			value.type = Bool;
+			value.number = c == 't';
+			at += c == 't' ? 4 : 5;
+		}
+		else if (json.compare(at, 4, "null") == 0) {
+			at += 4;
+		}
+		else {
+			char* end;
+			value.type = Number;
+			value.number = strtod(json.c_str() + at, &end);
+			if (end == json.c_str() + at) {
+				throw runtime_error("bad JSON value at " + to_string(at));
+			}
+			at = end - json.c_str();
+		}
+		return value;
+	}
+};
+
+// The results of a WriteJson file. The samples in it are the ones kept after outlier rejection, so they are not filtered again.
+// device, when given, receives "<platform>, <device>" of the run, or "" if the file does not say.
+inline vector<BenchmarkResult> ReadResults(const string& filename, string* device = NULL) {
+	JsonValue json = JsonValue::Load(filename);
+	if (device != NULL) {
+		*device = json.Has("platform") && json.Has("device") ? json["platform"].text + ", " + json["device"].text : "";
+	}
+	vector<BenchmarkResult> results;
+	for (const JsonValue& item : json["results"].items) {
+		BenchmarkResult result;
+		result.kernel = item["kernel"].text;
+		result.width = (int)item["width"].number;
+		result.height = (int)item["height"].number;
+		result.bins = (int)item["bins"].number;
+		result.distribution = item.Has("distribution") ? item["distribution"].text : "noise"; // what runs before -dist used
+		for (const JsonValue& sample : item["samples_ns"].items) {
+			result.ns.kept.push_back(sample.number);
+		}
+		sort(result.ns.kept.begin(), result.ns.kept.end());
+		result.ns.min = item["min_ns"].number;
+		result.ns.median = item["median_ns"].number;
+		result.ns.p95 = item["p95_ns"].number;
+		result.ns.mean = item["mean_ns"].number;
+		result.ns.stddev = item["stddev_ns"].number;
+		result.ns.rejected = (int)item["rejected"].number;
+		results.push_back(result);
+	}
+	return results;
+}
+
+// One-sided Mann-Whitney U test of whether the current samples tend to be larger (slower) than the baseline ones.
+// Gives the p-value from the normal approximation with the tie correction, good enough from about 8 samples each.
+// Unlike a t-test it only looks at the order of the samples, so the long right tail of kernel timings does not upset it.
+inline double MannWhitneyP(const vector<double>& baseline, const vector<double>& current) {
+	size_t n1 = current.size(), n2 = baseline.size(), n = n1 + n2;
+	if (n1 == 0 || n2 == 0) {
+		return 1;
+	}
+	vector<pair<double, int>> all; // value and 1 for the current run
+	for (double sample : current) {
+		all.push_back({ sample, 1 });
+	}
+	for (double sample : baseline) {
+		all.push_back({ sample, 0 });
+	}
+	sort(all.begin(), all.end());
+
+	// Rank sum of the current samples, ties sharing the average of their ranks
+	double rankSum = 0, ties = 0;
+	for (size_t i = 0; i < n;) {
+		size_t j = i;
+		while (j < n && all[j].first == all[i].first) {
+			j++;
+		}
+		double rank = (i + 1 + j) / 2.0, t = (double)(j - i);
+		for (size_t k = i; k < j; k++) {
+			rankSum += all[k].second ? rank : 0;
+		}
+		ties += t * t * t - t;
+		i = j;
+	}
+	double u = rankSum - n1 * (n1 + 1) / 2.0;
+	double mean = n1 * n2 / 2.0;
+	double variance = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1.0)));
+	if (variance <= 0) {
+		return 1;
+	}
+	double z = (u - mean - 0.5) / sqrt(variance); // with the continuity correction
+	return 0.5 * erfc(z / sqrt(2.0));
+}
+
+// How a kernel at one size moved from the baseline to the current run.
+struct Comparison {
+	string kernel;
+	int width = 0;
+	int height = 0;
+	int bins = 0;
+	double baselineNs = 0; // medians
+	double currentNs = 0;
+	double bandNs = 0; // how far above the baseline median still counts as noise
+	double p = 1;
+	string verdict; // "ok", "faster", "REGRESSION", "new", "MISSING" or, when allowed, "missing"
+};
+
+// Regression limits. A kernel has regressed when its median is above the baseline median by more than the noise band,
+// the larger of mads combined MADs of the two runs and threshold of the baseline median, and, when both runs kept enough
+// samples for it to mean something, the Mann-Whitney test agrees at level alpha. The band alone stops a shift well inside
+// the run to run noise from failing, the test alone would fail on a real but tiny shift with many samples.
+struct RegressionLimits {
+	double threshold = 0.05;
+	double mads = 3;
+	double alpha = 0.01;
+	int minSamples = 8; // each, for the test
+	bool allowMissing = false; // a baseline kernel the current run does not have is only listed instead of failing
+};
+
+// Matches the results on kernel, size, bins and input distribution and compares each pair. A kernel only in the current run
+// is listed as new. A kernel only in the baseline fails as MISSING, since a kernel that stopped running or a run at another
+// size would otherwise pass without comparing anything, unless limits.allowMissing is set.
+inline vector<Comparison> Compare(const vector<BenchmarkResult>& baseline, const vector<BenchmarkResult>& current, const RegressionLimits& limits = RegressionLimits()) {
+	auto key = [](const BenchmarkResult& result) {
+		return result.kernel + " " + to_string(result.width) + "x" + to_string(result.height) + " " + to_string(result.bins) + " " + result.distribution;
+	};
+	map<string, const BenchmarkResult*> base;
+	for (const BenchmarkResult& result : baseline) {
+		base[key(result)] = &result;
+	}
+
+	vector<Comparison> comparisons;
+	auto row = [](const BenchmarkResult& result) {
+		Comparison comparison;
+		comparison.kernel = result.kernel;
+		comparison.width = result.width;
+		comparison.height = result.height;
+		comparison.bins = result.bins;
+		return comparison;
+	};
+	for (const BenchmarkResult& result : current) {
+		Comparison comparison = row(result);
+		comparison.currentNs = result.ns.median;
+		auto found = base.find(key(result));
+		if (found == base.end()) {
+			comparison.verdict = "new";
+			comparisons.push_back(comparison);
+			continue;
+		}
+		const BenchmarkResult& before = *found->second;
+		base.erase(found);
+		comparison.baselineNs = before.ns.median;
+		double mad = sqrt(pow(Mad(before.ns.kept, before.ns.median), 2) + pow(Mad(result.ns.kept, result.ns.median), 2));
+		comparison.bandNs = max(limits.mads * mad, limits.threshold * before.ns.median);
+		bool tested = (int)before.ns.kept.size() >= limits.minSamples && (int)result.ns.kept.size() >= limits.minSamples;
+		if (tested) {
+			comparison.p = MannWhitneyP(before.ns.kept, result.ns.kept);
+		}
+		double shift = result.ns.median - before.ns.median;
+		if (shift > comparison.bandNs && (!tested || comparison.p < limits.alpha)) {
+			comparison.verdict = "REGRESSION";
+		}
+		else if (-shift > comparison.bandNs) {
+			comparison.verdict = "faster";
+		}
+		else {
+			comparison.verdict = "ok";
+		}
+		comparisons.push_back(comparison);
+	}
+	for (const BenchmarkResult& result : baseline) {
+		if (base.count(key(result))) {
+			Comparison comparison = row(result);
+			comparison.baselineNs = result.ns.median;
+			comparison.verdict = limits.allowMissing ? "missing" : "MISSING";
+			comparisons.push_back(comparison);
+		}
+	}
+	return comparisons;
+}
+
+// A comparison that fails the gate, a regression or a kernel missing from the current run
+inline bool Fails(const Comparison& comparison) {
+	return comparison.verdict == "REGRESSION" || comparison.verdict == "MISSING";
+}
+
+inline int Regressions(const vector<Comparison>& comparisons) {
+	return (int)count_if(comparisons.begin(), comparisons.end(), Fails);
+}
+
+// The comparisons as a table, failures first so they are not lost in a long run.
+inline void PrintComparisons(ostream& out, vector<Comparison> comparisons) {
+	stable_sort(comparisons.begin(), comparisons.end(), [](const Comparison& a, const Comparison& b) {
+		return Fails(a) > Fails(b);
+	});
+	out << left << setw(26) << "kernel" << setw(12) << "size" << right << setw(6) << "bins" << setw(14) << "baseline us" << setw(14) << "current us"
+		<< setw(10) << "change" << setw(12) << "band us" << setw(10) << "p" << "  " << "verdict" << std::endl;
+	for (const Comparison& comparison : comparisons) {
+		out << left << setw(26) << comparison.kernel << setw(12) << (to_string(comparison.width) + "x" + to_string(comparison.height))
+			<< right << setw(6) << comparison.bins << fixed << setprecision(2);
+		if (comparison.baselineNs > 0 && comparison.currentNs > 0) {
+			out << setw(14) << comparison.baselineNs / 1000 << setw(14) << comparison.currentNs / 1000
+				<< setw(9) << showpos << 100 * (comparison.currentNs / comparison.baselineNs - 1) << noshowpos << "%"
+				<< setw(12) << comparison.bandNs / 1000 << setw(10) << setprecision(4) << comparison.p;
+		}
+		else {
+			// Only one of the runs has the kernel
+			for (double ns : { comparison.baselineNs, comparison.currentNs }) {
+				if (ns > 0) {
+					out << setw(14) << ns / 1000;
+				}
+				else {
+					out << setw(14) << "-";
+				}
+			}
+			out << setw(10) << "-" << setw(12) << "-" << setw(10) << "-";
+		}
+		out << "  " << comparison.verdict << std::endl;
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include "Utils.h"
+
+using namespace std;
+
+// Measured limits of a device, what each kernel is compared against to see how far it is from the hardware.
+// Calibrate() runs the probe_ kernels of my_kernels.cl: a 16 byte per work-item copy, read and write over a large buffer for
+// device memory bandwidth, and contention-free local atomic_inc for the atomic rate. The best of a few runs is kept, the roof
+// is what the device can reach, not what it usually does.
+// A kernel's roofline time is the longer of its bytes over the matching bandwidth and its local atomics over the atomic rate.
+// Its efficiency is that time over its measured time, so 100% means it runs at the roof and a low percentage is worth optimising.
+class Roofline {
+public:
+	double copyBandwidth = 0; // bytes per second, read and written together
+	double readBandwidth = 0;
+	double writeBandwidth = 0;
+	double localAtomics = 0; // per second
+
+	// size is the bytes each bandwidth probe moves, capped by what the device can allocate.
+	void Calibrate(const cl::Context& context, const cl::Program& program, size_t size = 256 * 1024 * 1024, int repetitions = 10) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+		size = min(size, (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) / 16 * 16;
+		size_t vectors = size / 16;
+
+		cl::Buffer source(context, CL_MEM_READ_WRITE, size);
+		cl::Buffer destination(context, CL_MEM_READ_WRITE, size);
+		// All zero, so the xor probe_read works out is never the key
+		queue.enqueueFillBuffer(source, 0, 0, size);
+
+		cl::Kernel copy(program, "probe_copy");
+		copy.setArg(0, source);
+		copy.setArg(1, destination);
+		copyBandwidth = 2.0 * size / Best(queue, copy, cl::NDRange(vectors), cl::NullRange, repetitions);
+
+		cl::Kernel read(program, "probe_read");
+		read.setArg(0, source);
+		read.setArg(1, destination);
+		read.setArg(2, 0xFFFFFFFFu);
+		readBandwidth = size / Best(queue, read, cl::NDRange(vectors), cl::NullRange, repetitions);
+
+		cl::Kernel write(program, "probe_write");
+		write.setArg(0, destination);
+		write.setArg(1, 0u);
+		writeBandwidth = size / Best(queue, write, cl::NDRange(vectors), cl::NullRange, repetitions);
+
+		// A few work-groups of 256 per compute unit, each work-item doing enough atomics to hide the launch
+		int iterations = 1024;
+		size_t groups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 8;
+		size_t local = min((size_t)256, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+		cl::Buffer histogram(context, CL_MEM_READ_WRITE, 256 * sizeof(int));
+		cl::Kernel atomics(program, "probe_local_atomics");
+		atomics.setArg(0, histogram);
+		atomics.setArg(1, cl::Local(256 * sizeof(int)));
+		atomics.setArg(2, iterations);
+		atomics.setArg(3, 256);
+		localAtomics = (double)groups * local * iterations / Best(queue, atomics, cl::NDRange(groups * local), cl::NDRange(local), repetitions);
+	}
+
+	bool Calibrated() const {
+		return copyBandwidth > 0;
+	}
+
+	// The shortest time a launch could take in ns, moving bytes of global memory (written of them writes) and doing atomics
+	// local atomics. Only reading or only writing is held to that bandwidth, anything else to the copy bandwidth.
+	double BoundNs(double bytes, double written, double atomics) const {
+		return max(bytes / Bandwidth(bytes, written), atomics / localAtomics) * 1e9;
+	}
+
+	// How close a launch that took ns came to its roof, in percent.
+	double Percent(double bytes, double written, double atomics, double ns) const {
+		return ns > 0 ? 100 * BoundNs(bytes, written, atomics) / ns : 0;
+	}
+
+	// Which roof limits the launch
+	const char* Limit(double bytes, double written, double atomics) const {
+		return atomics / localAtomics > bytes / Bandwidth(bytes, written) ? "atomics" : "bandwidth";
+	}
+
+	// Percent and Limit of the command behind a profiled event, for the stage timings, e.g. " (42.0% of the bandwidth roofline)".
+	string Report(double bytes, double written, double atomics, const cl::Event& event) const {
+		if (!Calibrated()) {
+			return "";
+		}
+		double ns = (double)(event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+		stringstream report;
+		report << fixed << setprecision(1) << " (" << Percent(bytes, written, atomics, ns) << "% of the " << Limit(bytes, written, atomics) << " roofline)";
+		return report.str();
+	}
+
+private:
+	double Bandwidth(double bytes, double written) const {
+		return written <= 0 ? readBandwidth : written >= bytes ? writeBandwidth : copyBandwidth;
+	}
+
+	// The shortest of repetitions timed launches in seconds, after one untimed launch.
+	static double Best(cl::CommandQueue& queue, cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local, int repetitions) {
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+		queue.finish();
+		double best = 0;
+		for (int r = 0; r < repetitions; r++) {
+			cl::Event event;
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, &event);
+			event.wait();
+			double seconds = (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+			if (r == 0 || seconds < best) {
+				best = seconds;
+			}
+		}
+		return best;
+	}
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+
+// Sliding window adaptive histogram equalisation: every pixel is equalised with the histogram of the (2r+1) x (2r+1)
+// window centred on it (clipped at the image edges), out = 255 * (pixels in the window <= value) / (pixels in the window).
+// Counting each window from scratch costs O(r^2) per pixel. This uses Perreault and Hebert's incremental histograms instead:
+// every column keeps a histogram of its 2r+1 pixels, which moves down a row by removing one pixel and adding one, and the
+// window histogram moves right a pixel by adding one column histogram and removing another. Both steps are a fixed 256 + 16
+// operations, so the cost per pixel does not depend on the radius. The histograms are kept in 16 coarse bins as well as the
+// 256 fine ones so the count up to a value needs at most 16 + 16 additions instead of 256.
+// The image is split into bands of rows, one per CPU thread, each band with its own column histograms.
+// Each channel of a colour image is equalised on its own.
+class SlidingAHE {
+public:
+	SlidingAHE(int radius) : radius(radius) {}
+
+	// in and out hold width x height pixels per channel, one channel after another like CImg.
+	void Apply(const unsigned char* in, unsigned char* out, int width, int height, int channels) const {
+		int threads = max(1, (int)thread::hardware_concurrency());
+		int bands = min(threads, height);
+		vector<thread> workers;
+
+		for (int c = 0; c < channels; c++) {
+			const unsigned char* plane = in + (size_t)c * width * height;
+			unsigned char* result = out + (size_t)c * width * height;
+			for (int b = 0; b < bands; b++) {
+				int y0 = (int)((long long)height * b / bands);
+				int y1 = (int)((long long)height * (b + 1) / bands);
+				workers.emplace_back([this, plane, result, width, height, y0, y1]() { Band(plane, result, width, height, y0, y1); });
+			}
+			for (thread& worker : workers) {
+				worker.join();
+			}
+			workers.clear();
+		}
+	}
+
+private:
+	static const int BINS = 256;
+	static const int COARSE = 16; // fine bins per coarse bin
+
+	// Equalises rows y0 to y1 - 1.
+	void Band(const unsigned char* plane, unsigned char* result, int width, int height, int y0, int y1) const {
+		// Column histograms, fine and coarse, for every column of the image
+		vector<int> column(width * BINS, 0);
+		vector<int> columnCoarse(width * COARSE, 0);
+		vector<int> window(BINS);
+		vector<int> windowCoarse(COARSE);
+
+		auto addRow = [&](int y, int sign) {
+			const unsigned char* row = plane + (size_t)y * width;
+			for (int x = 0; x < width; x++) {
+				column[x * BINS + row[x]] += sign;
+				columnCoarse[x * COARSE + row[x] / COARSE] += sign;
+			}
+		};
+		auto addColumn = [&](int x, int sign) {
+			for (int v = 0; v < BINS; v++) {
+				window[v] += sign * column[x * BINS + v];
+			}
+			for (int v = 0; v < COARSE; v++) {
+				windowCoarse[v] += sign * columnCoarse[x * COARSE + v];
+			}
+		};
+
+		// The column histograms start with the rows around y0
+		for (int y = max(0, y0 - radius); y <= min(height - 1, y0 + radius); y++) {
+			addRow(y, 1);
+		}
+
+		for (int y = y0; y < y1; y++) {
+			// Move the column histograms down a row, the first row already has them
+			if (y > y0) {
+				if (y - radius - 1 >= 0) {
+					addRow(y - radius - 1, -1);
+				}
+				if (y + radius < height) {
+					addRow(y + radius, 1);
+				}
+			}
+			int rows = min(height - 1, y + radius) - max(0, y - radius) + 1;
+
+			// The window histogram starts with the columns around x = 0 and slides right
+			fill(window.begin(), window.end(), 0);
+			fill(windowCoarse.begin(), windowCoarse.end(), 0);
+			for (int x = 0; x <= min(width - 1, radius); x++) {
+				addColumn(x, 1);
+			}
+
+			for (int x = 0; x < width; x++) {
+				int columns = min(width - 1, x + radius) - max(0, x - radius) + 1;
+				int value = plane[(size_t)y * width + x];
+
+				// Pixels in the window up to and including value, whole coarse bins first
+				int below = 0;
+				for (int v = 0; v < value / COARSE; v++) {
+					below += windowCoarse[v];
+				}
+				for (int v = (value / COARSE) * COARSE; v <= value; v++) {
+					below += window[v];
+				}
+				result[(size_t)y * width + x] = (unsigned char)((long long)below * 255 / ((long long)rows * columns));
+
+				if (x + radius + 1 < width) {
+					addColumn(x + radius + 1, 1);
+				}
+				if (x - radius >= 0) {
+					addColumn(x - radius, -1);
+				}
+			}
+		}
+	}
+
+	int radius;
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+#include "Pnm.h"
+
+using namespace std;
+
+// Synthetic test images with a chosen histogram, for load and stress tests at sizes and distributions the shipped images
+// do not have. A distribution is given as name[:a[:b]]:
+//   uniform         each aligned run of 256 bytes holds every level once, so the image is exactly flat when its size
+//                   in bytes is a multiple of 256, otherwise the last partial run of r bytes puts r levels one ahead
+//   gaussian:m:s    normal around level m (128) with standard deviation s (32), clamped to 0..255
+//   single:v        every pixel v (128), the worst case for the histogram atomics
+//   twospike:a:b    half the pixels a (32) and half b (224), at random
+//   gradient        a left to right ramp from 0 to 255, the same on every row
+//   noise           independent random levels, flat only on average
+// The random ones draw 16 bits per byte from a counter-based generator (splitmix64 of the seed and the byte's index) and
+// look them up in a 65536 entry inverse CDF table. Every byte only depends on its index, so any part of an image can be
+// made on its own, in any order and on any number of threads, and always comes out the same for the same seed.
+class SyntheticImage {
+public:
+	enum Distribution { Uniform, Gaussian, Single, TwoSpike, Gradient, Noise };
+
+	Distribution distribution = Noise;
+	int width = 0;
+	int height = 0;
+	int channels = 1; // interleaved, as in a PPM
+	uint64_t seed = 0;
+
+	SyntheticImage(const string& spec, int width, int height, int channels = 1, uint64_t seed = 0)
+		: width(width), height(height), channels(channels), seed(seed), table(65536) {
+		if (width <= 0 || height <= 0 || (channels != 1 && channels != 3)) {
+			throw runtime_error("bad synthetic image size");
+		}
+		stringstream parts(spec);
+		string name;
+		getline(parts, name, ':');
+		vector<double> arguments;
+		for (string argument; getline(parts, argument, ':');) {
+			arguments.push_back(atof(argument.c_str()));
+		}
+		auto argument = [&](size_t i, double otherwise) { return i < arguments.size() ? arguments[i] : otherwise; };
+
+		if (name == "uniform") {
+			distribution = Uniform;
+		}
+		else if (name == "gradient") {
+			distribution = Gradient;
+			ramp.resize((size_t)width * channels);
+			for (size_t i = 0; i < ramp.size(); i++) {
+				ramp[i] = (unsigned char)(i / channels * 256 / width);
+			}
+		}
+		else if (name == "noise") {
+			distribution = Noise;
+			Table(vector<double>(256, 1));
+		}
+		else if (name == "gaussian") {
+			distribution = Gaussian;
+			double mean = argument(0, 128), deviation = max(argument(1, 32), 0.1);
+			vector<double> weights(256);
+			for (int v = 0; v < 256; v++) {
+				// Levels past the ends are clamped, so the tails pile up on 0 and 255
+				double below = v == 0 ? 0 : 0.5 * erfc(-(v - 0.5 - mean) / (deviation * sqrt(2.0)));
+				double above = v == 255 ? 1 : 0.5 * erfc(-(v + 0.5 - mean) / (deviation * sqrt(2.0)));
+				weights[v] = above - below;
+			}
+			Table(weights);
+		}
+		else if (name == "single") {
+			distribution = Single;
+			vector<double> weights(256, 0);
+			weights[Level(argument(0, 128))] = 1;
+			Table(weights);
+		}
+		else if (name == "twospike") {
+			distribution = TwoSpike;
+			vector<double> weights(256, 0);
+			weights[Level(argument(0, 32))] += 1;
+			weights[Level(argument(1, 224))] += 1;
+			Table(weights);
+		}
+		else {
+			throw runtime_error("unknown distribution " + name + ", use uniform, gaussian, single, twospike, gradient or noise");
+		}
+	}
+
+	size_t Size() const {
+		return (size_t)width * height * channels;
+	}
+
+	// Bytes first to first + count - 1 of the image.
+	void Fill(unsigned char* bytes, size_t first, size_t count) const {
+		size_t i = first, end = first + count;
+		if (distribution == Single) {
+			memset(bytes, table[0], count);
+		}
+		else if (distribution == Uniform) {
+			// 97 is odd so i * 97 visits every level once in 256 steps, the i >> 8 moves each run of 256 along by one
+			while (i < end) {
+				size_t run = min(end, (i | 255) + 1);
+				unsigned char shift = (unsigned char)(i >> 8);
+				for (; i < run; i++) {
+					*bytes++ = (unsigned char)(i * 97 + shift);
+				}
+			}
+		}
+		else if (distribution == Gradient) {
+			while (i < end) {
+				size_t column = i % ramp.size(), span = min(end - i, ramp.size() - column);
+				memcpy(bytes, ramp.data() + column, span);
+				bytes += span;
+				i += span;
+			}
+		}
+		else {
+			// Four bytes from every 64 bit random number, the ends of the range can start or stop part way through one
+			for (; i < end && i % 4 != 0; i++) {
+				*bytes++ = table[(Random(i / 4) >> (16 * (i % 4))) & 0xFFFF];
+			}
+			for (; i + 4 <= end; i += 4) {
+				uint64_t random = Random(i / 4);
+				bytes[0] = table[random & 0xFFFF];
+				bytes[1] = table[(random >> 16) & 0xFFFF];
+				bytes[2] = table[(random >> 32) & 0xFFFF];
+				bytes[3] = table[random >> 48];
+				bytes += 4;
+			}
+			for (; i < end; i++) {
+				*bytes++ = table[(Random(i / 4) >> (16 * (i % 4))) & 0xFFFF];
+			}
+		}
+	}
+
+	// The same split between threads, each making at least 1MB.
+	void Fill(unsigned char* bytes, size_t first, size_t count, int threads) const {
+		threads = (int)min((size_t)max(1, threads), count / (1 << 20) + 1);
+		vector<thread> workers;
+		for (int t = 0; t < threads; t++) {
+			size_t from = count * t / threads, to = count * (t + 1) / threads;
+			workers.emplace_back([this, bytes, first, from, to]() { Fill(bytes + from, first + from, to - from); });
+		}
+		for (thread& worker : workers) {
+			worker.join();
+		}
+	}
+
+	// An in-memory P5 or P6 image.
+	Pnm Make() const {
+		Pnm image(width, height, channels);
+		Fill(image.Pixels(), 0, Size(), (int)thread::hardware_concurrency());
+		return image;
+	}
+
+	// Streams the image to a binary PGM or PPM file a chunk at a time, so it can be much larger than memory.
+	void Write(const string& filename, size_t chunk = 64 << 20) const {
+		FILE* file = fopen(filename.c_str(), "wb");
+		if (!file) {
+			throw runtime_error("cannot write " + filename);
+		}
+		string header = string(channels == 1 ? "P5" : "P6") + "\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+		bool written = fwrite(header.data(), 1, header.size(), file) == header.size();
+		vector<unsigned char> buffer(min(chunk, Size()));
+		for (size_t at = 0; written && at < Size(); at += buffer.size()) {
+			size_t count = min(buffer.size(), Size() - at);
+			Fill(buffer.data(), at, count, (int)thread::hardware_concurrency());
+			written = fwrite(buffer.data(), 1, count, file) == count;
+		}
+		if (fclose(file) != 0 || !written) {
+			throw runtime_error("cannot write " + filename);
+		}
+	}
+
+private:
+	vector<unsigned char> table; // a uniform 16 bit number to a level, for the random distributions
+	vector<unsigned char> ramp; // a row of the gradient
+
+	static int Level(double value) {
+		return (int)min(max(value, 0.0), 255.0);
+	}
+
+	// Lays the levels out in the table in proportion to their weights, so a uniform index picks them with those probabilities.
+	void Table(const vector<double>& weights) {
+		double total = 0, sum = 0;
+		for (double weight : weights) {
+			total += weight;
+		}
+		size_t at = 0;
+		for (int v = 0; v < 256; v++) {
+			sum += weights[v];
+			size_t to = v == 255 ? table.size() : (size_t)llround(sum / total * table.size());
+			for (; at < to; at++) {
+				table[at] = (unsigned char)v;
+			}
+		}
+	}
+
+	// splitmix64 of the seed and a counter
+	uint64_t Random(uint64_t counter) const {
+		uint64_t z = seed * 0xD1B54A32D192ED03ull + counter * 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+};
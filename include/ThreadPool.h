@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+using namespace std;
+
+// A fixed set of threads running posted work in the order it was posted. The destructor finishes the work
+// already posted before joining the threads.
+class ThreadPool {
+public:
+	// 0 threads means one per hardware thread.
+	ThreadPool(int threads = 0) {
+		int count = threads > 0 ? threads : max(1, (int)thread::hardware_concurrency());
+		for (int t = 0; t < count; t++) {
+			workers.emplace_back([this]() { Run(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		changed.notify_all();
+		for (thread& worker : workers) {
+			worker.join();
+		}
+	}
+
+	void Post(function<void()> work) {
+		{
+			lock_guard<mutex> guard(lock);
+			queue.push_back(move(work));
+		}
+		changed.notify_one();
+	}
+
+	int Size() const {
+		return (int)workers.size();
+	}
+
+private:
+	void Run() {
+		unique_lock<mutex> guard(lock);
+		while (true) {
+			changed.wait(guard, [this]() { return stopping || !queue.empty(); });
+			if (queue.empty()) {
+				return;
+			}
+			function<void()> work = move(queue.front());
+			queue.pop_front();
+			guard.unlock();
+			work();
+			guard.lock();
+		}
+	}
+
+	vector<thread> workers;
+	deque<function<void()>> queue;
+	mutex lock;
+	condition_variable changed;
+	bool stopping = false;
+};
@@ -128,6 +128,17 @@ void AddSources(cl::Program::Sources& sources, const string& file_name) {
 	sources.push_back((*source_code).c_str());
 }
 
+// Does the program have this kernel? The optional ones are only built when the device's compiler has the extension they need.
+bool HasKernel(const cl::Program& program, const string& name) {
+	stringstream names(program.getInfo<CL_PROGRAM_KERNEL_NAMES>());
+	for (string kernel; getline(names, kernel, ';');) {
+		if (kernel == name) {
+			return true;
+		}
+	}
+	return false;
+}
+
 string ListPlatformsDevices() {
 
 	stringstream sstream;
@@ -0,0 +1,76 @@
+#pragma once
+
+// C interface of the histogram equalisation library, for callers that hold decoded pixels in memory and for other languages.
+// Only plain C types cross it, so it stays the same however the C++ side (Equaliser.h, ImageView.h) changes.
+// Every function but histeq_create returns 0 on success or a negative OpenCL error code (-1 for other errors),
+// histeq_last_error describes the last failure on a handle.
+
+#include <stddef.h>
+
+// HISTEQ_STATIC is for programs that compile histeq.cpp in instead of linking the library (Verify).
+#if defined(HISTEQ_STATIC)
+#define HISTEQ_API
+#elif defined(_WIN32) && defined(HISTEQ_EXPORTS)
+#define HISTEQ_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define HISTEQ_API __declspec(dllimport)
+#else
+#define HISTEQ_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct histeq_equaliser histeq_equaliser;
+
+enum histeq_layout {
+	HISTEQ_PLANAR = 0, // one channel after another
+	HISTEQ_INTERLEAVED = 1 // the channels of a pixel next to each other
+};
+
+// Caller owned 8-bit pixels, pixel (x, y) of channel c is at data + y * row_pitch + x * (interleaved ? channels : 1) + c * channel_stride.
+// row_pitch is at least a row of pixels, and the planes of a planar view do not overlap (channel_stride is at least
+// row_pitch * (height - 1) + width). Views that break this, or have another layout, are refused with -1.
+typedef struct histeq_view {
+	unsigned char* data;
+	int width;
+	int height;
+	int channels;
+	size_t row_pitch;
+	size_t channel_stride; // 1 for interleaved
+	int layout; // a histeq_layout
+} histeq_view;
+
+// Called when a submitted image is done, with status 0 and its lookup table of bins entries, or a negative status and NULL.
+typedef void (*histeq_callback)(int status, const int* lut, int bins, void* user);
+
+// Creates an equaliser on an OpenCL device (see -l of the application), building the kernels in kernel_file
+// (NULL for kernels/my_kernels.cl). bins is 256 or a smaller power of 2. zero_copy != 0 uses the callers' buffers
+// in place through host pointer buffers. Returns NULL on failure, histeq_last_error(NULL) then says why (with the build
+// log if the kernels did not build). The handle is reused for any number of images.
+HISTEQ_API histeq_equaliser* histeq_create(int platform_id, int device_id, const char* kernel_file, int bins, int zero_copy);
+
+// Waits for submitted images and frees the handle.
+HISTEQ_API void histeq_destroy(histeq_equaliser* equaliser);
+
+// Equalises input into output (same size and channels, the layouts can differ) and waits for it. lut can be NULL,
+// otherwise it receives the lookup table (bins entries). It runs after the images already submitted to the handle and
+// can be called from any thread, errors of the submitted images are left for histeq_wait.
+HISTEQ_API int histeq_equalise(histeq_equaliser* equaliser, const histeq_view* input, const histeq_view* output, int* lut);
+
+// Starts equalising input into output and returns straight away, callback (can be NULL) runs on a library thread when it is done.
+// Both views have to stay valid until then. Images submitted to one handle are processed in order.
+HISTEQ_API int histeq_submit(histeq_equaliser* equaliser, const histeq_view* input, const histeq_view* output, histeq_callback callback, void* user);
+
+// Waits for every submitted image, returns the first error among them.
+HISTEQ_API int histeq_wait(histeq_equaliser* equaliser);
+
+// The message of the last failure on the handle, or with NULL of the last failed histeq_create on the calling thread.
+// The string belongs to the calling thread and stays valid until that thread calls histeq_last_error again, so it is
+// safe while other threads use the handle.
+HISTEQ_API const char* histeq_last_error(const histeq_equaliser* equaliser);
+
+#ifdef __cplusplus
+}
+#endif